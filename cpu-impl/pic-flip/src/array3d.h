@@ -5,16 +5,37 @@
 #include <cmath>
 #include <cstring>
 
-template<class T>
+// Storage layouts of Array3
+#define ARRAY3_LINEAR 0 // i + nx * (j + ny * k)
+#define ARRAY3_BRICK 1 // Bricks of 4x4x4 cells in linear order, Morton order within a brick
+
+#ifdef PICFLIP_BRICK_LAYOUT
+#define ARRAY3_LAYOUT ARRAY3_BRICK
+#else
+#define ARRAY3_LAYOUT ARRAY3_LINEAR
+#endif
+
+#define ARRAY3_BRICK_BITS 2 // log2 of the brick side, index() interleaves this many bits per axis
+
+//----------------------------------------------------------------------------//
+// 3D array, stored in the Layout chosen at compile time. In the brick layout 
+// the 8 corners of a cell lie in one brick of 64 elements unless the cell 
+// straddles a brick boundary, and the dimensions are padded to whole bricks.
+// Element wise operations see the padding, which stays zero. Code that needs
+// the linear layout, such as the voxel classification indexed by the 
+// pressure solve, asks for it explicitly.
+//----------------------------------------------------------------------------//
+template<class T, int Layout = ARRAY3_LAYOUT>
 struct Array3
 {
 	int nx, ny, nz;
+	int bx, by; // Number of bricks along x and y, brick layout only
 	int size;
 	T *data;
 
-	Array3() :nx(0), ny(0), nz(0), size(0), data(0) {}
+	Array3() :nx(0), ny(0), nz(0), bx(0), by(0), size(0), data(0) {}
 
-	Array3(int nx_, int ny_, int nz_) : nx(0), ny(0), nz(0), size(0), data(0) 
+	Array3(int nx_, int ny_, int nz_) : nx(0), ny(0), nz(0), bx(0), by(0), size(0), data(0) 
 	{ 
 		init(nx_,ny_,nz_); 
 	}
@@ -23,7 +44,15 @@ struct Array3
 	{
 		delete_memory();
 		nx = nx_; ny = ny_; nz = nz_;
-		size = nx * ny * nz;
+		if (Layout == ARRAY3_BRICK)
+		{
+			const int side = 1 << ARRAY3_BRICK_BITS;
+			bx = (nx + side - 1) >> ARRAY3_BRICK_BITS;
+			by = (ny + side - 1) >> ARRAY3_BRICK_BITS;
+			size = bx * by * ((nz + side - 1) >> ARRAY3_BRICK_BITS) * side * side * side;
+		}
+		else
+			size = nx * ny * nz;
 		data = new T[size];
 		zero();
 	}
@@ -36,26 +65,75 @@ struct Array3
 	void delete_memory()
 	{
 		delete[] data; data=0;
-		nx = ny = nz = size =0;
+		nx = ny = nz = bx = by = size =0;
+	}
+
+	// Position of element (i, j, k) in data, the sum of one term per axis. In the 
+	// brick layout every term holds the brick offset and the Morton bits of its 
+	// axis, which do not overlap those of the other axes.
+	int index_x(int i) const
+	{
+		if (Layout == ARRAY3_LINEAR)
+			return i;
+		return ((i >> ARRAY3_BRICK_BITS) << (3 * ARRAY3_BRICK_BITS)) | (i & 1) | ((i & 2) << 2);
+	}
+
+	int index_y(int j) const
+	{
+		if (Layout == ARRAY3_LINEAR)
+			return nx * j;
+		return (((j >> ARRAY3_BRICK_BITS) * bx) << (3 * ARRAY3_BRICK_BITS)) | ((j & 1) << 1) | ((j & 2) << 3);
+	}
+
+	int index_z(int k) const
+	{
+		if (Layout == ARRAY3_LINEAR)
+			return nx * ny * k;
+		return (((k >> ARRAY3_BRICK_BITS) * bx * by) << (3 * ARRAY3_BRICK_BITS)) | ((k & 1) << 2) | ((k & 2) << 4);
+	}
+
+	int index(int i, int j, int k) const
+	{
+		return index_x(i) + index_y(j) + index_z(k);
 	}
 
 	const T &operator() (int i, int j, int k) const
 	{ 
-		return data[i + nx * (j + k * ny)]; 
+		return data[index(i, j, k)]; 
 	}
 
 	T &operator() (int i, int j, int k)
 	{ 
-		return data[i + nx * (j + k * ny)]; 
+		return data[index(i, j, k)]; 
 	}
 
-	T trilerp(int i, int j, int k, T fx, T fy, T fz)
+	T trilerp(int i, int j, int k, T fx, T fy, T fz) const
 	{ 
-		T fval = (1 - fx) * ((1 - fy) * (*this)(i, j, k) + fy * (*this)(i, j + 1, k)) + fx * ((1 - fy) * (*this)(i + 1, j, k) + fy * (*this)(i + 1, j + 1, k)); 
-		T bval = (1 - fx) * ((1 - fy) * (*this)(i, j, k + 1) + fy * (*this)(i, j + 1, k + 1)) + fx * ((1 - fy) * (*this)(i + 1, j, k + 1) + fy * (*this)(i + 1, j + 1, k + 1)); 
+		const int x0 = index_x(i), x1 = index_x(i + 1);
+		const int y0 = index_y(j), y1 = index_y(j + 1);
+		const int z0 = index_z(k), z1 = index_z(k + 1);
+
+		T fval = (1 - fx) * ((1 - fy) * data[x0 + y0 + z0] + fy * data[x0 + y1 + z0]) + fx * ((1 - fy) * data[x1 + y0 + z0] + fy * data[x1 + y1 + z0]); 
+		T bval = (1 - fx) * ((1 - fy) * data[x0 + y0 + z1] + fy * data[x0 + y1 + z1]) + fx * ((1 - fy) * data[x1 + y0 + z1] + fy * data[x1 + y1 + z1]); 
 		return (1 - fz) * fval + fz * bval;		
 	}
 
+	// trilerp of this array and of b, of the same size, in one walk over the corners
+	void trilerp2(const Array3 &b, int i, int j, int k, T fx, T fy, T fz, T &ra, T &rb) const
+	{
+		const int x0 = index_x(i), x1 = index_x(i + 1);
+		const int y0 = index_y(j), y1 = index_y(j + 1);
+		const int z0 = index_z(k), z1 = index_z(k + 1);
+		const T *a = data, *d = b.data;
+
+		T fval = (1 - fx) * ((1 - fy) * a[x0 + y0 + z0] + fy * a[x0 + y1 + z0]) + fx * ((1 - fy) * a[x1 + y0 + z0] + fy * a[x1 + y1 + z0]);
+		T dfval = (1 - fx) * ((1 - fy) * d[x0 + y0 + z0] + fy * d[x0 + y1 + z0]) + fx * ((1 - fy) * d[x1 + y0 + z0] + fy * d[x1 + y1 + z0]);
+		T bval = (1 - fx) * ((1 - fy) * a[x0 + y0 + z1] + fy * a[x0 + y1 + z1]) + fx * ((1 - fy) * a[x1 + y0 + z1] + fy * a[x1 + y1 + z1]);
+		T dbval = (1 - fx) * ((1 - fy) * d[x0 + y0 + z1] + fy * d[x0 + y1 + z1]) + fx * ((1 - fy) * d[x1 + y0 + z1] + fy * d[x1 + y1 + z1]);
+		ra = (1 - fz) * fval + fz * bval;
+		rb = (1 - fz) * dfval + fz * dbval;
+	}
+
 	void copy_to(Array3 &a) const
 	{ 
 		std::memcpy(a.data, data, size * sizeof(T)); 
@@ -101,6 +179,6 @@ struct Array3
 
 typedef Array3<float> Array3f;
 typedef Array3<double> Array3d;
-typedef Array3<char> Array3c;
+typedef Array3<char, ARRAY3_LINEAR> Array3c; // Shares the linear cell index of the pressure solve
 
 #endif
@@ -0,0 +1,543 @@
+//----------------------------------------------------------------------------//
+// Headless batch driver: runs the solver without a window or GL context
+//----------------------------------------------------------------------------//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "exporter.h"
+#include "fluid_solver.h"
+#include "parallel.h"
+#include "simd.h"
+
+struct BatchOptions
+{
+	int dimx = 100, dimy = 78, dimz = 64;
+	float gridh = 0.1f;
+	int maxparticles = 30000 * 8;
+	int frames = 100;
+	float timestep = 1.0f / 30.0f;
+	float gravity = 9.82f;
+	float rho = 1.0f;
+	unsigned int seed = 0;
+	int threads = 0; // 0 uses the OpenMP default
+	int precond = PRECOND_MIC0;
+	int simd = -1; // -1 uses the best supported level
+	int precision = SOLVER_DOUBLE;
+	int poisson = POISSON_MATRIX_FREE;
+	bool warm_start = false;
+	int max_iterations = SOLVE_MAX_ITERATIONS;
+	float divergence_target = 0.0f; // Volume fraction per frame, 0 for only the relative tolerance
+	int sort_interval = 10;
+	int advection = ADVECT_EULER;
+	float advect_cfl = ADVECT_CFL;
+	float narrow_band = 0.0f; // Width in cells, 0 keeps the particles everywhere
+	int reseed_min = 0, reseed_target = RESEED_TARGET, reseed_max = 0; // Particles per cell, 0 disables
+	std::vector<Emitter> emitters;
+	std::vector<Region> sinks;
+	bool empty = false; // Start without the dam break boxes
+	bool haveseed = false;
+	std::string output; // Prefix of the per frame output files, empty for none
+	int formats = EXPORT_RAW;
+	bool quantize = false;
+	bool compress = false;
+	std::string profile; // Prefix of the profile files, empty for none
+	std::string checkpoint; // Prefix of the checkpoint files, empty for none
+	int checkpoint_every = 10;
+	std::string restart; // Checkpoint to continue from
+	int every = 1;
+	bool quiet = false;
+	bool hash = false;
+};
+
+static void usage(const char *prog)
+{
+	std::cout << "Usage: " << prog << " [options]\n"
+		<< "  --dims X Y Z       grid resolution (default 100 78 64)\n"
+		<< "  --h H              grid cell size (default 0.1)\n"
+		<< "  --particles N      maximum number of particles (default 240000)\n"
+		<< "  --frames N         number of frames to simulate (default 100)\n"
+		<< "  --dt T             frame time step (default 1/30)\n"
+		<< "  --gravity G        gravity (default 9.82)\n"
+		<< "  --rho R            fluid density (default 1)\n"
+		<< "  --threads N        number of solver threads (default: all cores)\n"
+		<< "  --precond P        mic0, wavefront or multigrid (default mic0)\n"
+		<< "  --precision P      double or mixed (float PCG with double refinement) pressure solve (default double)\n"
+		<< "  --poisson P        stencil (matrix free) or matrix Poisson operator (default stencil)\n"
+		<< "  --warm-start       start each pressure solve from the pressure of the last step\n"
+		<< "  --max-iterations N PCG iterations per pressure solve (default 100)\n"
+		<< "  --divergence-target F\n"
+		<< "                     also stop the pressure solve once no cell is left to change its\n"
+		<< "                     volume by more than the fraction F per frame (default 0, off)\n"
+		<< "  --simd S           scalar, avx2 or avx512 vector kernels (default: best supported)\n"
+		<< "  --advect A         euler (5 fixed steps), rk2 or rk3 (adaptive steps per particle)\n"
+		<< "                     particle advection (default euler)\n"
+		<< "  --advect-cfl C     cells a particle may move per rk2 or rk3 step (default 1)\n"
+		<< "  --sort-every N     sort the particles by cell every N:th step, 0 never (default 10)\n"
+		<< "  --narrow-band W    only keep particles within W cells of the surface, a level set\n"
+		<< "                     holds the interior (default 0, off)\n"
+		<< "  --reseed MIN T MAX seed liquid cells with fewer than MIN particles and thin cells with\n"
+		<< "                     more than MAX to T particles per cell, 0 disables either (default off)\n"
+		<< "  --emit-box X0 Y0 Z0 X1 Y1 Z1 VX VY VZ RATE\n"
+		<< "                     emit RATE particles per second in a box with velocity V\n"
+		<< "  --emit-sphere X Y Z R VX VY VZ RATE\n"
+		<< "                     emit RATE particles per second in a sphere with velocity V\n"
+		<< "  --inflow X0 Y0 Z0 X1 Y1 Z1 VX VY VZ RATE\n"
+		<< "                     inflow through a rectangle, flat along one axis, RATE 0 derives\n"
+		<< "                     the rate from the flux at 8 particles per cell\n"
+		<< "  --sink-box X0 Y0 Z0 X1 Y1 Z1, --sink-sphere X Y Z R\n"
+		<< "                     delete the particles that enter the region\n"
+		<< "  --empty            start without the dam break boxes, for emitter scenes\n"
+		<< "  --seed S           seed for the initial particle jitter (default: time)\n"
+		<< "  --output PREFIX    write frames to PREFIX_NNNN.<format> in the background\n"
+		<< "  --every N          write every N:th frame (default 1)\n"
+		<< "  --format F,...     raw (.bin particles), ply (.ply particles), volume (.vol dense grid)\n"
+		<< "                     and sparse (.svol fluid cells only) (default raw)\n"
+		<< "  --quantize         write particle positions as 16 bit fixed point (.qbin)\n"
+		<< "  --compress         LZ4 compress the written files (.lz)\n"
+		<< "  --checkpoint PREFIX  write checkpoints to PREFIX_NNNN.chk in the background\n"
+		<< "  --checkpoint-every N checkpoint every N:th frame (default 10)\n"
+		<< "  --restart FILE     continue from a checkpoint up to frame --frames, its grid and\n"
+		<< "                     physical parameters replace --dims, --h, --dt, --gravity, --rho\n"
+		<< "                     and --narrow-band\n"
+		<< "  --profile PREFIX   time the solver stages, write PREFIX.csv, PREFIX.json and PREFIX.trace.json\n"
+		<< "  --hash             print a hash of the final particle state\n"
+		<< "  --quiet            only print the summary\n";
+}
+
+static vec3f read_vec3(char **argv, int &a)
+{
+	float x = (float)atof(argv[++a]);
+	float y = (float)atof(argv[++a]);
+	float z = (float)atof(argv[++a]);
+	return vec3f(x, y, z);
+}
+
+static bool parse_args(int argc, char **argv, BatchOptions &opt)
+{
+	for (int a = 1; a < argc; ++a)
+	{
+		std::string arg = argv[a];
+		int left = argc - a - 1;
+
+		if (arg == "--dims" && left >= 3)
+		{
+			opt.dimx = atoi(argv[++a]);
+			opt.dimy = atoi(argv[++a]);
+			opt.dimz = atoi(argv[++a]);
+		}
+		else if (arg == "--h" && left >= 1)
+			opt.gridh = (float)atof(argv[++a]);
+		else if (arg == "--particles" && left >= 1)
+			opt.maxparticles = atoi(argv[++a]);
+		else if (arg == "--frames" && left >= 1)
+			opt.frames = atoi(argv[++a]);
+		else if (arg == "--dt" && left >= 1)
+			opt.timestep = (float)atof(argv[++a]);
+		else if (arg == "--gravity" && left >= 1)
+			opt.gravity = (float)atof(argv[++a]);
+		else if (arg == "--rho" && left >= 1)
+			opt.rho = (float)atof(argv[++a]);
+		else if (arg == "--threads" && left >= 1)
+			opt.threads = atoi(argv[++a]);
+		else if (arg == "--precond" && left >= 1)
+		{
+			std::string mode = argv[++a];
+			if (mode == "mic0")
+				opt.precond = PRECOND_MIC0;
+			else if (mode == "wavefront")
+				opt.precond = PRECOND_MIC0_WAVEFRONT;
+			else if (mode == "multigrid")
+				opt.precond = PRECOND_MULTIGRID;
+			else
+			{
+				std::cerr << "Unknown preconditioner: " << mode << "\n";
+				return false;
+			}
+		}
+		else if (arg == "--advect" && left >= 1)
+		{
+			std::string scheme = argv[++a];
+			if (scheme == "euler")
+				opt.advection = ADVECT_EULER;
+			else if (scheme == "rk2")
+				opt.advection = ADVECT_RK2;
+			else if (scheme == "rk3")
+				opt.advection = ADVECT_RK3;
+			else
+			{
+				std::cerr << "Unknown advection: " << scheme << "\n";
+				return false;
+			}
+		}
+		else if (arg == "--advect-cfl" && left >= 1)
+			opt.advect_cfl = (float)atof(argv[++a]);
+		else if (arg == "--precision" && left >= 1)
+		{
+			std::string precision = argv[++a];
+			if (precision == "double")
+				opt.precision = SOLVER_DOUBLE;
+			else if (precision == "mixed")
+				opt.precision = SOLVER_MIXED;
+			else
+			{
+				std::cerr << "Unknown precision: " << precision << "\n";
+				return false;
+			}
+		}
+		else if (arg == "--poisson" && left >= 1)
+		{
+			std::string poisson = argv[++a];
+			if (poisson == "stencil")
+				opt.poisson = POISSON_MATRIX_FREE;
+			else if (poisson == "matrix")
+				opt.poisson = POISSON_MATRIX;
+			else
+			{
+				std::cerr << "Unknown Poisson operator: " << poisson << "\n";
+				return false;
+			}
+		}
+		else if (arg == "--warm-start")
+			opt.warm_start = true;
+		else if (arg == "--max-iterations" && left >= 1)
+			opt.max_iterations = atoi(argv[++a]);
+		else if (arg == "--divergence-target" && left >= 1)
+			opt.divergence_target = (float)atof(argv[++a]);
+		else if (arg == "--simd" && left >= 1)
+		{
+			std::string level = argv[++a];
+			if (level == "scalar")
+				opt.simd = SIMD_SCALAR;
+			else if (level == "avx2")
+				opt.simd = SIMD_AVX2;
+			else if (level == "avx512")
+				opt.simd = SIMD_AVX512;
+			else
+			{
+				std::cerr << "Unknown instruction set: " << level << "\n";
+				return false;
+			}
+		}
+		else if (arg == "--sort-every" && left >= 1)
+			opt.sort_interval = atoi(argv[++a]);
+		else if (arg == "--narrow-band" && left >= 1)
+			opt.narrow_band = (float)atof(argv[++a]);
+		else if ((arg == "--emit-box" || arg == "--inflow") && left >= 10)
+		{
+			vec3f lo = read_vec3(argv, a), hi = read_vec3(argv, a);
+			vec3f vel = read_vec3(argv, a);
+			float rate = (float)atof(argv[++a]);
+			opt.emitters.push_back(Emitter(arg == "--inflow" ? plane_region(lo, hi) : box_region(lo, hi), vel, rate));
+		}
+		else if (arg == "--emit-sphere" && left >= 8)
+		{
+			vec3f centre = read_vec3(argv, a);
+			float radius = (float)atof(argv[++a]);
+			vec3f vel = read_vec3(argv, a);
+			float rate = (float)atof(argv[++a]);
+			opt.emitters.push_back(Emitter(sphere_region(centre, radius), vel, rate));
+		}
+		else if (arg == "--sink-box" && left >= 6)
+		{
+			vec3f lo = read_vec3(argv, a), hi = read_vec3(argv, a);
+			opt.sinks.push_back(box_region(lo, hi));
+		}
+		else if (arg == "--sink-sphere" && left >= 4)
+		{
+			vec3f centre = read_vec3(argv, a);
+			float radius = (float)atof(argv[++a]);
+			opt.sinks.push_back(sphere_region(centre, radius));
+		}
+		else if (arg == "--empty")
+			opt.empty = true;
+		else if (arg == "--reseed" && left >= 3)
+		{
+			opt.reseed_min = atoi(argv[++a]);
+			opt.reseed_target = atoi(argv[++a]);
+			opt.reseed_max = atoi(argv[++a]);
+		}
+		else if (arg == "--seed" && left >= 1)
+		{
+			opt.seed = (unsigned int)strtoul(argv[++a], NULL, 10);
+			opt.haveseed = true;
+		}
+		else if (arg == "--output" && left >= 1)
+			opt.output = argv[++a];
+		else if (arg == "--every" && left >= 1)
+			opt.every = atoi(argv[++a]);
+		else if (arg == "--format" && left >= 1)
+		{
+			std::string list = argv[++a];
+			opt.formats = 0;
+			for (size_t begin = 0, end; begin <= list.size(); begin = end + 1)
+			{
+				end = list.find(',', begin);
+				if (end == std::string::npos)
+					end = list.size();
+				std::string format = list.substr(begin, end - begin);
+				if (format == "raw")
+					opt.formats |= EXPORT_RAW;
+				else if (format == "ply")
+					opt.formats |= EXPORT_PLY;
+				else if (format == "volume")
+					opt.formats |= EXPORT_VOLUME;
+				else if (format == "sparse")
+					opt.formats |= EXPORT_SPARSE_VOLUME;
+				else
+				{
+					std::cerr << "Unknown output format: " << format << "\n";
+					return false;
+				}
+			}
+		}
+		else if (arg == "--quantize")
+			opt.quantize = true;
+		else if (arg == "--compress")
+			opt.compress = true;
+		else if (arg == "--checkpoint" && left >= 1)
+			opt.checkpoint = argv[++a];
+		else if (arg == "--checkpoint-every" && left >= 1)
+			opt.checkpoint_every = atoi(argv[++a]);
+		else if (arg == "--restart" && left >= 1)
+			opt.restart = argv[++a];
+		else if (arg == "--profile" && left >= 1)
+			opt.profile = argv[++a];
+		else if (arg == "--hash")
+			opt.hash = true;
+		else if (arg == "--quiet")
+			opt.quiet = true;
+		else
+		{
+			std::cerr << "Unknown or incomplete option: " << arg << "\n";
+			return false;
+		}
+	}
+
+	if (opt.dimx < 3 || opt.dimy < 3 || opt.dimz < 3 || opt.gridh <= 0.0f || opt.frames < 0 || opt.timestep <= 0.0f || opt.every < 1 || opt.threads < 0 || opt.sort_interval < 0 || !(opt.advect_cfl > 0.0f) || opt.narrow_band < 0.0f || opt.checkpoint_every < 1 ||
+		opt.reseed_min < 0 || opt.reseed_target < opt.reseed_min || (opt.reseed_max > 0 && opt.reseed_max < opt.reseed_target) || opt.reseed_target < 1)
+	{
+		std::cerr << "Invalid option value\n";
+		return false;
+	}
+
+	std::vector<Region> regions(opt.sinks);
+	for (size_t e = 0; e < opt.emitters.size(); ++e)
+	{
+		if (opt.emitters[e].rate < 0.0f)
+		{
+			std::cerr << "Invalid emitter rate\n";
+			return false;
+		}
+		regions.push_back(opt.emitters[e].region);
+	}
+	for (size_t r = 0; r < regions.size(); ++r)
+	{
+		const Region &region = regions[r];
+		if (region.hi.v[0] < region.lo.v[0] || region.hi.v[1] < region.lo.v[1] || region.hi.v[2] < region.lo.v[2] || region.radius < 0.0f)
+		{
+			std::cerr << "Invalid emitter or sink region\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------//
+// Writes the profile files and prints the mean stage times per frame
+//----------------------------------------------------------------------------//
+static bool write_profile(const std::string &prefix, const Profiler &profiler)
+{
+	if (!profiler.write_csv(prefix + ".csv") || !profiler.write_json(prefix + ".json") || !profiler.write_trace(prefix + ".trace.json"))
+	{
+		std::cerr << "Could not write the profile " << prefix << "\n";
+		return false;
+	}
+
+	size_t n = profiler.frames.size();
+	if (n == 0)
+		return true;
+
+	double total = 0.0;
+	int iterations = 0, substeps = 0;
+	for (size_t f = 0; f < n; ++f)
+	{
+		total += profiler.frames[f].total_ms;
+		iterations += profiler.frames[f].cg_iterations;
+		substeps += profiler.frames[f].substeps;
+	}
+
+	printf("Stage          ms/frame       %%\n");
+	for (int s = 0; s < STAGE_COUNT; ++s)
+	{
+		double ms = 0.0;
+		for (size_t f = 0; f < n; ++f)
+			ms += profiler.frames[f].stage_ms[s];
+		printf("%-12s %10.3f %7.1f\n", stage_names[s], ms / n, total > 0.0 ? 100.0 * ms / total : 0.0);
+	}
+	printf("%.2f substeps and %.1f CG iterations per frame\n", (double)substeps / n, (double)iterations / n);
+	return true;
+}
+
+static std::string checkpoint_path(const std::string &prefix, int frame)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "_%04d.chk", frame);
+	return prefix + name;
+}
+
+static unsigned long long fnv1a(const void *data, size_t size, unsigned long long h)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		h ^= bytes[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+int main(int argc, char **argv)
+{
+	BatchOptions opt;
+	for (int a = 1; a < argc; ++a)
+	{
+		if (!strcmp(argv[a], "--help") || !strcmp(argv[a], "-h"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	if (!parse_args(argc, argv, opt))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	set_num_threads(opt.threads);
+	if (opt.simd >= 0 && !simd_set_level(opt.simd))
+	{
+		std::cerr << "The " << simd_name(opt.simd) << " kernels are not supported on this machine\n";
+		return 1;
+	}
+
+	Checkpoint_Header restart;
+	if (!opt.restart.empty())
+	{
+		if (!read_checkpoint_header(opt.restart, restart))
+			return 1;
+		opt.dimx = restart.dimx; opt.dimy = restart.dimy; opt.dimz = restart.dimz;
+		opt.gridh = restart.h;
+		opt.timestep = restart.timestep;
+		opt.gravity = restart.gravity;
+		opt.rho = restart.rho;
+	}
+
+	FluidSolver fluid_solver(opt.dimx, opt.dimy, opt.dimz, opt.gridh, opt.timestep, opt.gravity, opt.rho, opt.maxparticles);
+	fluid_solver.grid.cg.precond_mode = opt.precond;
+	fluid_solver.grid.precision = opt.precision;
+	fluid_solver.grid.poisson_mode = opt.poisson;
+	fluid_solver.grid.warm_start = opt.warm_start;
+	fluid_solver.solve_iterations = opt.max_iterations;
+	fluid_solver.divergence_target = opt.divergence_target;
+	fluid_solver.sort_interval = opt.sort_interval;
+	fluid_solver.advection = opt.advection;
+	fluid_solver.advect_cfl = opt.advect_cfl;
+	fluid_solver.band.width = opt.narrow_band;
+	fluid_solver.reseed.min_count = opt.reseed_min;
+	fluid_solver.reseed.target = opt.reseed_target;
+	fluid_solver.reseed.max_count = opt.reseed_max;
+	fluid_solver.emitters = opt.emitters;
+	fluid_solver.sinks = opt.sinks;
+	if (!opt.profile.empty())
+		fluid_solver.profiler.enable(true);
+	if (!opt.restart.empty())
+	{
+		if (!load_checkpoint(fluid_solver, opt.restart))
+			return 1;
+	}
+	else
+	{
+		if (opt.haveseed)
+			fluid_solver.seed = opt.seed;
+		if (opt.empty)
+			fluid_solver.rng.seed(fluid_solver.seed); // As init_box, for the emitters
+		else
+			fluid_solver.init_box();
+	}
+
+	std::cout << "Grid " << opt.dimx << "x" << opt.dimy << "x" << opt.dimz << ", h = " << opt.gridh
+		<< ", particles: " << fluid_solver.particles.currnp << ", seed: " << fluid_solver.seed << ", threads: " << max_threads()
+		<< ", simd: " << simd_name(simd_level()) << std::endl;
+	if (!opt.restart.empty())
+		std::cout << "Restarting from frame " << fluid_solver.frame << std::endl;
+
+	Export_Options export_options;
+	export_options.prefix = opt.output;
+	export_options.formats = opt.formats;
+	export_options.every = opt.every;
+	export_options.quantize = opt.quantize;
+	export_options.compress = opt.compress;
+	Frame_Exporter exporter;
+	exporter.init(export_options);
+
+	int first = fluid_solver.frame + 1;
+	if (opt.restart.empty())
+		exporter.submit(fluid_solver);
+
+	Checkpoint_Writer checkpoints;
+
+	typedef std::chrono::steady_clock clock;
+	clock::time_point start = clock::now();
+
+	for (int f = first; f <= opt.frames; ++f)
+	{
+		clock::time_point t0 = clock::now();
+		fluid_solver.step_frame();
+		double ms = std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+
+		if (!opt.quiet)
+			std::cout << "Frame " << f << ": " << fluid_solver.particles.currnp << " particles, " << ms << " ms" << std::endl;
+
+		exporter.submit(fluid_solver);
+
+		if (!opt.checkpoint.empty() && f % opt.checkpoint_every == 0)
+			checkpoints.write(fluid_solver, checkpoint_path(opt.checkpoint, f));
+	}
+
+	bool written = exporter.wait();
+	if (!checkpoints.wait() || !written)
+		return 1;
+
+	int frames = max(0, opt.frames - first + 1);
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+	std::cout << frames << " frames in " << seconds << " s";
+	if (frames > 0)
+		std::cout << " (" << 1000.0 * seconds / frames << " ms/frame)";
+	std::cout << std::endl;
+
+	if (!opt.profile.empty() && !write_profile(opt.profile, fluid_solver.profiler))
+		return 1;
+
+	if (opt.hash)
+	{
+		const Particles &p = fluid_solver.particles;
+		unsigned long long h = 14695981039346656037ULL;
+		if (p.currnp > 0)
+		{
+			std::vector<vec3f> buf(p.currnp);
+			p.copy_positions(&buf[0]);
+			h = fnv1a(&buf[0], buf.size() * sizeof(vec3f), h);
+			p.copy_velocities(&buf[0]);
+			h = fnv1a(&buf[0], buf.size() * sizeof(vec3f), h);
+		}
+		printf("Hash: %016llx\n", h);
+	}
+
+	return 0;
+}
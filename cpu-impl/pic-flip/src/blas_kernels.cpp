@@ -0,0 +1,147 @@
+#include "blas_kernels.h"
+#include "simd.h"
+
+#include <cmath>
+
+template<class T>
+static void axpy_scalar(T *y, const T *x, double a, const int *begin, const int *end, int nruns)
+{
+	for (int run = 0; run < nruns; ++run)
+		for (int n = begin[run]; n < end[run]; ++n)
+			y[n] = (T)(y[n] + a * x[n]);
+}
+
+template<class T>
+static void xpby_scalar(T *y, const T *x, double b, const int *begin, const int *end, int nruns)
+{
+	for (int run = 0; run < nruns; ++run)
+		for (int n = begin[run]; n < end[run]; ++n)
+			y[n] = (T)(x[n] + b * y[n]);
+}
+
+template<class T>
+static void dot_scalar(const T *x, const T *y, const int *begin, const int *end, int nruns, double *lanes)
+{
+	for (int run = 0; run < nruns; ++run)
+		for (int n = begin[run]; n < end[run]; ++n)
+			lanes[(n - begin[run]) % BLAS_LANES] += (double)x[n] * y[n];
+}
+
+template<class T>
+static double absmax_scalar(const T *x, const int *begin, const int *end, int nruns, double m)
+{
+	for (int run = 0; run < nruns; ++run)
+		for (int n = begin[run]; n < end[run]; ++n)
+			if (!(std::fabs((double)x[n]) <= m))
+				m = std::fabs((double)x[n]);
+	return m;
+}
+
+template<class T>
+static double update_xr_scalar(T *x, const T *d, T *r, const T *q, double alpha,
+	const int *begin, const int *end, int nruns, double *lanes, double m)
+{
+	for (int run = 0; run < nruns; ++run)
+		for (int n = begin[run]; n < end[run]; ++n)
+		{
+			double rn = r[n] - alpha * q[n];
+			x[n] = (T)(x[n] + alpha * d[n]);
+			r[n] = (T)rn;
+			lanes[(n - begin[run]) % BLAS_LANES] += rn * rn;
+			if (!(std::fabs(rn) <= m))
+				m = std::fabs(rn);
+		}
+	return m;
+}
+
+template<class T>
+static void stencil_dot_scalar(const T *a, const T *x, T *y, int sy, int sz,
+	const int *begin, const int *end, int nruns, double *lanes)
+{
+	for (int run = 0; run < nruns; ++run)
+		for (int n = begin[run]; n < end[run]; ++n)
+		{
+			double sum = (double)a[4 * n] * x[n];     // i, j, k
+
+			sum += (double)a[4 * n + 1] * x[n + 1];  // i + 1, j, k
+			sum += (double)a[4 * n + 2] * x[n + sy]; // i, j + 1, k
+			sum += (double)a[4 * n + 3] * x[n + sz]; // i, j, k + 1
+
+			sum += (double)a[4 * (n - 1) + 1] * x[n - 1];   // i - 1, j, k
+			sum += (double)a[4 * (n - sy) + 2] * x[n - sy]; // i, j - 1, k
+			sum += (double)a[4 * (n - sz) + 3] * x[n - sz]; // i, j, k - 1
+
+			y[n] = (T)sum;
+			lanes[(n - begin[run]) % BLAS_LANES] += x[n] * sum;
+		}
+}
+
+template<class T>
+static void stencil_mf_dot_scalar(const char *m, const double *diag, double offdiag, const T *x, T *y, int sy, int sz,
+	const int *begin, const int *end, int nruns, double *lanes)
+{
+	for (int run = 0; run < nruns; ++run)
+		for (int n = begin[run]; n < end[run]; ++n)
+		{
+			double sum = blas_stencil_mf_row(m, diag, offdiag, x, n, sy, sz);
+			y[n] = (T)sum;
+			lanes[(n - begin[run]) % BLAS_LANES] += x[n] * sum;
+		}
+}
+
+const Blas_Kernels blas_kernels_scalar =
+{
+	axpy_scalar<double>,
+	xpby_scalar<double>,
+	dot_scalar<double>,
+	absmax_scalar<double>,
+	update_xr_scalar<double>,
+	stencil_dot_scalar<double>,
+	stencil_mf_dot_scalar<double>
+};
+
+const Blas_Kernelsf blas_kernelsf_scalar =
+{
+	axpy_scalar<float>,
+	xpby_scalar<float>,
+	dot_scalar<float>,
+	absmax_scalar<float>,
+	update_xr_scalar<float>,
+	stencil_dot_scalar<float>,
+	stencil_mf_dot_scalar<float>
+};
+
+template<>
+const Blas_Kernels &blas_kernels<double>()
+{
+	switch (simd_level())
+	{
+#ifdef PICFLIP_SIMD_AVX512
+	case SIMD_AVX512: return blas_kernels_avx512;
+#endif
+#ifdef PICFLIP_SIMD_AVX2
+	case SIMD_AVX2: return blas_kernels_avx2;
+#endif
+	default: return blas_kernels_scalar;
+	}
+}
+
+template<>
+const Blas_Kernelsf &blas_kernels<float>()
+{
+	switch (simd_level())
+	{
+#ifdef PICFLIP_SIMD_AVX512
+	case SIMD_AVX512: return blas_kernelsf_avx512;
+#endif
+#ifdef PICFLIP_SIMD_AVX2
+	case SIMD_AVX2: return blas_kernelsf_avx2;
+#endif
+	default: return blas_kernelsf_scalar;
+	}
+}
+
+double blas_reduce_lanes(const double *lanes)
+{
+	return ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) + ((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+}
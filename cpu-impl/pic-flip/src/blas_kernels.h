@@ -0,0 +1,92 @@
+#pragma once
+#ifndef BLAS_KERNELS_H_
+#define BLAS_KERNELS_H_
+
+//----------------------------------------------------------------------------//
+// Vector kernels of the CG solver, one implementation per instruction set. 
+// Every kernel walks a list of runs of linear indices [begin[n], end[n]). 
+// Reductions accumulate into BLAS_LANES partial sums, element t of a run goes 
+// to lane t % BLAS_LANES, and products and sums are never fused. All versions 
+// therefore produce bitwise identical results. The float kernels compute in 
+// double and round the stored results to float.
+//----------------------------------------------------------------------------//
+
+#define BLAS_LANES 8
+
+#define AIRCELL 0
+#define FLUIDCELL 1
+#define SOLIDCELL 2
+
+template<class T>
+struct Blas_KernelsT
+{
+	// y = y + a * x
+	void(*axpy)(T *y, const T *x, double a, const int *begin, const int *end, int nruns);
+
+	// y = x + b * y
+	void(*xpby)(T *y, const T *x, double b, const int *begin, const int *end, int nruns);
+
+	// lanes += x * y
+	void(*dot)(const T *x, const T *y, const int *begin, const int *end, int nruns, double *lanes);
+
+	// Returns max(m, |x|)
+	double(*absmax)(const T *x, const int *begin, const int *end, int nruns, double m);
+
+	// x = x + alpha * d, r = r - alpha * q, lanes += r * r, returns max(m, |r|)
+	double(*update_xr)(T *x, const T *d, T *r, const T *q, double alpha,
+		const int *begin, const int *end, int nruns, double *lanes, double m);
+
+	// y = A * x for the 7-point matrix A (4 coefficients per cell, strides sy 
+	// and sz in cells), lanes += x * y
+	void(*stencil_dot)(const T *a, const T *x, T *y, int sy, int sz,
+		const int *begin, const int *end, int nruns, double *lanes);
+
+	// The same for the matrix free stencil of the voxel classification m: 
+	// diag[c] on the diagonal of a cell with c non-solid neighbours, offdiag 
+	// towards fluid neighbours. All cells of the runs must be fluid.
+	void(*stencil_mf_dot)(const char *m, const double *diag, double offdiag, const T *x, T *y, int sy, int sz,
+		const int *begin, const int *end, int nruns, double *lanes);
+};
+
+typedef Blas_KernelsT<double> Blas_Kernels;
+typedef Blas_KernelsT<float> Blas_Kernelsf;
+
+// The kernels of the active simd_level()
+template<class T> const Blas_KernelsT<T> &blas_kernels();
+template<> const Blas_Kernels &blas_kernels<double>();
+template<> const Blas_Kernelsf &blas_kernels<float>();
+
+// Sums the lanes in a fixed order
+double blas_reduce_lanes(const double *lanes);
+
+// Row n of the matrix free stencil times x, summed in the order of stencil_dot. 
+// Used by all versions of stencil_mf_dot for the cells they do not vectorize. 
+// Static, so every file keeps a copy compiled for its own instruction set.
+template<class T>
+static inline double blas_stencil_mf_row(const char *m, const double *diag, double offdiag, const T *x, int n, int sy, int sz)
+{
+	int c = (m[n - 1] != SOLIDCELL) + (m[n + 1] != SOLIDCELL) + (m[n - sy] != SOLIDCELL)
+		+ (m[n + sy] != SOLIDCELL) + (m[n - sz] != SOLIDCELL) + (m[n + sz] != SOLIDCELL);
+
+	double sum = diag[c] * x[n];
+	sum += (m[n + 1] == FLUIDCELL ? offdiag : 0.0) * x[n + 1];
+	sum += (m[n + sy] == FLUIDCELL ? offdiag : 0.0) * x[n + sy];
+	sum += (m[n + sz] == FLUIDCELL ? offdiag : 0.0) * x[n + sz];
+	sum += (m[n - 1] == FLUIDCELL ? offdiag : 0.0) * x[n - 1];
+	sum += (m[n - sy] == FLUIDCELL ? offdiag : 0.0) * x[n - sy];
+	sum += (m[n - sz] == FLUIDCELL ? offdiag : 0.0) * x[n - sz];
+	return sum;
+}
+
+extern const Blas_Kernels blas_kernels_scalar;
+extern const Blas_Kernelsf blas_kernelsf_scalar;
+#ifdef PICFLIP_SIMD_AVX2
+extern const Blas_Kernels blas_kernels_avx2;
+extern const Blas_Kernelsf blas_kernelsf_avx2;
+#endif
+#ifdef PICFLIP_SIMD_AVX512
+extern const Blas_Kernels blas_kernels_avx512;
+extern const Blas_Kernelsf blas_kernelsf_avx512;
+#endif
+
+#endif
@@ -0,0 +1,339 @@
+//----------------------------------------------------------------------------//
+// AVX2 versions of the CG vector kernels. Built with AVX2 enabled for this 
+// file only, and only called when simd_detect() reports AVX2 support. The 
+// kernels are written once for double and float, load4 and store4 convert 
+// float data to and from double.
+//----------------------------------------------------------------------------//
+#include "blas_kernels.h"
+
+#ifdef PICFLIP_SIMD_AVX2
+
+#include <immintrin.h>
+#include <cmath>
+#include <cstring>
+
+static inline __m256d load4(const double *p) { return _mm256_loadu_pd(p); }
+static inline __m256d load4(const float *p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+static inline void store4(double *p, __m256d v) { _mm256_storeu_pd(p, v); }
+static inline void store4(float *p, __m256d v) { _mm_storeu_ps(p, _mm256_cvtpd_ps(v)); }
+
+// p[0], p[4], p[8], p[12]
+static inline __m256d gather4(const double *p) { return _mm256_i32gather_pd(p, _mm_setr_epi32(0, 4, 8, 12), 8); }
+static inline __m256d gather4(const float *p) { return _mm256_cvtps_pd(_mm_i32gather_ps(p, _mm_setr_epi32(0, 4, 8, 12), 4)); }
+
+static inline __m256d abs_pd(__m256d v)
+{
+	return _mm256_andnot_pd(_mm256_set1_pd(-0.0), v);
+}
+
+static inline double hmax_pd(__m256d v)
+{
+	__m128d m = _mm_max_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+	return _mm_cvtsd_f64(_mm_max_sd(m, _mm_unpackhi_pd(m, m)));
+}
+
+template<class T>
+static void axpy_avx2(T *y, const T *x, double a, const int *begin, const int *end, int nruns)
+{
+	__m256d va = _mm256_set1_pd(a);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + 4 <= end[run]; n += 4)
+			store4(y + n, _mm256_add_pd(load4(y + n), _mm256_mul_pd(va, load4(x + n))));
+		for (; n < end[run]; ++n)
+			y[n] = (T)(y[n] + a * x[n]);
+	}
+}
+
+template<class T>
+static void xpby_avx2(T *y, const T *x, double b, const int *begin, const int *end, int nruns)
+{
+	__m256d vb = _mm256_set1_pd(b);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + 4 <= end[run]; n += 4)
+			store4(y + n, _mm256_add_pd(load4(x + n), _mm256_mul_pd(vb, load4(y + n))));
+		for (; n < end[run]; ++n)
+			y[n] = (T)(x[n] + b * y[n]);
+	}
+}
+
+template<class T>
+static void dot_avx2(const T *x, const T *y, const int *begin, const int *end, int nruns, double *lanes)
+{
+	__m256d acc0 = _mm256_loadu_pd(lanes), acc1 = _mm256_loadu_pd(lanes + 4);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + BLAS_LANES <= end[run]; n += BLAS_LANES)
+		{
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(load4(x + n), load4(y + n)));
+			acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(load4(x + n + 4), load4(y + n + 4)));
+		}
+		if (n == end[run])
+			continue;
+
+		_mm256_storeu_pd(lanes, acc0);
+		_mm256_storeu_pd(lanes + 4, acc1);
+		for (int t = 0; n < end[run]; ++n, ++t)
+			lanes[t] += (double)x[n] * y[n];
+		acc0 = _mm256_loadu_pd(lanes);
+		acc1 = _mm256_loadu_pd(lanes + 4);
+	}
+
+	_mm256_storeu_pd(lanes, acc0);
+	_mm256_storeu_pd(lanes + 4, acc1);
+}
+
+template<class T>
+static double absmax_avx2(const T *x, const int *begin, const int *end, int nruns, double m)
+{
+	__m256d vm = _mm256_set1_pd(m);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + 4 <= end[run]; n += 4)
+			vm = _mm256_max_pd(vm, abs_pd(load4(x + n)));
+		for (; n < end[run]; ++n)
+			if (!(std::fabs((double)x[n]) <= m))
+				m = std::fabs((double)x[n]);
+	}
+
+	double vmax = hmax_pd(vm);
+	return vmax > m ? vmax : m;
+}
+
+template<class T>
+static double update_xr_avx2(T *x, const T *d, T *r, const T *q, double alpha,
+	const int *begin, const int *end, int nruns, double *lanes, double m)
+{
+	__m256d va = _mm256_set1_pd(alpha);
+	__m256d vm = _mm256_set1_pd(m);
+	__m256d acc0 = _mm256_loadu_pd(lanes), acc1 = _mm256_loadu_pd(lanes + 4);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + BLAS_LANES <= end[run]; n += BLAS_LANES)
+		{
+			__m256d r0 = _mm256_sub_pd(load4(r + n), _mm256_mul_pd(va, load4(q + n)));
+			__m256d r1 = _mm256_sub_pd(load4(r + n + 4), _mm256_mul_pd(va, load4(q + n + 4)));
+			store4(x + n, _mm256_add_pd(load4(x + n), _mm256_mul_pd(va, load4(d + n))));
+			store4(x + n + 4, _mm256_add_pd(load4(x + n + 4), _mm256_mul_pd(va, load4(d + n + 4))));
+			store4(r + n, r0);
+			store4(r + n + 4, r1);
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(r0, r0));
+			acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(r1, r1));
+			vm = _mm256_max_pd(vm, _mm256_max_pd(abs_pd(r0), abs_pd(r1)));
+		}
+		if (n == end[run])
+			continue;
+
+		_mm256_storeu_pd(lanes, acc0);
+		_mm256_storeu_pd(lanes + 4, acc1);
+		for (int t = 0; n < end[run]; ++n, ++t)
+		{
+			double rn = r[n] - alpha * q[n];
+			x[n] = (T)(x[n] + alpha * d[n]);
+			r[n] = (T)rn;
+			lanes[t] += rn * rn;
+			if (!(std::fabs(rn) <= m))
+				m = std::fabs(rn);
+		}
+		acc0 = _mm256_loadu_pd(lanes);
+		acc1 = _mm256_loadu_pd(lanes + 4);
+	}
+
+	_mm256_storeu_pd(lanes, acc0);
+	_mm256_storeu_pd(lanes + 4, acc1);
+	double vmax = hmax_pd(vm);
+	return vmax > m ? vmax : m;
+}
+
+//----------------------------------------------------------------------------//
+// A * x for the four cells n..n+3. The own coefficients are loaded as four 
+// rows and transposed, the -i coefficient is the +i column shifted by one 
+// cell and the -j and -k coefficients are gathered.
+//----------------------------------------------------------------------------//
+template<class T>
+static inline __m256d stencil4(const T *a, const T *x, int n, int sy, int sz)
+{
+	__m256d r0 = load4(a + 4 * n);
+	__m256d r1 = load4(a + 4 * n + 4);
+	__m256d r2 = load4(a + 4 * n + 8);
+	__m256d r3 = load4(a + 4 * n + 12);
+	__m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1);
+	__m256d t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+	__m256d diag = _mm256_permute2f128_pd(t0, t2, 0x20);
+	__m256d ai = _mm256_permute2f128_pd(t1, t3, 0x20);
+	__m256d aj = _mm256_permute2f128_pd(t0, t2, 0x31);
+	__m256d ak = _mm256_permute2f128_pd(t1, t3, 0x31);
+
+	__m256d ai_m = _mm256_blend_pd(_mm256_permute4x64_pd(ai, _MM_SHUFFLE(2, 1, 0, 3)), _mm256_set1_pd(a[4 * (n - 1) + 1]), 0x1);
+	__m256d aj_m = gather4(a + 4 * (n - sy) + 2);
+	__m256d ak_m = gather4(a + 4 * (n - sz) + 3);
+
+	__m256d sum = _mm256_mul_pd(diag, load4(x + n));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(ai, load4(x + n + 1)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(aj, load4(x + n + sy)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(ak, load4(x + n + sz)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(ai_m, load4(x + n - 1)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(aj_m, load4(x + n - sy)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(ak_m, load4(x + n - sz)));
+	return sum;
+}
+
+template<class T>
+static void stencil_dot_avx2(const T *a, const T *x, T *y, int sy, int sz,
+	const int *begin, const int *end, int nruns, double *lanes)
+{
+	__m256d acc0 = _mm256_loadu_pd(lanes), acc1 = _mm256_loadu_pd(lanes + 4);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + BLAS_LANES <= end[run]; n += BLAS_LANES)
+		{
+			__m256d y0 = stencil4(a, x, n, sy, sz);
+			__m256d y1 = stencil4(a, x, n + 4, sy, sz);
+			store4(y + n, y0);
+			store4(y + n + 4, y1);
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(load4(x + n), y0));
+			acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(load4(x + n + 4), y1));
+		}
+		if (n == end[run])
+			continue;
+
+		_mm256_storeu_pd(lanes, acc0);
+		_mm256_storeu_pd(lanes + 4, acc1);
+		for (int t = 0; n < end[run]; ++n, ++t)
+		{
+			double sum = (double)a[4 * n] * x[n];
+			sum += (double)a[4 * n + 1] * x[n + 1];
+			sum += (double)a[4 * n + 2] * x[n + sy];
+			sum += (double)a[4 * n + 3] * x[n + sz];
+			sum += (double)a[4 * (n - 1) + 1] * x[n - 1];
+			sum += (double)a[4 * (n - sy) + 2] * x[n - sy];
+			sum += (double)a[4 * (n - sz) + 3] * x[n - sz];
+			y[n] = (T)sum;
+			lanes[t] += x[n] * sum;
+		}
+		acc0 = _mm256_loadu_pd(lanes);
+		acc1 = _mm256_loadu_pd(lanes + 4);
+	}
+
+	_mm256_storeu_pd(lanes, acc0);
+	_mm256_storeu_pd(lanes + 4, acc1);
+}
+
+// Voxel classes of the cells n..n+3, one per 64-bit element
+static inline __m256i marker4(const char *m, int n)
+{
+	int v;
+	std::memcpy(&v, m + n, sizeof(v));
+	return _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(v));
+}
+
+//----------------------------------------------------------------------------//
+// Matrix free A * x for the cells n..n+3. Every comparison against SOLIDCELL 
+// is -1 for a solid neighbour, so 6 plus their sum counts the non-solid ones.
+//----------------------------------------------------------------------------//
+template<class T>
+static inline __m256d stencil_mf4(const char *m, const double *diag, __m256d offdiag, const T *x, int n, int sy, int sz)
+{
+	const __m256i fluid = _mm256_set1_epi64x(FLUIDCELL), solid = _mm256_set1_epi64x(SOLIDCELL);
+	__m256i mi = marker4(m, n + 1), mj = marker4(m, n + sy), mk = marker4(m, n + sz);
+	__m256i mi_m = marker4(m, n - 1), mj_m = marker4(m, n - sy), mk_m = marker4(m, n - sz);
+
+	__m256i c = _mm256_add_epi64(_mm256_set1_epi64x(6), _mm256_cmpeq_epi64(mi, solid));
+	c = _mm256_add_epi64(c, _mm256_cmpeq_epi64(mj, solid));
+	c = _mm256_add_epi64(c, _mm256_cmpeq_epi64(mk, solid));
+	c = _mm256_add_epi64(c, _mm256_cmpeq_epi64(mi_m, solid));
+	c = _mm256_add_epi64(c, _mm256_cmpeq_epi64(mj_m, solid));
+	c = _mm256_add_epi64(c, _mm256_cmpeq_epi64(mk_m, solid));
+
+	__m256d ad = _mm256_i64gather_pd(diag, c, 8);
+	__m256d ai = _mm256_and_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(mi, fluid)), offdiag);
+	__m256d aj = _mm256_and_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(mj, fluid)), offdiag);
+	__m256d ak = _mm256_and_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(mk, fluid)), offdiag);
+	__m256d ai_m = _mm256_and_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(mi_m, fluid)), offdiag);
+	__m256d aj_m = _mm256_and_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(mj_m, fluid)), offdiag);
+	__m256d ak_m = _mm256_and_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(mk_m, fluid)), offdiag);
+
+	__m256d sum = _mm256_mul_pd(ad, load4(x + n));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(ai, load4(x + n + 1)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(aj, load4(x + n + sy)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(ak, load4(x + n + sz)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(ai_m, load4(x + n - 1)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(aj_m, load4(x + n - sy)));
+	sum = _mm256_add_pd(sum, _mm256_mul_pd(ak_m, load4(x + n - sz)));
+	return sum;
+}
+
+template<class T>
+static void stencil_mf_dot_avx2(const char *m, const double *diag, double offdiag, const T *x, T *y, int sy, int sz,
+	const int *begin, const int *end, int nruns, double *lanes)
+{
+	__m256d acc0 = _mm256_loadu_pd(lanes), acc1 = _mm256_loadu_pd(lanes + 4);
+	__m256d voff = _mm256_set1_pd(offdiag);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + BLAS_LANES <= end[run]; n += BLAS_LANES)
+		{
+			__m256d y0 = stencil_mf4(m, diag, voff, x, n, sy, sz);
+			__m256d y1 = stencil_mf4(m, diag, voff, x, n + 4, sy, sz);
+			store4(y + n, y0);
+			store4(y + n + 4, y1);
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(load4(x + n), y0));
+			acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(load4(x + n + 4), y1));
+		}
+		if (n == end[run])
+			continue;
+
+		_mm256_storeu_pd(lanes, acc0);
+		_mm256_storeu_pd(lanes + 4, acc1);
+		for (int t = 0; n < end[run]; ++n, ++t)
+		{
+			double sum = blas_stencil_mf_row(m, diag, offdiag, x, n, sy, sz);
+			y[n] = (T)sum;
+			lanes[t] += x[n] * sum;
+		}
+		acc0 = _mm256_loadu_pd(lanes);
+		acc1 = _mm256_loadu_pd(lanes + 4);
+	}
+
+	_mm256_storeu_pd(lanes, acc0);
+	_mm256_storeu_pd(lanes + 4, acc1);
+}
+
+const Blas_Kernels blas_kernels_avx2 =
+{
+	axpy_avx2<double>,
+	xpby_avx2<double>,
+	dot_avx2<double>,
+	absmax_avx2<double>,
+	update_xr_avx2<double>,
+	stencil_dot_avx2<double>,
+	stencil_mf_dot_avx2<double>
+};
+
+const Blas_Kernelsf blas_kernelsf_avx2 =
+{
+	axpy_avx2<float>,
+	xpby_avx2<float>,
+	dot_avx2<float>,
+	absmax_avx2<float>,
+	update_xr_avx2<float>,
+	stencil_dot_avx2<float>,
+	stencil_mf_dot_avx2<float>
+};
+
+#endif
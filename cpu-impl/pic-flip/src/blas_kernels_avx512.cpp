@@ -0,0 +1,305 @@
+//----------------------------------------------------------------------------//
+// AVX-512 versions of the CG vector kernels. Built with AVX-512F enabled for 
+// this file only, and only called when simd_detect() reports AVX-512 support. 
+// One register holds all BLAS_LANES partial sums. The kernels are written once 
+// for double and float, load8 and store8 convert float data to and from double.
+//----------------------------------------------------------------------------//
+#include "blas_kernels.h"
+
+#ifdef PICFLIP_SIMD_AVX512
+
+#include <immintrin.h>
+#include <cmath>
+#include <cstring>
+
+static inline __m512d load8(const double *p) { return _mm512_loadu_pd(p); }
+static inline __m512d load8(const float *p) { return _mm512_cvtps_pd(_mm256_loadu_ps(p)); }
+static inline void store8(double *p, __m512d v) { _mm512_storeu_pd(p, v); }
+static inline void store8(float *p, __m512d v) { _mm256_storeu_ps(p, _mm512_cvtpd_ps(v)); }
+
+// Masked out elements are not read and load as zero
+static inline __m512d load8(__mmask8 mask, const double *p) { return _mm512_maskz_loadu_pd(mask, p); }
+static inline __m512d load8(__mmask8 mask, const float *p) { return _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps((__mmask16)mask, p))); }
+static inline void store8(__mmask8 mask, double *p, __m512d v) { _mm512_mask_storeu_pd(p, mask, v); }
+static inline void store8(__mmask8 mask, float *p, __m512d v) { _mm512_mask_storeu_ps(p, (__mmask16)mask, _mm512_castps256_ps512(_mm512_cvtpd_ps(v))); }
+
+static inline __mmask8 tail_mask(int left)
+{
+	return left >= 8 ? (__mmask8)0xff : (__mmask8)((1u << left) - 1);
+}
+
+static inline __m512d abs_pd(__m512d v)
+{
+	return _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(v), _mm512_set1_epi64(0x7fffffffffffffffLL)));
+}
+
+template<class T>
+static void axpy_avx512(T *y, const T *x, double a, const int *begin, const int *end, int nruns)
+{
+	__m512d va = _mm512_set1_pd(a);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + 8 <= end[run]; n += 8)
+			store8(y + n, _mm512_add_pd(load8(y + n), _mm512_mul_pd(va, load8(x + n))));
+		for (; n < end[run]; ++n)
+			y[n] = (T)(y[n] + a * x[n]);
+	}
+}
+
+template<class T>
+static void xpby_avx512(T *y, const T *x, double b, const int *begin, const int *end, int nruns)
+{
+	__m512d vb = _mm512_set1_pd(b);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + 8 <= end[run]; n += 8)
+			store8(y + n, _mm512_add_pd(load8(x + n), _mm512_mul_pd(vb, load8(y + n))));
+		for (; n < end[run]; ++n)
+			y[n] = (T)(x[n] + b * y[n]);
+	}
+}
+
+template<class T>
+static void dot_avx512(const T *x, const T *y, const int *begin, const int *end, int nruns, double *lanes)
+{
+	__m512d acc = _mm512_loadu_pd(lanes);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + BLAS_LANES <= end[run]; n += BLAS_LANES)
+			acc = _mm512_add_pd(acc, _mm512_mul_pd(load8(x + n), load8(y + n)));
+		if (n == end[run])
+			continue;
+
+		// The tail lanes start at 0, so the missing elements add nothing
+		__mmask8 tail = tail_mask(end[run] - n);
+		acc = _mm512_mask_add_pd(acc, tail, acc, _mm512_mul_pd(load8(tail, x + n), load8(tail, y + n)));
+	}
+
+	_mm512_storeu_pd(lanes, acc);
+}
+
+template<class T>
+static double absmax_avx512(const T *x, const int *begin, const int *end, int nruns, double m)
+{
+	__m512d vm = _mm512_set1_pd(m);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + 8 <= end[run]; n += 8)
+			vm = _mm512_max_pd(vm, abs_pd(load8(x + n)));
+		if (n == end[run])
+			continue;
+
+		__mmask8 tail = tail_mask(end[run] - n);
+		vm = _mm512_mask_max_pd(vm, tail, vm, abs_pd(load8(tail, x + n)));
+	}
+
+	return _mm512_reduce_max_pd(vm);
+}
+
+template<class T>
+static double update_xr_avx512(T *x, const T *d, T *r, const T *q, double alpha,
+	const int *begin, const int *end, int nruns, double *lanes, double m)
+{
+	__m512d va = _mm512_set1_pd(alpha);
+	__m512d vm = _mm512_set1_pd(m);
+	__m512d acc = _mm512_loadu_pd(lanes);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		for (int n = begin[run]; n < end[run]; n += BLAS_LANES)
+		{
+			__mmask8 mask = tail_mask(end[run] - n);
+
+			__m512d rn = _mm512_sub_pd(load8(mask, r + n), _mm512_mul_pd(va, load8(mask, q + n)));
+			__m512d xn = _mm512_add_pd(load8(mask, x + n), _mm512_mul_pd(va, load8(mask, d + n)));
+			store8(mask, x + n, xn);
+			store8(mask, r + n, rn);
+			acc = _mm512_mask_add_pd(acc, mask, acc, _mm512_mul_pd(rn, rn));
+			vm = _mm512_mask_max_pd(vm, mask, vm, abs_pd(rn));
+		}
+	}
+
+	_mm512_storeu_pd(lanes, acc);
+	return _mm512_reduce_max_pd(vm);
+}
+
+//----------------------------------------------------------------------------//
+// Column c of the 4 coefficient matrix rows of eight consecutive cells, 
+// loaded as four registers z0..z3
+//----------------------------------------------------------------------------//
+static inline __m512d column8(__m512d z0, __m512d z1, __m512d z2, __m512d z3, int c)
+{
+	__m512i idx = _mm512_setr_epi64(c, c + 4, c + 8, c + 12, c, c + 4, c + 8, c + 12);
+	__m512d lo = _mm512_permutex2var_pd(z0, idx, z1);
+	__m512d hi = _mm512_permutex2var_pd(z2, idx, z3);
+	return _mm512_shuffle_f64x2(lo, hi, _MM_SHUFFLE(1, 0, 1, 0));
+}
+
+template<class T>
+static inline __m512d column8(const T *p, int c)
+{
+	return column8(load8(p), load8(p + 8), load8(p + 16), load8(p + 24), c);
+}
+
+//----------------------------------------------------------------------------//
+// A * x for the cells n..n+7 selected by mask. The rows of masked out cells 
+// may lie past the run, they are read but never used.
+//----------------------------------------------------------------------------//
+template<class T>
+static inline __m512d stencil8(const T *a, const T *x, int n, int sy, int sz, __mmask8 mask)
+{
+	__m512d z0 = load8(a + 4 * n), z1 = load8(a + 4 * n + 8);
+	__m512d z2 = load8(a + 4 * n + 16), z3 = load8(a + 4 * n + 24);
+	__m512d diag = column8(z0, z1, z2, z3, 0);
+	__m512d ai = column8(z0, z1, z2, z3, 1);
+	__m512d aj = column8(z0, z1, z2, z3, 2);
+	__m512d ak = column8(z0, z1, z2, z3, 3);
+
+	__m512d ai_m = _mm512_permutexvar_pd(_mm512_setr_epi64(0, 0, 1, 2, 3, 4, 5, 6), ai);
+	ai_m = _mm512_mask_blend_pd(0x1, ai_m, _mm512_set1_pd(a[4 * (n - 1) + 1]));
+	__m512d aj_m = column8(a + 4 * (n - sy), 2);
+	__m512d ak_m = column8(a + 4 * (n - sz), 3);
+
+	__m512d sum = _mm512_mul_pd(diag, load8(mask, x + n));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(ai, load8(mask, x + n + 1)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(aj, load8(mask, x + n + sy)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(ak, load8(mask, x + n + sz)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(ai_m, load8(mask, x + n - 1)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(aj_m, load8(mask, x + n - sy)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(ak_m, load8(mask, x + n - sz)));
+	return sum;
+}
+
+template<class T>
+static void stencil_dot_avx512(const T *a, const T *x, T *y, int sy, int sz,
+	const int *begin, const int *end, int nruns, double *lanes)
+{
+	__m512d acc = _mm512_loadu_pd(lanes);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		for (int n = begin[run]; n < end[run]; n += BLAS_LANES)
+		{
+			__mmask8 mask = tail_mask(end[run] - n);
+
+			__m512d yn = stencil8(a, x, n, sy, sz, mask);
+			store8(mask, y + n, yn);
+			acc = _mm512_mask_add_pd(acc, mask, acc, _mm512_mul_pd(load8(mask, x + n), yn));
+		}
+	}
+
+	_mm512_storeu_pd(lanes, acc);
+}
+
+// Voxel classes of the cells n..n+7, one per 64-bit element
+static inline __m512i marker8(const char *m, int n)
+{
+	long long v;
+	std::memcpy(&v, m + n, sizeof(v));
+	return _mm512_cvtepi8_epi64(_mm_cvtsi64_si128(v));
+}
+
+//----------------------------------------------------------------------------//
+// Matrix free A * x for the cells n..n+7. The diagonal is looked up in the 8 
+// entry diag table with one permute.
+//----------------------------------------------------------------------------//
+template<class T>
+static inline __m512d stencil_mf8(const char *m, __m512d diag, __m512d offdiag, const T *x, int n, int sy, int sz)
+{
+	const __m512i fluid = _mm512_set1_epi64(FLUIDCELL), solid = _mm512_set1_epi64(SOLIDCELL), one = _mm512_set1_epi64(1);
+	__m512i mi = marker8(m, n + 1), mj = marker8(m, n + sy), mk = marker8(m, n + sz);
+	__m512i mi_m = marker8(m, n - 1), mj_m = marker8(m, n - sy), mk_m = marker8(m, n - sz);
+
+	__m512i c = _mm512_set1_epi64(6);
+	c = _mm512_mask_sub_epi64(c, _mm512_cmpeq_epi64_mask(mi, solid), c, one);
+	c = _mm512_mask_sub_epi64(c, _mm512_cmpeq_epi64_mask(mj, solid), c, one);
+	c = _mm512_mask_sub_epi64(c, _mm512_cmpeq_epi64_mask(mk, solid), c, one);
+	c = _mm512_mask_sub_epi64(c, _mm512_cmpeq_epi64_mask(mi_m, solid), c, one);
+	c = _mm512_mask_sub_epi64(c, _mm512_cmpeq_epi64_mask(mj_m, solid), c, one);
+	c = _mm512_mask_sub_epi64(c, _mm512_cmpeq_epi64_mask(mk_m, solid), c, one);
+
+	__m512d ad = _mm512_permutexvar_pd(c, diag);
+	__m512d ai = _mm512_maskz_mov_pd(_mm512_cmpeq_epi64_mask(mi, fluid), offdiag);
+	__m512d aj = _mm512_maskz_mov_pd(_mm512_cmpeq_epi64_mask(mj, fluid), offdiag);
+	__m512d ak = _mm512_maskz_mov_pd(_mm512_cmpeq_epi64_mask(mk, fluid), offdiag);
+	__m512d ai_m = _mm512_maskz_mov_pd(_mm512_cmpeq_epi64_mask(mi_m, fluid), offdiag);
+	__m512d aj_m = _mm512_maskz_mov_pd(_mm512_cmpeq_epi64_mask(mj_m, fluid), offdiag);
+	__m512d ak_m = _mm512_maskz_mov_pd(_mm512_cmpeq_epi64_mask(mk_m, fluid), offdiag);
+
+	__m512d sum = _mm512_mul_pd(ad, load8(x + n));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(ai, load8(x + n + 1)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(aj, load8(x + n + sy)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(ak, load8(x + n + sz)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(ai_m, load8(x + n - 1)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(aj_m, load8(x + n - sy)));
+	sum = _mm512_add_pd(sum, _mm512_mul_pd(ak_m, load8(x + n - sz)));
+	return sum;
+}
+
+//----------------------------------------------------------------------------//
+// Only whole blocks of 8 cells are vectorized, masked byte loads of the 
+// classification would need AVX-512BW. The tails go through the scalar row.
+//----------------------------------------------------------------------------//
+template<class T>
+static void stencil_mf_dot_avx512(const char *m, const double *diag, double offdiag, const T *x, T *y, int sy, int sz,
+	const int *begin, const int *end, int nruns, double *lanes)
+{
+	__m512d acc = _mm512_loadu_pd(lanes);
+	__m512d vdiag = _mm512_loadu_pd(diag), voff = _mm512_set1_pd(offdiag);
+
+	for (int run = 0; run < nruns; ++run)
+	{
+		int n = begin[run];
+		for (; n + BLAS_LANES <= end[run]; n += BLAS_LANES)
+		{
+			__m512d yn = stencil_mf8(m, vdiag, voff, x, n, sy, sz);
+			store8(y + n, yn);
+			acc = _mm512_add_pd(acc, _mm512_mul_pd(load8(x + n), yn));
+		}
+		if (n == end[run])
+			continue;
+
+		_mm512_storeu_pd(lanes, acc);
+		for (int t = 0; n < end[run]; ++n, ++t)
+		{
+			double sum = blas_stencil_mf_row(m, diag, offdiag, x, n, sy, sz);
+			y[n] = (T)sum;
+			lanes[t] += x[n] * sum;
+		}
+		acc = _mm512_loadu_pd(lanes);
+	}
+
+	_mm512_storeu_pd(lanes, acc);
+}
+
+const Blas_Kernels blas_kernels_avx512 =
+{
+	axpy_avx512<double>,
+	xpby_avx512<double>,
+	dot_avx512<double>,
+	absmax_avx512<double>,
+	update_xr_avx512<double>,
+	stencil_dot_avx512<double>,
+	stencil_mf_dot_avx512<double>
+};
+
+const Blas_Kernelsf blas_kernelsf_avx512 =
+{
+	axpy_avx512<float>,
+	xpby_avx512<float>,
+	dot_avx512<float>,
+	absmax_avx512<float>,
+	update_xr_avx512<float>,
+	stencil_dot_avx512<float>,
+	stencil_mf_dot_avx512<float>
+};
+
+#endif
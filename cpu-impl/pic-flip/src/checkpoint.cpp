@@ -0,0 +1,314 @@
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+static const char checkpoint_magic[4] = { 'P', 'F', 'C', 'K' };
+
+static unsigned long long checkpoint_hash(const char *data, size_t size)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; ++i)
+	{
+		h ^= (unsigned char)data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+//----------------------------------------------------------------------------//
+// Serialization into and out of a byte buffer
+//----------------------------------------------------------------------------//
+static void put(std::vector<char> &b, const void *data, size_t size)
+{
+	b.insert(b.end(), (const char *)data, (const char *)data + size);
+}
+
+template<class T>
+static void put_value(std::vector<char> &b, const T &v)
+{
+	put(b, &v, sizeof(T));
+}
+
+// In i, j, k order, whatever the layout of a
+template<class T, int Layout>
+static void put_array(std::vector<char> &b, const Array3<T, Layout> &a)
+{
+	std::vector<T> line(a.nx);
+	for (int k = 0; k < a.nz; ++k)
+		for (int j = 0; j < a.ny; ++j)
+		{
+			for (int i = 0; i < a.nx; ++i)
+				line[i] = a(i, j, k);
+			put(b, &line[0], a.nx * sizeof(T));
+		}
+}
+
+struct Checkpoint_Reader
+{
+	const char *p, *end;
+
+	bool get(void *data, size_t size)
+	{
+		if ((size_t)(end - p) < size)
+			return false;
+		std::memcpy(data, p, size);
+		p += size;
+		return true;
+	}
+
+	template<class T>
+	bool get_value(T &v)
+	{
+		return get(&v, sizeof(T));
+	}
+
+	template<class T, int Layout>
+	bool get_array(Array3<T, Layout> &a)
+	{
+		std::vector<T> line(a.nx);
+		for (int k = 0; k < a.nz; ++k)
+			for (int j = 0; j < a.ny; ++j)
+			{
+				if (!get(&line[0], a.nx * sizeof(T)))
+					return false;
+				for (int i = 0; i < a.nx; ++i)
+					a(i, j, k) = line[i];
+			}
+		return true;
+	}
+};
+
+static void serialize(const FluidSolver &solver, std::vector<char> &b)
+{
+	const Grid &grid = solver.grid;
+	const Particles &particles = solver.particles;
+	int np = particles.currnp;
+
+	b.clear();
+	b.reserve(64 + 24 * (size_t)np + 4 * (size_t)(grid.u.size + grid.v.size + grid.w.size) + 9 * (size_t)grid.pressure.size);
+
+	put(b, checkpoint_magic, sizeof(checkpoint_magic));
+	put_value(b, (unsigned int)CHECKPOINT_VERSION);
+	put_value(b, solver.dimx);
+	put_value(b, solver.dimy);
+	put_value(b, solver.dimz);
+	put_value(b, grid.h);
+	put_value(b, solver.timestep);
+	put_value(b, grid.gravity);
+	put_value(b, grid.rho);
+	put_value(b, solver.frame);
+	put_value(b, solver.steps);
+	put_value(b, solver.seed);
+	put_value(b, solver.rng.state);
+	put_value(b, solver.rng.inc);
+	put_value(b, np);
+
+	for (int c = 0; c < 3; ++c)
+		put(b, particles.pos[c], np * sizeof(float));
+	for (int c = 0; c < 3; ++c)
+		put(b, particles.vel[c], np * sizeof(float));
+
+	put_array(b, grid.u);
+	put_array(b, grid.v);
+	put_array(b, grid.w);
+	put_array(b, grid.marker);
+	put(b, grid.pressure.data, grid.pressure.size * sizeof(double));
+
+	const Narrow_Band &band = solver.band;
+	put_value(b, band.width);
+	if (band.enabled())
+	{
+		put_value(b, (char)band.ready);
+		if (band.ready)
+			put_array(b, band.phi);
+	}
+
+	put_value(b, checkpoint_hash(&b[0], b.size()));
+}
+
+static bool write_file(const std::vector<char> &b, const std::string &path)
+{
+	std::string tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return false;
+
+	bool ok = fwrite(&b[0], 1, b.size(), f) == b.size();
+	ok = fclose(f) == 0 && ok;
+
+	// rename does not replace an existing file everywhere
+	if (ok)
+	{
+		std::remove(path.c_str());
+		ok = std::rename(tmp.c_str(), path.c_str()) == 0;
+	}
+	if (!ok)
+		std::remove(tmp.c_str());
+	return ok;
+}
+
+static bool read_file(const std::string &path, std::vector<char> &b)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+
+	b.clear();
+	char chunk[1 << 16];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		b.insert(b.end(), chunk, chunk + n);
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+static bool parse_header(Checkpoint_Reader &r, Checkpoint_Header &h)
+{
+	char magic[4];
+	if (!r.get(magic, sizeof(magic)) || std::memcmp(magic, checkpoint_magic, sizeof(magic)) != 0)
+		return false;
+
+	return r.get_value(h.version) && (h.version == 1 || h.version == CHECKPOINT_VERSION)
+		&& r.get_value(h.dimx) && r.get_value(h.dimy) && r.get_value(h.dimz)
+		&& r.get_value(h.h) && r.get_value(h.timestep) && r.get_value(h.gravity) && r.get_value(h.rho)
+		&& r.get_value(h.frame) && r.get_value(h.steps) && r.get_value(h.seed)
+		&& r.get_value(h.rng_state) && r.get_value(h.rng_inc) && r.get_value(h.currnp)
+		&& h.currnp >= 0;
+}
+
+bool save_checkpoint(const FluidSolver &solver, const std::string &path)
+{
+	std::vector<char> b;
+	serialize(solver, b);
+	if (!write_file(b, path))
+	{
+		std::cerr << "Could not write the checkpoint " << path << "\n";
+		return false;
+	}
+	return true;
+}
+
+bool read_checkpoint_header(const std::string &path, Checkpoint_Header &header)
+{
+	std::vector<char> b;
+	if (!read_file(path, b))
+	{
+		std::cerr << "Could not read the checkpoint " << path << "\n";
+		return false;
+	}
+
+	Checkpoint_Reader r = { b.empty() ? NULL : &b[0], b.empty() ? NULL : &b[0] + b.size() };
+	if (!parse_header(r, header))
+	{
+		std::cerr << path << " is not a version " << CHECKPOINT_VERSION << " checkpoint\n";
+		return false;
+	}
+	return true;
+}
+
+bool load_checkpoint(FluidSolver &solver, const std::string &path)
+{
+	std::vector<char> b;
+	if (!read_file(path, b))
+	{
+		std::cerr << "Could not read the checkpoint " << path << "\n";
+		return false;
+	}
+
+	unsigned long long hash;
+	if (b.size() < sizeof(hash))
+	{
+		std::cerr << path << " is not a checkpoint\n";
+		return false;
+	}
+	std::memcpy(&hash, &b[b.size() - sizeof(hash)], sizeof(hash));
+	if (hash != checkpoint_hash(&b[0], b.size() - sizeof(hash)))
+	{
+		std::cerr << "The checkpoint " << path << " is damaged\n";
+		return false;
+	}
+
+	Checkpoint_Reader r = { &b[0], &b[0] + b.size() - sizeof(hash) };
+	Checkpoint_Header h;
+	if (!parse_header(r, h))
+	{
+		std::cerr << path << " is not a version " << CHECKPOINT_VERSION << " checkpoint\n";
+		return false;
+	}
+
+	Grid &grid = solver.grid;
+	Particles &particles = solver.particles;
+	if (h.dimx != solver.dimx || h.dimy != solver.dimy || h.dimz != solver.dimz || h.currnp > particles.maxnp)
+	{
+		std::cerr << "The checkpoint " << path << " does not fit the solver: grid " << h.dimx << "x" << h.dimy << "x" << h.dimz
+			<< ", " << h.currnp << " particles\n";
+		return false;
+	}
+
+	bool ok = true;
+	for (int c = 0; c < 3; ++c)
+		ok = ok && r.get(particles.pos[c], h.currnp * sizeof(float));
+	for (int c = 0; c < 3; ++c)
+		ok = ok && r.get(particles.vel[c], h.currnp * sizeof(float));
+	ok = ok && r.get_array(grid.u) && r.get_array(grid.v) && r.get_array(grid.w) && r.get_array(grid.marker);
+	ok = ok && r.get(grid.pressure.data, grid.pressure.size * sizeof(double));
+	grid.max_speed_valid = false;
+	// The marker and pressure are those of the last solve, for a warm start of the next
+	grid.marker.copy_to(grid.warm_marker);
+	grid.warm_valid = true;
+
+	Narrow_Band &band = solver.band;
+	char ready = 0;
+	if (ok && h.version >= 2)
+	{
+		ok = r.get_value(band.width);
+		if (ok && band.enabled())
+		{
+			band.init(grid);
+			ok = r.get_value(ready) && (!ready || r.get_array(band.phi));
+		}
+	}
+	ok = ok && r.p == r.end;
+	if (!ok)
+	{
+		std::cerr << "The checkpoint " << path << " has the wrong size\n";
+		particles.clear();
+		return false;
+	}
+
+	particles.currnp = h.currnp;
+	band.ready = ready != 0;
+	grid.h = h.h;
+	grid.overh = 1.0f / h.h;
+	grid.gravity = h.gravity;
+	grid.rho = h.rho;
+	solver.timestep = h.timestep;
+	solver.frame = h.frame;
+	solver.steps = h.steps;
+	solver.seed = h.seed;
+	solver.rng.state = h.rng_state;
+	solver.rng.inc = h.rng_inc;
+	return true;
+}
+
+void Checkpoint_Writer::write(const FluidSolver &solver, const std::string &path_)
+{
+	wait();
+	serialize(solver, buffer);
+	path = path_;
+	worker = std::thread([this]() { ok = write_file(buffer, path); });
+}
+
+bool Checkpoint_Writer::wait()
+{
+	if (worker.joinable())
+	{
+		worker.join();
+		if (!ok)
+			std::cerr << "Could not write the checkpoint " << path << "\n";
+	}
+	return ok;
+}
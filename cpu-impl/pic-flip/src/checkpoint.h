@@ -0,0 +1,61 @@
+#pragma once
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fluid_solver.h"
+
+#define CHECKPOINT_VERSION 2 // Version 1 files, without the narrow band, are still read
+
+//----------------------------------------------------------------------------//
+// Checkpoint file, little endian: the magic "PFCK", the version, then the 
+// header fields below in order, then the arrays: the currnp particle 
+// positions and velocities one component after the other as float, the u, v 
+// and w velocities as float and the marker as char, in i, j, k order 
+// independent of the Array3 layout, the pressure as double, the narrow band
+// width as float and, if it is non-zero, a char for whether phi is built and
+// phi as float in i, j, k order, and last an FNV-1a hash of everything 
+// before it. Restarting from a checkpoint with the same solver settings 
+// continues bit identical to the uninterrupted run.
+//----------------------------------------------------------------------------//
+struct Checkpoint_Header
+{
+	unsigned int version;
+	int dimx, dimy, dimz;
+	float h, timestep, gravity, rho;
+	int frame, steps;
+	unsigned int seed;
+	unsigned long long rng_state, rng_inc;
+	int currnp;
+};
+
+bool save_checkpoint(const FluidSolver &solver, const std::string &path);
+bool read_checkpoint_header(const std::string &path, Checkpoint_Header &header);
+
+// The solver must have the grid dimensions of the checkpoint and room for its particles
+bool load_checkpoint(FluidSolver &solver, const std::string &path);
+
+//----------------------------------------------------------------------------//
+// Writes checkpoints on a background thread. write() copies the solver state 
+// into a buffer, so the solver can continue right away, and waits for the 
+// previous write first. Files are written under a temporary name and renamed 
+// when complete, so a crash never leaves a partial checkpoint.
+//----------------------------------------------------------------------------//
+struct Checkpoint_Writer
+{
+	std::thread worker;
+	std::vector<char> buffer;
+	std::string path;
+	bool ok; // Whether the last finished write succeeded
+
+	Checkpoint_Writer() : ok(true) {}
+	~Checkpoint_Writer() { wait(); }
+
+	void write(const FluidSolver &solver, const std::string &path);
+	bool wait(); // Waits for the write in progress, returns ok
+};
+
+#endif
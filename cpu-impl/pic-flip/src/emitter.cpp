@@ -0,0 +1,151 @@
+#include "emitter.h"
+
+#include <cmath>
+
+Region box_region(const vec3f &lo, const vec3f &hi)
+{
+	Region r;
+	r.shape = REGION_BOX;
+	r.lo = lo; r.hi = hi;
+	r.centre = vec3f(0.0f); r.radius = 0.0f;
+	return r;
+}
+
+Region sphere_region(const vec3f &centre, float radius)
+{
+	Region r;
+	r.shape = REGION_SPHERE;
+	r.lo = centre - vec3f(radius); r.hi = centre + vec3f(radius);
+	r.centre = centre; r.radius = radius;
+	return r;
+}
+
+Region plane_region(const vec3f &lo, const vec3f &hi)
+{
+	Region r = box_region(lo, hi);
+	r.shape = REGION_PLANE;
+	return r;
+}
+
+bool Region::contains(float x, float y, float z) const
+{
+	if (shape == REGION_SPHERE)
+	{
+		float dx = x - centre.v[0], dy = y - centre.v[1], dz = z - centre.v[2];
+		return dx * dx + dy * dy + dz * dz <= radius * radius;
+	}
+	if (shape == REGION_BOX)
+		return x >= lo.v[0] && x < hi.v[0] && y >= lo.v[1] && y < hi.v[1] && z >= lo.v[2] && z < hi.v[2];
+	return false;
+}
+
+int Region::normal_axis() const
+{
+	int axis = 0;
+	for (int a = 1; a < 3; ++a)
+	{
+		if (hi.v[a] - lo.v[a] < hi.v[axis] - lo.v[axis])
+			axis = a;
+	}
+	return axis;
+}
+
+float Emitter::particle_rate(float h) const
+{
+	if (rate > 0.0f || region.shape != REGION_PLANE)
+		return rate;
+
+	// EMIT_DENSITY particles per cell of the volume flowing through the plane
+	int n = region.normal_axis();
+	float area = 1.0f;
+	for (int a = 0; a < 3; ++a)
+	{
+		if (a != n)
+			area *= region.hi.v[a] - region.lo.v[a];
+	}
+	return EMIT_DENSITY * area * std::fabs(velocity.v[n]) / (h * h * h);
+}
+
+//----------------------------------------------------------------------------//
+// Emits n particles from first on. Every block of EMIT_BLOCK particles draws
+// from its own stream, seeded from base, so the blocks fill their part of the
+// reserved range in parallel and the result does not depend on the number of
+// threads. Particles outside the grid are clamped to its walls.
+//----------------------------------------------------------------------------//
+static void emit(const Emitter &e, Particles &particles, const Grid &grid, int first, int n, unsigned long long base, float dt)
+{
+	const Region &r = e.region;
+	const float lo[3] = { 1.001f * grid.h, 1.001f * grid.h, 1.001f * grid.h };
+	const float hi[3] = { (grid.Nx - 1.001f) * grid.h, (grid.Ny - 1.001f) * grid.h, (grid.Nz - 1.001f) * grid.h };
+	int nblocks = (n + EMIT_BLOCK - 1) / EMIT_BLOCK;
+
+#pragma omp parallel for schedule(static)
+	for (int b = 0; b < nblocks; ++b)
+	{
+		Random rng;
+		rng.seed(base + (unsigned long long)b);
+
+		for (int p = first + b * EMIT_BLOCK; p < first + min(n, (b + 1) * EMIT_BLOCK); ++p)
+		{
+			float x[3];
+			do
+			{
+				for (int a = 0; a < 3; ++a)
+					x[a] = r.lo.v[a] + rng.uniform() * (r.hi.v[a] - r.lo.v[a]);
+			} while (r.shape == REGION_SPHERE && !r.contains(x[0], x[1], x[2]));
+
+			if (r.shape == REGION_PLANE)
+			{
+				float s = rng.uniform() * dt;
+				for (int a = 0; a < 3; ++a)
+					x[a] += s * e.velocity.v[a];
+			}
+
+			// Kept inside the walls, like move_particles_in_grid
+			for (int a = 0; a < 3; ++a)
+			{
+				clamp(x[a], lo[a], hi[a]);
+				particles.pos[a][p] = x[a];
+				particles.vel[a][p] = e.velocity.v[a];
+			}
+		}
+	}
+}
+
+int emit_particles(const std::vector<Emitter> &emitters, Particles &particles, const Grid &grid, Random &rng, double time, float dt)
+{
+	int added = 0;
+	for (size_t i = 0; i < emitters.size(); ++i)
+	{
+		// The particles emitted up to the end of the step, less those up to its start
+		double rate = emitters[i].particle_rate(grid.h);
+		int n = (int)(std::floor(rate * (time + dt)) - std::floor(rate * time));
+		if (n <= 0)
+			continue;
+
+		int first = reserve_particles(particles, n);
+		unsigned long long base = rng.next();
+		base = (base << 32) | rng.next();
+		emit(emitters[i], particles, grid, first, n, base, dt);
+		added += n;
+	}
+	return added;
+}
+
+int apply_sinks(const std::vector<Region> &sinks, Particles &particles)
+{
+	if (sinks.empty())
+		return 0;
+
+	int np = particles.currnp;
+	std::vector<char> inside(np, 0);
+
+#pragma omp parallel for schedule(static)
+	for (int p = 0; p < np; ++p)
+	{
+		for (size_t s = 0; s < sinks.size() && !inside[p]; ++s)
+			inside[p] = sinks[s].contains(particles.pos[0][p], particles.pos[1][p], particles.pos[2][p]);
+	}
+
+	return compact_particles(particles, inside);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef EMITTER_H_
+#define EMITTER_H_
+
+#include <vector>
+
+#include "grid.h"
+#include "particles.h"
+#include "util.h"
+#include "vector3.h"
+
+// Shapes of a Region
+#define REGION_BOX 0
+#define REGION_SPHERE 1
+#define REGION_PLANE 2 // A rectangle, lo and hi are equal along its normal axis
+
+#define EMIT_DENSITY 8 // Particles per cell of the derived inflow rate, as init_box
+#define EMIT_BLOCK 1024 // Particles per parallel block and random stream of an emission
+
+//----------------------------------------------------------------------------//
+// A box, sphere or rectangle in world coordinates
+//----------------------------------------------------------------------------//
+struct Region
+{
+	int shape;
+	vec3f lo, hi; // Corners of a box or plane
+	vec3f centre; // Of a sphere
+	float radius;
+
+	bool contains(float x, float y, float z) const;
+	int normal_axis() const; // The flat axis of a plane
+};
+
+Region box_region(const vec3f &lo, const vec3f &hi);
+Region sphere_region(const vec3f &centre, float radius);
+Region plane_region(const vec3f &lo, const vec3f &hi);
+
+//----------------------------------------------------------------------------//
+// Emits rate particles per second at random positions in region, with the
+// given velocity. A plane is an inflow: its particles are spread over the
+// slab the velocity sweeps during the step, so the stream has no gaps, and a
+// rate of 0 gives EMIT_DENSITY particles per cell of inflowing liquid. The
+// particles of a step follow from the simulation time, so a run restarted
+// from a checkpoint emits the same particles.
+//----------------------------------------------------------------------------//
+struct Emitter
+{
+	Region region;
+	vec3f velocity;
+	float rate; // Particles per second
+
+	Emitter() : rate(0.0f) {}
+	Emitter(const Region &r, const vec3f &vel, float rate_) : region(r), velocity(vel), rate(rate_) {}
+
+	float particle_rate(float h) const; // rate, or the one derived for an inflow
+};
+
+// Adds the particles of the step [time, time + dt), up to maxnp. Returns the particles added.
+int emit_particles(const std::vector<Emitter> &emitters, Particles &particles, const Grid &grid, Random &rng, double time, float dt);
+// Deletes the particles inside any of the sinks. Returns the particles removed.
+int apply_sinks(const std::vector<Region> &sinks, Particles &particles);
+
+#endif
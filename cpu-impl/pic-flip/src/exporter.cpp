@@ -0,0 +1,491 @@
+#include "exporter.h"
+#include "fluid_solver.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+//----------------------------------------------------------------------------//
+// Byte buffers
+//----------------------------------------------------------------------------//
+static void put(std::vector<char> &b, const void *data, size_t size)
+{
+	b.insert(b.end(), (const char *)data, (const char *)data + size);
+}
+
+template<class T>
+static void put_value(std::vector<char> &b, const T &v)
+{
+	put(b, &v, sizeof(T));
+}
+
+static void put_text(std::vector<char> &b, const char *text)
+{
+	put(b, text, std::strlen(text));
+}
+
+//----------------------------------------------------------------------------//
+// LZ4 block compression, greedy with a hash table of the last position of
+// every 4 byte sequence. The output is a standard LZ4 block: sequences of a
+// token, literals, a 16 bit offset and the match length, where the last 5
+// bytes are literals and no match starts in the last 12 bytes.
+//----------------------------------------------------------------------------//
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_HASH_BITS 16
+
+static inline unsigned int read32(const unsigned char *p)
+{
+	unsigned int v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void lz4_length(std::vector<char> &out, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		out.push_back((char)255);
+	out.push_back((char)len);
+}
+
+static void lz4_sequence(std::vector<char> &out, const unsigned char *literals, size_t nliterals, size_t offset, size_t matchlen)
+{
+	size_t ml = matchlen ? matchlen - LZ4_MINMATCH : 0;
+	out.push_back((char)(((nliterals < 15 ? nliterals : 15) << 4) | (ml < 15 ? ml : 15)));
+	if (nliterals >= 15)
+		lz4_length(out, nliterals - 15);
+	put(out, literals, nliterals);
+
+	if (matchlen)
+	{
+		out.push_back((char)(offset & 0xff));
+		out.push_back((char)(offset >> 8));
+		if (ml >= 15)
+			lz4_length(out, ml - 15);
+	}
+}
+
+static void lz4_compress(const unsigned char *src, size_t n, std::vector<char> &out)
+{
+	std::vector<long long> table((size_t)1 << LZ4_HASH_BITS, -1);
+	size_t anchor = 0, ip = 0;
+
+	while (n > LZ4_MFLIMIT && ip < n - LZ4_MFLIMIT)
+	{
+		unsigned int seq = read32(src + ip);
+		unsigned int h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+		long long ref = table[h];
+		table[h] = (long long)ip;
+
+		if (ref < 0 || ip - (size_t)ref > 65535 || read32(src + ref) != seq)
+		{
+			++ip;
+			continue;
+		}
+
+		size_t len = LZ4_MINMATCH, maxlen = n - LZ4_LASTLITERALS - ip;
+		while (len < maxlen && src[ref + len] == src[ip + len])
+			++len;
+
+		lz4_sequence(out, src + anchor, ip - anchor, ip - (size_t)ref, len);
+		ip += len;
+		anchor = ip;
+	}
+
+	lz4_sequence(out, src + anchor, n - anchor, 0, 0);
+}
+
+static bool lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t rawsize)
+{
+	size_t ip = 0, op = 0;
+	while (ip < n)
+	{
+		unsigned int token = src[ip++];
+
+		size_t nliterals = token >> 4;
+		if (nliterals == 15)
+		{
+			unsigned char c;
+			do
+			{
+				if (ip >= n)
+					return false;
+				c = src[ip++];
+				nliterals += c;
+			} while (c == 255);
+		}
+		if (nliterals > n - ip || nliterals > rawsize - op)
+			return false;
+		std::memcpy(dst + op, src + ip, nliterals);
+		ip += nliterals;
+		op += nliterals;
+
+		if (ip == n)
+			break; // The last sequence has no match
+
+		if (n - ip < 2)
+			return false;
+		size_t offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+
+		size_t len = (token & 15) + LZ4_MINMATCH;
+		if ((token & 15) == 15)
+		{
+			unsigned char c;
+			do
+			{
+				if (ip >= n)
+					return false;
+				c = src[ip++];
+				len += c;
+			} while (c == 255);
+		}
+		if (offset == 0 || offset > op || len > rawsize - op)
+			return false;
+
+		// Byte by byte, the match may overlap its own output
+		for (size_t i = 0; i < len; ++i, ++op)
+			dst[op] = dst[op - offset];
+	}
+	return op == rawsize;
+}
+
+//----------------------------------------------------------------------------//
+// Byte shuffle over elements of s bytes, makes the exponent bytes of floats
+// and the high bytes of integers compress together
+//----------------------------------------------------------------------------//
+static void shuffle(const char *src, char *dst, size_t n, int s)
+{
+	size_t count = n / s;
+	for (size_t e = 0; e < count; ++e)
+		for (int b = 0; b < s; ++b)
+			dst[b * count + e] = src[e * s + b];
+	std::memcpy(dst + count * s, src + count * s, n - count * s);
+}
+
+static void unshuffle(const char *src, char *dst, size_t n, int s)
+{
+	size_t count = n / s;
+	for (size_t e = 0; e < count; ++e)
+		for (int b = 0; b < s; ++b)
+			dst[e * s + b] = src[b * count + e];
+	std::memcpy(dst + count * s, src + count * s, n - count * s);
+}
+
+static const int export_shuffle = 4; // Most of the data are 4 byte floats
+
+static void compress(const std::vector<char> &raw, std::vector<char> &out)
+{
+	std::vector<char> shuffled(raw.size());
+	if (!raw.empty())
+		shuffle(&raw[0], &shuffled[0], raw.size(), export_shuffle);
+
+	out.clear();
+	put_text(out, "PFLZ");
+	put_value(out, (unsigned int)EXPORT_COMPRESSED_VERSION);
+	put_value(out, (unsigned int)export_shuffle);
+	put_value(out, (unsigned long long)raw.size());
+	size_t sizeat = out.size();
+	put_value(out, (unsigned long long)0);
+
+	size_t blockat = out.size();
+	lz4_compress(shuffled.empty() ? NULL : (const unsigned char *)&shuffled[0], shuffled.size(), out);
+	unsigned long long blocksize = out.size() - blockat;
+	std::memcpy(&out[sizeat], &blocksize, sizeof(blocksize));
+}
+
+bool read_export_file(const std::string &path, std::vector<char> &data)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+
+	std::vector<char> file;
+	char chunk[1 << 16];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		file.insert(file.end(), chunk, chunk + n);
+	bool ok = !ferror(f);
+	fclose(f);
+	if (!ok)
+		return false;
+
+	const size_t header = 4 + 4 + 4 + 8 + 8;
+	if (file.size() < header || std::memcmp(&file[0], "PFLZ", 4) != 0)
+	{
+		data.swap(file);
+		return true;
+	}
+
+	unsigned int version, s;
+	unsigned long long rawsize, blocksize;
+	std::memcpy(&version, &file[4], 4);
+	std::memcpy(&s, &file[8], 4);
+	std::memcpy(&rawsize, &file[12], 8);
+	std::memcpy(&blocksize, &file[20], 8);
+	if (version != EXPORT_COMPRESSED_VERSION || s == 0 || blocksize != file.size() - header)
+		return false;
+
+	std::vector<char> shuffled(rawsize);
+	if (!lz4_decompress((const unsigned char *)&file[0] + header, blocksize, rawsize ? (unsigned char *)&shuffled[0] : NULL, rawsize))
+		return false;
+
+	data.resize(rawsize);
+	if (rawsize)
+		unshuffle(&shuffled[0], &data[0], rawsize, s);
+	return true;
+}
+
+//----------------------------------------------------------------------------//
+// The formats
+//----------------------------------------------------------------------------//
+
+// Scale of the 16 bit positions, the grid extent over 65535
+static void quantize_scale(const Export_Snapshot &s, float scale[3])
+{
+	scale[0] = s.marker.nx * s.h / 65535.0f;
+	scale[1] = s.marker.ny * s.h / 65535.0f;
+	scale[2] = s.marker.nz * s.h / 65535.0f;
+}
+
+static inline unsigned short quantize(float x, float scale)
+{
+	float q = std::floor(x / scale + 0.5f);
+	return (unsigned short)(q < 0.0f ? 0.0f : (q > 65535.0f ? 65535.0f : q));
+}
+
+static void put_positions(std::vector<char> &b, const Export_Snapshot &s, bool quantized)
+{
+	float scale[3];
+	quantize_scale(s, scale);
+	for (int p = 0; p < s.np; ++p)
+		for (int c = 0; c < 3; ++c)
+		{
+			if (quantized)
+				put_value(b, quantize(s.pos[c][p], scale[c]));
+			else
+				put_value(b, s.pos[c][p]);
+		}
+}
+
+static void put_velocities(std::vector<char> &b, const Export_Snapshot &s)
+{
+	for (int p = 0; p < s.np; ++p)
+		for (int c = 0; c < 3; ++c)
+			put_value(b, s.vel[c][p]);
+}
+
+static void format_raw(const Export_Snapshot &s, bool quantized, std::vector<char> &b)
+{
+	if (quantized)
+	{
+		float scale[3];
+		quantize_scale(s, scale);
+		put_text(b, "PFQP");
+		put_value(b, s.np);
+		put(b, scale, sizeof(scale));
+	}
+	else
+		put_value(b, s.np);
+
+	put_positions(b, s, quantized);
+	put_velocities(b, s);
+}
+
+static void format_ply(const Export_Snapshot &s, bool quantized, std::vector<char> &b)
+{
+	char line[128];
+	put_text(b, "ply\nformat binary_little_endian 1.0\n");
+	snprintf(line, sizeof(line), "comment pic-flip frame %d\n", s.frame);
+	put_text(b, line);
+
+	const char *type = "float";
+	if (quantized)
+	{
+		float scale[3];
+		quantize_scale(s, scale);
+		snprintf(line, sizeof(line), "comment scale %.9g %.9g %.9g\n", scale[0], scale[1], scale[2]);
+		put_text(b, line);
+		type = "ushort";
+	}
+
+	snprintf(line, sizeof(line), "element vertex %d\nproperty %s x\nproperty %s y\nproperty %s z\n", s.np, type, type, type);
+	put_text(b, line);
+	put_text(b, "property float vx\nproperty float vy\nproperty float vz\nend_header\n");
+
+	float scale[3];
+	quantize_scale(s, scale);
+	for (int p = 0; p < s.np; ++p)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			if (quantized)
+				put_value(b, quantize(s.pos[c][p], scale[c]));
+			else
+				put_value(b, s.pos[c][p]);
+		}
+		for (int c = 0; c < 3; ++c)
+			put_value(b, s.vel[c][p]);
+	}
+}
+
+static void put_cell_velocity(std::vector<char> &b, const Export_Snapshot &s, int i, int j, int k)
+{
+	float vel[3] = {
+		0.5f * (s.u(i, j, k) + s.u(i + 1, j, k)),
+		0.5f * (s.v(i, j, k) + s.v(i, j + 1, k)),
+		0.5f * (s.w(i, j, k) + s.w(i, j, k + 1))
+	};
+	put(b, vel, sizeof(vel));
+}
+
+static void format_volume(const Export_Snapshot &s, bool sparse, std::vector<char> &b)
+{
+	const Array3c &m = s.marker;
+	put_text(b, sparse ? "PFVS" : "PFVD");
+	put_value(b, (unsigned int)EXPORT_VOLUME_VERSION);
+	put_value(b, m.nx);
+	put_value(b, m.ny);
+	put_value(b, m.nz);
+	put_value(b, s.h);
+
+	if (!sparse)
+	{
+		put(b, m.data, m.size);
+		for (int k = 0; k < m.nz; ++k)
+			for (int j = 0; j < m.ny; ++j)
+				for (int i = 0; i < m.nx; ++i)
+					put_cell_velocity(b, s, i, j, k);
+		return;
+	}
+
+	Fluid_Cells cells;
+	cells.build(m);
+	put_value(b, cells.runs());
+	for (int r = 0; r < cells.runs(); ++r)
+	{
+		put_value(b, cells.begin[r]);
+		put_value(b, cells.end[r]);
+	}
+	for (int r = 0; r < cells.runs(); ++r)
+		put(b, m.data + cells.begin[r], cells.end[r] - cells.begin[r]);
+	for (int r = 0; r < cells.runs(); ++r)
+		for (int n = cells.begin[r]; n < cells.end[r]; ++n)
+			put_cell_velocity(b, s, n % m.nx, (n / m.nx) % m.ny, n / (m.nx * m.ny));
+}
+
+static bool write_file(const std::string &path, const std::vector<char> &b)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f)
+	{
+		std::cerr << "Could not open " << path << " for writing\n";
+		return false;
+	}
+	bool ok = b.empty() || fwrite(&b[0], 1, b.size(), f) == b.size();
+	ok = fclose(f) == 0 && ok;
+	if (!ok)
+		std::cerr << "Could not write " << path << "\n";
+	return ok;
+}
+
+static bool write_snapshot(const Export_Snapshot &s, const Export_Options &options)
+{
+	static const struct { int format; const char *ext, *qext; } formats[] = {
+		{ EXPORT_RAW, ".bin", ".qbin" },
+		{ EXPORT_PLY, ".ply", ".ply" },
+		{ EXPORT_VOLUME, ".vol", ".vol" },
+		{ EXPORT_SPARSE_VOLUME, ".svol", ".svol" }
+	};
+
+	bool ok = true;
+	std::vector<char> b, z;
+	for (size_t n = 0; n < sizeof(formats) / sizeof(formats[0]); ++n)
+	{
+		if (!(options.formats & formats[n].format))
+			continue;
+
+		b.clear();
+		switch (formats[n].format)
+		{
+		case EXPORT_RAW: format_raw(s, options.quantize, b); break;
+		case EXPORT_PLY: format_ply(s, options.quantize, b); break;
+		case EXPORT_VOLUME: format_volume(s, false, b); break;
+		default: format_volume(s, true, b); break;
+		}
+
+		char name[32];
+		snprintf(name, sizeof(name), "_%04d%s%s", s.frame, options.quantize ? formats[n].qext : formats[n].ext, options.compress ? ".lz" : "");
+		if (options.compress)
+		{
+			compress(b, z);
+			ok = write_file(options.prefix + name, z) && ok;
+		}
+		else
+			ok = write_file(options.prefix + name, b) && ok;
+	}
+	return ok;
+}
+
+//----------------------------------------------------------------------------//
+// Frame_Exporter
+//----------------------------------------------------------------------------//
+void Frame_Exporter::init(const Export_Options &options_)
+{
+	wait();
+	options = options_;
+	current = 0;
+	ok = true;
+}
+
+static void copy_array(const Array3f &src, Array3f &dst)
+{
+	if (dst.nx != src.nx || dst.ny != src.ny || dst.nz != src.nz)
+		dst.init(src.nx, src.ny, src.nz);
+	src.copy_to(dst);
+}
+
+void Frame_Exporter::submit(const FluidSolver &solver)
+{
+	if (options.prefix.empty() || options.formats == 0 || solver.frame % options.every != 0)
+		return;
+
+	// The other snapshot may still be written, this one is free
+	Export_Snapshot &s = snapshots[current];
+	const Particles &particles = solver.particles;
+	const Grid &grid = solver.grid;
+
+	s.frame = solver.frame;
+	s.np = particles.currnp;
+	s.h = grid.h;
+	for (int c = 0; c < 3; ++c)
+	{
+		s.pos[c].assign(particles.pos[c], particles.pos[c] + s.np);
+		s.vel[c].assign(particles.vel[c], particles.vel[c] + s.np);
+	}
+
+	if (options.formats & (EXPORT_VOLUME | EXPORT_SPARSE_VOLUME))
+	{
+		if (s.marker.nx != grid.marker.nx || s.marker.ny != grid.marker.ny || s.marker.nz != grid.marker.nz)
+			s.marker.init(grid.marker.nx, grid.marker.ny, grid.marker.nz);
+		grid.marker.copy_to(s.marker);
+		copy_array(grid.u, s.u);
+		copy_array(grid.v, s.v);
+		copy_array(grid.w, s.w);
+	}
+	else if (s.marker.nx != grid.marker.nx)
+		s.marker.init(grid.marker.nx, grid.marker.ny, grid.marker.nz); // For the extent of the quantized positions
+
+	wait();
+	worker = std::thread([this, &s]() { if (!write_snapshot(s, options)) ok = false; });
+	current ^= 1;
+}
+
+bool Frame_Exporter::wait()
+{
+	if (worker.joinable())
+		worker.join();
+	return ok;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#ifndef EXPORTER_H_
+#define EXPORTER_H_
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "array3d.h"
+
+struct FluidSolver;
+
+// Output formats of the Frame_Exporter, combined with |
+#define EXPORT_RAW 1 // PREFIX_NNNN.bin: int32 count, count * xyz positions, count * xyz velocities
+#define EXPORT_PLY 2 // PREFIX_NNNN.ply: binary PLY vertices x y z vx vy vz
+#define EXPORT_VOLUME 4 // PREFIX_NNNN.vol: dense marker and cell centred velocity grids
+#define EXPORT_SPARSE_VOLUME 8 // PREFIX_NNNN.svol: the same channels on the fluid cells only
+
+#define EXPORT_VOLUME_VERSION 1
+#define EXPORT_COMPRESSED_VERSION 1
+
+//----------------------------------------------------------------------------//
+// File layouts, all little endian:
+//
+// Quantized positions: .bin becomes .qbin, magic "PFQP", int32 count, float
+// scale[3], then count * uint16 xyz positions, position = q * scale, and the
+// count * float xyz velocities. The PLY stores x y z as ushort and gives the
+// scale in a "comment scale sx sy sz" header line.
+//
+// Volumes: magic "PFVD" (dense) or "PFVS" (sparse), uint32 version, int32
+// dimx, dimy, dimz, float h. Sparse volumes then list the fluid cells as
+// int32 nruns and nruns (begin, end) pairs of linear cell indices
+// i + dimx * (j + dimy * k). The channels follow: every cell's char marker,
+// then every cell's float xyz velocity, over all cells in linear order or
+// over the runs.
+//
+// Compressed files get ".lz" appended: magic "PFLZ", uint32 version, uint32
+// shuffle, uint64 raw size, uint64 compressed size, then one LZ4 block of
+// the uncompressed file. With shuffle s > 1 the file was byte shuffled
+// first: the bytes of the first raw size / s * s bytes, seen as elements of
+// s bytes, stored byte plane by byte plane. read_export_file undoes both.
+//----------------------------------------------------------------------------//
+
+struct Export_Options
+{
+	std::string prefix;
+	int formats; // EXPORT_* flags
+	int every; // Export every N:th frame
+	bool quantize; // Positions as 16 bit fixed point over the grid extent
+	bool compress;
+
+	Export_Options() : formats(EXPORT_RAW), every(1), quantize(false), compress(false) {}
+};
+
+// The state of one frame, copied from the solver
+struct Export_Snapshot
+{
+	int frame;
+	int np;
+	float h;
+	std::vector<float> pos[3], vel[3];
+	Array3c marker;
+	Array3f u, v, w;
+};
+
+//----------------------------------------------------------------------------//
+// Writes frames on a background thread while the solver continues. submit()
+// copies the solver state into one of two snapshots and starts writing it,
+// after the write of the other snapshot, started by the previous submit(),
+// has finished. The solver thus only waits if writing a frame takes longer
+// than computing one.
+//----------------------------------------------------------------------------//
+struct Frame_Exporter
+{
+	Export_Options options;
+	Export_Snapshot snapshots[2];
+	int current; // The snapshot filled by the next submit
+	std::thread worker;
+	bool ok; // Whether every finished write succeeded
+
+	Frame_Exporter() : current(0), ok(true) {}
+	~Frame_Exporter() { wait(); }
+
+	void init(const Export_Options &options_);
+	void submit(const FluidSolver &solver); // Exports frame solver.frame if it is due
+	bool wait(); // Waits for the write in progress, returns ok
+};
+
+// Reads an exported file, decompressing it if it is compressed
+bool read_export_file(const std::string &path, std::vector<char> &data);
+
+#endif
@@ -1,7 +1,10 @@
 #include "fluid_solver.h"
 
+#include <ctime>
+
 FluidSolver::FluidSolver(int dimx, int dimy, int dimz, float h, float timestep, float gravity, float rho, int max_particles)
-	: dimx(dimx), dimy(dimy), dimz(dimz), timestep(timestep)
+	: dimx(dimx), dimy(dimy), dimz(dimz), timestep(timestep), frame(0), steps(0), time(0.0), sort_interval(10), advection(ADVECT_EULER), advect_cfl(ADVECT_CFL),
+	solve_iterations(SOLVE_MAX_ITERATIONS), divergence_target(0.0f), seed((unsigned int)::time(NULL))
 {
 	grid.init(dimx, dimy, dimz, h, gravity, rho);
 	particles.init(max_particles, grid);
@@ -10,115 +13,192 @@ FluidSolver::FluidSolver(int dimx, int dimy, int dimz, float h, float timestep,
 void FluidSolver::reset()
 {
 	particles.clear();
+	steps = 0;
+	seed = (unsigned int)::time(NULL);
 	init_box();
 
 }
 
-void FluidSolver::init_box()
+//----------------------------------------------------------------------------//
+// Seeds 2x2x2 jittered particles in every interior cell of the box 
+// [i0, i1) x [j0, j1) x [k0, k1), clipped to the grid
+//----------------------------------------------------------------------------//
+static void seed_box(Particles &particles, Grid &grid, Random &rng, int i0, int i1, int j0, int j1, int k0, int k1)
 {
-	srand(time(NULL));
 	float r1, r2, r3;
 	float subh = grid.h / 2.0f;
 	vec3f pos(0);
 
-	for (float k = 1; k < 10; ++k)
-		for (float j = 1; j < 10; ++j)
-			for (float i = 1; i < 10; ++i)
-			{
-				for (int kk = -1; kk < 1; ++kk)
-					for (int jj = -1; jj < 1; ++jj)
-						for (int ii = -1; ii < 1; ++ii)
-						{
-							r1 = float(rand()) / RAND_MAX - 0.5f; //[-0.5, 0.5]
-							r2 = float(rand()) / RAND_MAX - 0.5f;
-							r3 = float(rand()) / RAND_MAX - 0.5f;
-							pos[0] = (i + 0.5f) * grid.h + (ii + 0.5f + 0.95f * r1) * subh;
-							pos[1] = (j + 0.5f) * grid.h + (jj + 0.5f + 0.95f * r2) * subh;
-							pos[2] = (k + 0.5f) * grid.h + (kk + 0.5f + 0.95f * r3) * subh;
-							add_particle(particles, pos, vec3f(0.f));
-						}
-			}
+	i1 = min(i1, grid.Nx - 1);
+	j1 = min(j1, grid.Ny - 1);
+	k1 = min(k1, grid.Nz - 1);
 
-	for (float k = 20; k < 30; ++k)
-		for (float j = 20; j < 30; ++j)
-			for (float i = 40; i < 50; ++i)
+	for (int k = k0; k < k1; ++k)
+		for (int j = j0; j < j1; ++j)
+			for (int i = i0; i < i1; ++i)
 			{
 				for (int kk = -1; kk < 1; ++kk)
 					for (int jj = -1; jj < 1; ++jj)
 						for (int ii = -1; ii < 1; ++ii)
 						{
-							r1 = float(rand()) / RAND_MAX - 0.5f; //[-0.5, 0.5]
-							r2 = float(rand()) / RAND_MAX - 0.5f;
-							r3 = float(rand()) / RAND_MAX - 0.5f;
+							r1 = rng.uniform() - 0.5f; //[-0.5, 0.5)
+							r2 = rng.uniform() - 0.5f;
+							r3 = rng.uniform() - 0.5f;
 							pos[0] = (i + 0.5f) * grid.h + (ii + 0.5f + 0.95f * r1) * subh;
 							pos[1] = (j + 0.5f) * grid.h + (jj + 0.5f + 0.95f * r2) * subh;
 							pos[2] = (k + 0.5f) * grid.h + (kk + 0.5f + 0.95f * r3) * subh;
 							add_particle(particles, pos, vec3f(0.0f));
 						}
 			}
+}
 
-	for (float k = 43; k < 53; ++k)
-		for (float j = 1; j < 10; ++j)
-			for (float i = 79; i < 89; ++i)
-			{
-				for (int kk = -1; kk < 1; ++kk)
-					for (int jj = -1; jj < 1; ++jj)
-						for (int ii = -1; ii < 1; ++ii)
-						{
-							r1 = float(rand()) / RAND_MAX - 0.5f; //[-0.5, 0.5]
-							r2 = float(rand()) / RAND_MAX - 0.5f;
-							r3 = float(rand()) / RAND_MAX - 0.5f;
-							pos[0] = (i + 0.5f) * grid.h + (ii + 0.5f + 0.95f * r1) * subh;
-							pos[1] = (j + 0.5f) * grid.h + (jj + 0.5f + 0.95f * r2) * subh;
-							pos[2] = (k + 0.5f) * grid.h + (kk + 0.5f + 0.95f * r3) * subh;
-							add_particle(particles, pos, vec3f(0.0f));
-						}
-			}
+void FluidSolver::init_box()
+{
+	rng.seed(seed);
+
+	seed_box(particles, grid, rng, 1, 10, 1, 10, 1, 10);
+	seed_box(particles, grid, rng, 40, 50, 20, 30, 20, 30);
+	seed_box(particles, grid, rng, 79, 89, 1, 10, 43, 53);
 }
 
 void FluidSolver::step_frame()
 {
-	static int frame = 0;
+	double start_us = profiler.enabled ? profiler.now_us() : 0.0;
+	profiler.begin_frame(frame + 1);
 
 	for (float elapsed = 0; elapsed < timestep;)
 	{
-
-		float dt = grid.CFL();
+		float dt;
+		{
+			Scoped_Timer t(profiler, STAGE_CFL);
+			dt = grid.CFL();
+		}
 		if (dt > timestep - elapsed)
 			dt = timestep - elapsed;
 
+		// From the frame count, so a restarted run steps through the same times
+		time = frame * (double)timestep + elapsed;
 		elapsed += dt;
 
 		step(dt);
+		++profiler.current.substeps;
 	}
 	frame++;
+
+	if (profiler.enabled)
+		profiler.end_frame(start_us, particles.currnp);
 }
 
 void FluidSolver::step(float dt)
 {
+	{
+		Scoped_Timer t(profiler, STAGE_ADVECT);
+		// grid.extend_velocity();
+		if (advection == ADVECT_EULER)
+		{
+			for (int i = 0; i < 5; i++)
+				move_particles_in_grid(particles, grid, 0.2f * dt);
+		}
+		else
+			advect_particles(particles, grid, dt, advection, advect_cfl);
+	}
 
-	// grid.extend_velocity();
-	for (int i = 0; i < 5; i++)
-		move_particles_in_grid(particles, grid, 0.2f * dt);
+	if (!emitters.empty() || !sinks.empty())
+	{
+		Scoped_Timer t(profiler, STAGE_EMIT);
+		profiler.current.removed += apply_sinks(sinks, particles);
+		profiler.current.added += emit_particles(emitters, particles, grid, rng, time, dt);
+	}
 
-	grid.zero();
+	if (band.enabled())
+	{
+		// Needs the grid velocity of the last step, before grid.zero
+		Scoped_Timer t(profiler, STAGE_NARROW_BAND);
+		advect_narrow_band(band, grid, dt);
+		build_narrow_band(band, particles, grid);
+	}
 
-	grid.classify_voxel();
+	{
+		Scoped_Timer t(profiler, STAGE_CLASSIFY);
+		grid.zero();
 
-	transfer_to_grid(particles, grid);
+		grid.classify_voxel();
+	}
 
-	grid.save_velocities();
-	grid.add_gravity(dt);
+	{
+		Scoped_Timer t(profiler, STAGE_SORT);
+		// Every sort_interval steps the particles are reordered by cell, which
+		// keeps the grid accesses of the transfers local. The sort also bins them.
+		if (sort_interval > 0 && steps % sort_interval == 0)
+			sort_particles(particles, grid);
+		else
+			bin_particles(particles, grid);
+	}
 
-	grid.apply_boundary_conditions();
+	{
+		Scoped_Timer t(profiler, STAGE_P2G);
+		int np = particles.currnp;
+		transfer_to_grid(particles, grid);
+		profiler.current.removed += np - particles.currnp;
+	}
+
+	if (band.enabled())
+	{
+		Scoped_Timer t(profiler, STAGE_NARROW_BAND);
+		fill_narrow_band(band, particles, grid);
+	}
+
+	{
+		Scoped_Timer t(profiler, STAGE_FORCES);
+		grid.add_forces(dt);
+
+		grid.apply_boundary_conditions();
+	}
 
 	// Pressure
-	grid.form_poisson(dt);
-	grid.calc_divergence();
-	grid.solve_pressure(100, 1e-6);
-	grid.project(dt);
-
-	grid.apply_boundary_conditions();
-	grid.get_velocity_update();
-	update_from_grid(particles, grid);
+	{
+		Scoped_Timer t(profiler, STAGE_FORM_POISSON);
+		grid.form_poisson(dt);
+	}
+	{
+		Scoped_Timer t(profiler, STAGE_DIVERGENCE);
+		grid.calc_divergence();
+	}
+	{
+		Scoped_Timer t(profiler, STAGE_SOLVE);
+		// The residual is the divergence left in 1/s, a cell changes its volume
+		// by that fraction per second
+		grid.solve_pressure(solve_iterations, SOLVE_TOLERANCE, divergence_target / timestep);
+	}
+	if (profiler.enabled)
+		profiler.add_solve(grid.solve_iterations, grid.solve_residual, grid.fluid_cells.count, grid.solve_history);
+
+	{
+		Scoped_Timer t(profiler, STAGE_PROJECT);
+		grid.project(dt);
+
+		grid.apply_boundary_conditions();
+		grid.get_velocity_update();
+	}
+
+	{
+		Scoped_Timer t(profiler, STAGE_G2P);
+		update_from_grid(particles, grid);
+	}
+
+	if (reseed.enabled())
+	{
+		// Before the narrow band, which moves particles out of the counted cells
+		Scoped_Timer t(profiler, STAGE_RESEED);
+		int added;
+		profiler.current.removed += reseed_particles(reseed, particles, grid, rng, added);
+		profiler.current.added += added;
+	}
+
+	if (band.enabled())
+	{
+		Scoped_Timer t(profiler, STAGE_NARROW_BAND);
+		profiler.current.removed += trim_narrow_band(band, particles, grid, rng);
+	}
+	++steps;
 }
@@ -6,6 +6,11 @@
 #include "grid.h"
 #include "vector3.h"
 #include "unconditioned_cg_solver.h"
+#include "timer.h"
+#include "util.h"
+#include "narrow_band.h"
+#include "reseed.h"
+#include "emitter.h"
 
 struct FluidSolver
 {
@@ -14,6 +19,21 @@ struct FluidSolver
 	
 	int dimx, dimy, dimz;
 	float timestep;
+	int frame; // Number of completed frames
+	int steps; // Number of completed steps
+	double time; // Simulation time at the start of the current step
+	int sort_interval; // Steps between the particle sorts by cell, 0 never sorts
+	int advection; // ADVECT_EULER, ADVECT_RK2 or ADVECT_RK3
+	float advect_cfl; // Cells a particle may move per Runge-Kutta step
+	int solve_iterations; // PCG iterations allowed per pressure solve
+	float divergence_target; // Volume fraction of a cell the pressure solve may leave to diverge per frame, 0 only stops at the relative tolerance
+	unsigned int seed; // Seed for the particle jitter in init_box
+	Random rng; // Seeded by init_box, saved in the checkpoints
+	Narrow_Band band; // Off unless band.width is set
+	Reseeding reseed; // Off unless its counts are set
+	std::vector<Emitter> emitters; // Evaluated every step
+	std::vector<Region> sinks; // Particles inside are deleted every step
+	Profiler profiler; // Stage times and counters of every frame, off by default
 
 	FluidSolver(int dimx, int dimy, int dimz, float h, float timestep, float gravity, float rho, int max_particles);
 
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <vector>
 #include <glm/ext/matrix_transform.hpp>
 #include <glm/ext/matrix_clip_space.hpp>
 #include <glm/vec3.hpp>
@@ -142,14 +143,20 @@ void GLApp::initWireframeCubes(void *positions, void *flags, int nrOfVoxels)
 
 void GLApp::updateParticles(Particles &p)
 {
-	_nrOfParticles = p.pos.size();
-	int size = p.pos.size() * sizeof(vec3f);
+	_nrOfParticles = p.currnp;
+	int size = p.currnp * sizeof(vec3f);
+	std::vector<vec3f> pos(p.currnp), vel(p.currnp);
+	if (p.currnp > 0)
+	{
+		p.copy_positions(&pos[0]);
+		p.copy_velocities(&vel[0]);
+	}
 	glBindVertexArray(_particleVAO);
 	{
 		glBindBuffer(GL_ARRAY_BUFFER, _particleVBO);
 		glBufferData(GL_ARRAY_BUFFER, 2.f * size, 0, GL_STREAM_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, size, &p.pos[0]);
-		glBufferSubData(GL_ARRAY_BUFFER, size, size, &p.vel[0]);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, pos.data());
+		glBufferSubData(GL_ARRAY_BUFFER, size, size, vel.data());
 		glVertexAttribPointer(_particleShader->getAttributeId("vertex"), 3, GL_FLOAT, GL_FALSE, 0, 0);
 		glVertexAttribPointer(_particleShader->getAttributeId("velocity"), 3, GL_FLOAT, GL_FALSE, 0, (GLvoid *)size);
 		glEnableVertexAttribArray(_particleShader->getAttributeId("vertex"));
@@ -158,14 +165,14 @@ void GLApp::updateParticles(Particles &p)
 	glBindVertexArray(0);
 }
 
-void GLApp::updateVoxels(void *positions, Array3f &data, int nrOfVoxels)
+void GLApp::updateVoxels(void *positions, const float *flags, int nrOfVoxels)
 {
 	_nrOfVoxels = nrOfVoxels;
 	size_t PosSize = 3 * sizeof(float) * nrOfVoxels;
 	size_t FlagSize = sizeof(float) * nrOfVoxels;
 	glBindBuffer(GL_ARRAY_BUFFER, _wfCubeFlagsVBO);
 	glBufferSubData(GL_ARRAY_BUFFER, 0, PosSize, positions);
-	glBufferSubData(GL_ARRAY_BUFFER, PosSize, FlagSize, data.data);
+	glBufferSubData(GL_ARRAY_BUFFER, PosSize, FlagSize, flags);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
@@ -28,7 +28,7 @@ public:
 	void initParticles(void *vertices, void *velocities, size_t size, int nrOfParticles);
 	void initWireframeCubes(void *positions, void *flags, int nrOfVoxels);
 	void updateParticles(Particles &p);
-	void updateVoxels(void *positions, Array3f &data, int nrOfVoxels);
+	void updateVoxels(void *positions, const float *flags, int nrOfVoxels);
 
 	void display();
 
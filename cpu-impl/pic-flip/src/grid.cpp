@@ -1,8 +1,13 @@
 #include "grid.h"
+#include "parallel.h"
 
-Grid::Grid() {}
+#include <cstring>
+#include <vector>
 
-Grid::Grid(int Nx_, int Ny_, int Nz_, float h_, float gravity_, float rho_) : Nx(Nx_), Ny(Ny_), Nz(Nz_), h(h_), overh(1.0f / h), gravity(gravity_), rho(rho_)
+Grid::Grid() : solve_iterations(0), solve_residual(0.0), warm_start(false), warm_valid(false), max_speed_valid(false), precision(SOLVER_DOUBLE), poisson_mode(POISSON_MATRIX_FREE), system_precision(-1), system_poisson_mode(-1) {}
+
+Grid::Grid(int Nx_, int Ny_, int Nz_, float h_, float gravity_, float rho_) : Nx(Nx_), Ny(Ny_), Nz(Nz_), h(h_), overh(1.0f / h), gravity(gravity_), rho(rho_),
+	solve_iterations(0), solve_residual(0.0), warm_start(false), warm_valid(false), max_speed_valid(false), precision(SOLVER_DOUBLE), poisson_mode(POISSON_MATRIX_FREE), system_precision(-1), system_poisson_mode(-1)
 {
 	init(Nx_, Ny_, Nz_, h_, gravity_, rho_);
 }
@@ -19,35 +24,89 @@ void Grid::init(int Nx_, int Ny_, int Nz_, float h_, float gravity_, float rho_)
 	dv.init(Nx_, Ny_ + 1, Nz_);
 	dw.init(Nx_, Ny_, Nz_ + 1);
 	marker.init(Nx_, Ny_, Nz_);
-	poisson.init(Nx_, Ny_, Nz_);
-	precond.init(Nx_, Ny_, Nz_);
 	rhs.init(Nx_, Ny_, Nz_);
 	pressure.init(Nx_, Ny_, Nz_);
-	cg.init(Nx_, Ny_, Nz_);
+	warm_marker.init(Nx_, Ny_, Nz_);
+	warm_valid = false;
+	max_speed_valid = false;
+	system_precision = -1;
+	system_poisson_mode = -1;
+	init_pressure_system();
+}
+
+//----------------------------------------------------------------------------//
+// Allocates the matrices and solver vectors of the chosen precision and frees 
+// those of the other one. The Poisson matrix is only allocated when the 
+// operator is not matrix free.
+//----------------------------------------------------------------------------//
+void Grid::init_pressure_system()
+{
+	if (system_precision == precision && system_poisson_mode == poisson_mode)
+		return;
+
+	bool matrix = poisson_mode == POISSON_MATRIX;
+
+	if (precision == SOLVER_MIXED)
+	{
+		poisson.delete_memory();
+		precond.delete_memory();
+		cg.release();
+		if (matrix)
+			poissonf.init(Nx, Ny, Nz);
+		else
+			poissonf.delete_memory();
+		precondf.init(Nx, Ny, Nz);
+		rhsf.init(Nx, Ny, Nz);
+		pressuref.init(Nx, Ny, Nz);
+		residual.init(Nx, Ny, Nz);
+		cgf.init(Nx, Ny, Nz);
+	}
+	else
+	{
+		poissonf.delete_memory();
+		precondf.delete_memory();
+		rhsf.delete_memory();
+		pressuref.delete_memory();
+		residual.delete_memory();
+		cgf.release();
+		if (matrix)
+			poisson.init(Nx, Ny, Nz);
+		else
+			poisson.delete_memory();
+		precond.init(Nx, Ny, Nz);
+		cg.init(Nx, Ny, Nz);
+	}
+	system_precision = precision;
+	system_poisson_mode = poisson_mode;
 }
 
+//----------------------------------------------------------------------------//
+// Clears the grid for the next transfer_to_grid. du, dv and dw are left as 
+// they are, add_forces overwrites them before they are read. form_poisson 
+// writes every interior coefficient of the Poisson matrix. A warm start 
+// keeps the pressure for remap_pressure.
+//----------------------------------------------------------------------------//
 void Grid::zero()
 {
-	u.zero();
-	v.zero();
-	w.zero();
-	du.zero();
-	dv.zero();
-	dw.zero();
-	poisson.zero();
-	rhs.zero();
-	pressure.zero();
-	marker.zero();
+	parallel_zero(u.data, u.size * sizeof(float));
+	parallel_zero(v.data, v.size * sizeof(float));
+	parallel_zero(w.data, w.size * sizeof(float));
+	max_speed_valid = false;
+	init_pressure_system();
+	parallel_zero(rhs.data, rhs.size * sizeof(double));
+	if (!warm_start)
+		parallel_zero(pressure.data, pressure.size * sizeof(double));
+	parallel_zero(marker.data, marker.size);
 }
 
-void Grid::bary_x(float x, int &i, float &fx)
+void Grid::bary_x(float x, int &i, float &fx) const
 {
 	float sx = x * overh;
 	i = (int)sx;
 	fx = sx - floor(sx);
 }
 
-void Grid::bary_x_centre(float x, int &i, float &fx)
+void Grid::bary_x_centre(float x, int &i, float &fx) const
 {
 	float sx = x * overh - 0.5f;
 	i = (int)sx;
@@ -64,14 +123,14 @@ void Grid::bary_x_centre(float x, int &i, float &fx)
 	}
 }
 
-void Grid::bary_y(float y, int &j, float &fy)
+void Grid::bary_y(float y, int &j, float &fy) const
 {
 	float sy = y * overh;
 	j = (int)sy;
 	fy = sy - floor(sy);
 }
 
-void Grid::bary_y_centre(float y, int &j, float &fy)
+void Grid::bary_y_centre(float y, int &j, float &fy) const
 {
 	float sy = y * overh - 0.5f;
 	j = (int)sy;
@@ -89,14 +148,14 @@ void Grid::bary_y_centre(float y, int &j, float &fy)
 	}
 }
 
-void Grid::bary_z(float z, int &k, float &fz)
+void Grid::bary_z(float z, int &k, float &fz) const
 {
 	float sz = z * overh;
 	k = (int)sz;
 	fz = sz - floor(sz);
 }
 
-void Grid::bary_z_centre(float z, int &k, float &fz)
+void Grid::bary_z_centre(float z, int &k, float &fz) const
 {
 	float sz = z * overh - 0.5f;
 	k = (int)sz;
@@ -114,51 +173,130 @@ void Grid::bary_z_centre(float z, int &k, float &fz)
 	}
 }
 
-void Grid::save_velocities()
+void Grid::stencil(float x, float y, float z, Stencil &s) const
 {
-	u.copy_to(du);
-	v.copy_to(dv);
-	w.copy_to(dw);
+	bary_x(x, s.ui, s.ufx);
+	bary_x_centre(x, s.i, s.fx);
+	bary_y(y, s.vj, s.vfy);
+	bary_y_centre(y, s.j, s.fy);
+	bary_z(z, s.wk, s.wfz);
+	bary_z_centre(z, s.k, s.fz);
 }
 
-void Grid::get_velocity_update()
+//----------------------------------------------------------------------------//
+// The element wise sweeps over the velocity grids run over the whole arrays, 
+// the padding of the brick layout included, in parallel over max_threads() 
+// chunks. Each grid is read once per sweep.
+//----------------------------------------------------------------------------//
+
+// Copies vel to saved
+static void save_velocity(const Array3f &vel, Array3f &saved)
 {
-	//du,dv,dw holds the saved velocites
-	//u, v, w hols the new velocities
-	//Thus the change in velocity in e.g u is: u - du
+#pragma omp parallel for schedule(static)
+	for (int n = 0; n < vel.size; ++n)
+		saved.data[n] = vel.data[n];
+}
 
-	for (int k = 0; k < u.nz; ++k)
-		for (int j = 0; j < u.ny; ++j)
-			for (int i = 0; i < u.nx; ++i)
-			{
-				du(i, j, k) = u(i, j, k) - du(i, j, k);
-			}
+// Copies vel to saved and subtracts gdt from vel
+static void save_velocity(Array3f &vel, Array3f &saved, float gdt)
+{
+#pragma omp parallel for schedule(static)
+	for (int n = 0; n < vel.size; ++n)
+	{
+		float a = vel.data[n];
+		saved.data[n] = a;
+		vel.data[n] = a - gdt;
+	}
+}
 
-	for (int k = 0; k < v.nz; ++k)
-		for (int j = 0; j < v.ny; ++j)
-			for (int i = 0; i < v.nx; ++i)
-			{
-				dv(i, j, k) = v(i, j, k) - dv(i, j, k);
-			}
+// The bits of |x|, which order as |x| does, NaN above infinity. Their integer 
+// maximum vectorizes where the float maximum, which has to keep NaN, does not.
+static inline int abs_bits(float x)
+{
+	int b;
+	std::memcpy(&b, &x, sizeof(b));
+	return b & 0x7fffffff;
+}
 
-	for (int k = 0; k < w.nz; ++k)
-		for (int j = 0; j < w.ny; ++j)
-			for (int i = 0; i < w.nx; ++i)
-			{
-				dw(i, j, k) = w(i, j, k) - dw(i, j, k);
-			}
+static inline float from_bits(int b)
+{
+	float x;
+	std::memcpy(&x, &b, sizeof(x));
+	return x;
 }
 
-void Grid::add_gravity(float dt)
+// saved = vel - saved, returns the largest |vel|
+static float velocity_update(const Array3f &vel, Array3f &saved)
 {
-	float gdt = gravity * dt;
+	const int nchunks = max_threads(), chunk = (vel.size + nchunks - 1) / nchunks;
+	std::vector<int> partial(nchunks, 0);
 
-	for (int k = 0; k < v.nz; ++k)
-		for (int j = 0; j < v.ny; ++j)
-			for (int i = 0; i < v.nx; ++i)
-			{
-				v(i, j, k) -= gdt;
-			}
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < nchunks; ++t)
+	{
+		int m = 0;
+		for (int n = t * chunk; n < min(vel.size, (t + 1) * chunk); ++n)
+		{
+			saved.data[n] = vel.data[n] - saved.data[n];
+			int a = abs_bits(vel.data[n]);
+			m = a > m ? a : m;
+		}
+		partial[t] = m;
+	}
+
+	int m = 0;
+	for (int t = 0; t < nchunks; ++t)
+		m = max(m, partial[t]);
+	return from_bits(m);
+}
+
+// The largest |vel|
+static float velocity_infnorm(const Array3f &vel)
+{
+	const int nchunks = max_threads(), chunk = (vel.size + nchunks - 1) / nchunks;
+	std::vector<int> partial(nchunks, 0);
+
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < nchunks; ++t)
+	{
+		int m = 0;
+		for (int n = t * chunk; n < min(vel.size, (t + 1) * chunk); ++n)
+		{
+			int a = abs_bits(vel.data[n]);
+			m = a > m ? a : m;
+		}
+		partial[t] = m;
+	}
+
+	int m = 0;
+	for (int t = 0; t < nchunks; ++t)
+		m = max(m, partial[t]);
+	return from_bits(m);
+}
+
+//----------------------------------------------------------------------------//
+// Saves the velocities of the particle transfer in du, dv and dw and adds 
+// gravity to v, in one sweep per grid
+//----------------------------------------------------------------------------//
+void Grid::add_forces(float dt)
+{
+	save_velocity(u, du);
+	save_velocity(v, dv, gravity * dt);
+	save_velocity(w, dw);
+	max_speed_valid = false;
+}
+
+//----------------------------------------------------------------------------//
+// du, dv and dw held the saved velocites and u, v, w hold the new ones, so the
+// change in velocity is e.g. u - du. The same sweep finds the largest 
+// velocities for the CFL of the next step.
+//----------------------------------------------------------------------------//
+void Grid::get_velocity_update()
+{
+	max_speed[0] = velocity_update(u, du);
+	max_speed[1] = velocity_update(v, dv);
+	max_speed[2] = velocity_update(w, dw);
+	max_speed_valid = true;
 }
 
 void Grid::classify_voxel()
@@ -212,190 +350,374 @@ void Grid::apply_boundary_conditions()
 				w(i, j, w.nz - 1) = w(i, j, w.nz - 2) = 0.0f; // Back wall
 		}
 
-	//Solidvoxels
-	for (int k = 1; k < Nz - 1; ++k)
-		for (int j = 1; j < Ny - 1; ++j)
-			for (int i = 1; i < Nx - 1; ++i)
-			{
-				if (marker(i, j, k) == SOLIDCELL)
+	//Solidvoxels. A slab k writes the w faces at k and k + 1 only, so the even
+	//and then the odd slabs run in parallel, as the colors of transfer_to_grid.
+	for (int parity = 0; parity < 2; ++parity)
+	{
+#pragma omp parallel for schedule(static)
+		for (int k = 1 + parity; k < Nz - 1; k += 2)
+			for (int j = 1; j < Ny - 1; ++j)
+				for (int i = 1; i < Nx - 1; ++i)
 				{
-					u(i, j, k) = u(i + 1, j, k) = 0;
-					v(i, j, k) = v(i, j + 1, k) = 0;
-					w(i, j, k) = w(i, j, k + 1) = 0;
+					if (marker(i, j, k) == SOLIDCELL)
+					{
+						u(i, j, k) = u(i + 1, j, k) = 0;
+						v(i, j, k) = v(i, j + 1, k) = 0;
+						w(i, j, k) = w(i, j, k + 1) = 0;
+					}
 				}
-			}
+	}
 }
 
+//----------------------------------------------------------------------------//
+// The largest stable time step. The velocity maxima come from the last 
+// get_velocity_update when no one has written the velocities since.
+//----------------------------------------------------------------------------//
 float Grid::CFL()
 {
-	float maxu = u.infnorm();
-	float maxv = v.infnorm();
-	float maxw = w.infnorm();
+	if (!max_speed_valid)
+	{
+		max_speed[0] = velocity_infnorm(u);
+		max_speed[1] = velocity_infnorm(v);
+		max_speed[2] = velocity_infnorm(w);
+		max_speed_valid = true;
+	}
+	float maxu = max_speed[0];
+	float maxv = max_speed[1];
+	float maxw = max_speed[2];
 	float maxvel = max(h * gravity, sqr(maxu) + sqr(maxv) + sqr(maxw));
 	if (maxvel < 10e-16f)
 		maxvel = 10e-16f;
 	return h / sqrtf(maxvel);
 }
 
-void Grid::form_precond()
+//----------------------------------------------------------------------------//
+// Computes the MIC(0) factor of A on the fluid runs of the i-line (j, k). The 
+// line depends on the lines (j - 1, k) and (j, k - 1) only. a gives the 
+// coefficients of A.
+//----------------------------------------------------------------------------//
+template<class T, class C>
+static void form_precond_line(C a, VectorNT<T> &precond, const Fluid_Cells &cells, int j, int k)
 {
 	double e = 0;
-	precond.zero();
 	double tau = 0.97, gamma = 0.25;
+	const int sy = cells.dimx, sz = cells.dimx * cells.dimy;
+	const T *p = precond.data;
+	int line = j + cells.dimy * k;
 
-	for (int k = 1; k < Nz - 1; ++k)
-		for (int j = 1; j < Ny - 1; ++j)
-			for (int i = 1; i < Nx - 1; ++i)
-			{
-				if (marker(i, j, k) == FLUIDCELL)
-				{
-					e = poisson(i, j, k, 0) - sqr(poisson(i - 1, j, k, 1) * precond(i - 1, j, k, 0))
-						- sqr(poisson(i, j - 1, k, 2) * precond(i, j - 1, k, 0))
-						- sqr(poisson(i, j, k - 1, 3) * precond(i, j, k - 1, 0))
-						- tau *
-						(
-							poisson(i - 1, j, k, 1) * (poisson(i - 1, j, k, 2) + poisson(i - 1, j, k, 3)) * sqr(precond(i - 1, j, k, 0))
-							+ poisson(i, j - 1, k, 2) * (poisson(i, j - 1, k, 1) + poisson(i, j - 1, k, 3)) * sqr(precond(i, j - 1, k, 0))
-							+ poisson(i, j, k - 1, 3) * (poisson(i, j, k - 1, 1) + poisson(i, j, k - 1, 2)) * sqr(precond(i, j, k - 1, 0))
-							);
-					if (e < gamma * poisson(i, j, k, 0))
-						e = poisson(i, j, k, 0);
-
-					precond(i, j, k, 0) = 1.0 / sqrt(e);
-				}
-			}
+	for (int run = cells.line_start[line]; run < cells.line_start[line + 1]; ++run)
+	{
+		for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+		{
+			double a0 = a(n, 0);
+			double a1_i = a(n - 1, 1), a2_i = a(n - 1, 2), a3_i = a(n - 1, 3);
+			double a1_j = a(n - sy, 1), a2_j = a(n - sy, 2), a3_j = a(n - sy, 3);
+			double a1_k = a(n - sz, 1), a2_k = a(n - sz, 2), a3_k = a(n - sz, 3);
+			double p_i = p[n - 1], p_j = p[n - sy], p_k = p[n - sz];
+
+			e = a0 - sqr(a1_i * p_i)
+				- sqr(a2_j * p_j)
+				- sqr(a3_k * p_k)
+				- tau *
+				(
+					a1_i * (a2_i + a3_i) * sqr(p_i)
+					+ a2_j * (a1_j + a3_j) * sqr(p_j)
+					+ a3_k * (a1_k + a2_k) * sqr(p_k)
+					);
+			if (e < gamma * a0)
+				e = a0;
+
+			precond.data[n] = (T)(1.0 / sqrt(e));
+		}
+	}
 }
 
-void Grid::solve_pressure(int maxiterations, double tolerance)
+template<class T, class C>
+static void form_mic0(C a, VectorNT<T> &precond, const Fluid_Cells &cells, bool wavefront)
 {
-	form_precond();
-	cg.solve_precond(poisson, rhs, precond, 100, tolerance, pressure, marker);
-	//cg.solve(poisson,rhs,maxiterations,tolerance,pressure,marker);
+	precond.zero();
+
+	if (wavefront)
+	{
+		// Lines on the same j + k diagonal are independent, see apply_precond_wavefront
+		int jmax = cells.dimy - 2, kmax = cells.dimz - 2;
+#pragma omp parallel
+		for (int level = 2; level <= jmax + kmax; ++level)
+		{
+			int jlo = max(1, level - kmax), jhi = min(jmax, level - 1);
+#pragma omp for schedule(static)
+			for (int j = jlo; j <= jhi; ++j)
+				form_precond_line(a, precond, cells, j, level - j);
+		}
+		return;
+	}
+
+	for (int k = 1; k < cells.dimz - 1; ++k)
+		for (int j = 1; j < cells.dimy - 1; ++j)
+			form_precond_line(a, precond, cells, j, k);
+}
+
+template<class T>
+static void form_mic0(const Poisson_OperatorT<T> &A, VectorNT<T> &precond, const Fluid_Cells &cells, bool wavefront)
+{
+	if (A.matrix)
+		form_mic0(A.matrix_coefficients(), precond, cells, wavefront);
+	else
+		form_mic0(A.stencil_coefficients(), precond, cells, wavefront);
+}
+
+void Grid::form_precond()
+{
+	bool wavefront = cg.precond_mode == PRECOND_MIC0_WAVEFRONT;
+
+	if (precision == SOLVER_MIXED)
+		form_mic0(poisson_opf, precondf, fluid_cells, wavefront);
+	else
+		form_mic0(poisson_op, precond, fluid_cells, wavefront);
 }
 
 //----------------------------------------------------------------------------//
-// Subtracts the pressure gradient from the velocities making the velocity field 
-// divergence free
-//----------------------------------------------------------------------------//	
-void Grid::project(float dt)
+// Solves for the pressure until the residual, the divergence left in the 
+// fluid cells, is within tolerance times that of rhs or within abstolerance,
+// or for maxiterations PCG iterations. A warm start begins from the remapped
+// pressure of the last step.
+//----------------------------------------------------------------------------//
+void Grid::solve_pressure(int maxiterations, double tolerance, double abstolerance)
 {
-	float scale = dt / (rho * h);
-	float val;
+	bool warm = warm_start && warm_valid;
+	if (warm)
+		remap_pressure();
 
-	for (int k = 0; k < Nz; ++k)
-		for (int j = 0; j < Ny; ++j)
-			for (int i = 0; i < Nx; ++i)
-			{
-				if (marker(i, j, k) == FLUIDCELL)
-				{
-					val = scale * float(pressure(i, j, k));
+	if (precision == SOLVER_MIXED)
+		solve_pressure_mixed(maxiterations, tolerance, abstolerance);
+	else
+	{
+		if (cg.precond_mode == PRECOND_MULTIGRID)
+			cg.mg.setup(poisson_op, marker, fluid_cells, poisson_scale);
+		else
+			form_precond();
+
+		cg.solve_precond(poisson_op, rhs, precond, maxiterations, tolerance, abstolerance, pressure, fluid_cells, warm);
+		solve_iterations = cg.iterations;
+		solve_residual = cg.residual;
+		solve_history = cg.history;
+		//cg.solve(poisson,rhs,maxiterations,tolerance,pressure,fluid_cells);
+	}
+	marker.copy_to(warm_marker);
+	warm_valid = true;
+}
 
-					u(i, j, k) -= val;
-					u(i + 1, j, k) += val;
+//----------------------------------------------------------------------------//
+// Mixed precision pressure solve by iterative refinement: the float PCG solves 
+// A e = r for a correction e, which is added to the double pressure, and the 
+// residual r = rhs - A * pressure is recomputed in double. Repeats until the 
+// double residual meets the tolerance. A is the float operator in both places.
+// The refinements share the maxiterations PCG iterations.
+// The history holds the residuals of the float solves, which estimate the 
+// double residual as the corrections converge.
+//----------------------------------------------------------------------------//
+void Grid::solve_pressure_mixed(int maxiterations, double tolerance, double abstolerance)
+{
+	cgf.precond_mode = cg.precond_mode;
+	if (cgf.precond_mode == PRECOND_MULTIGRID)
+		cgf.mg.setup(poisson_opf, marker, fluid_cells, poisson_scale);
+	else
+		form_precond();
 
-					v(i, j, k) -= val;
-					v(i, j + 1, k) += val;
+	vectorN_copy(residual, rhs, fluid_cells);
+	double binf = vectorN_infnorm(residual, fluid_cells);
+	double rinf = binf;
+	if (warm_start && warm_valid)
+		rinf = vectorN_residual(poisson_opf, pressure, rhs, residual, fluid_cells);
+	else
+		pressure.zero();
 
-					w(i, j, k) -= val;
-					w(i, j, k + 1) += val;
+	double tol = max(tolerance * binf, abstolerance);
+	double innertol = max(tolerance, MIXED_INNER_TOLERANCE);
+	solve_iterations = 0;
+	solve_history.assign(1, rinf);
 
-				}
-			}
+	for (int pass = 0; pass < MIXED_MAX_REFINEMENTS && rinf > tol && solve_iterations < maxiterations; ++pass)
+	{
+		vectorN_convert(rhsf, residual, fluid_cells);
+		cgf.solve_precond(poisson_opf, rhsf, precondf, maxiterations - solve_iterations, innertol, 0.0, pressuref, fluid_cells, false);
+		solve_iterations += cgf.iterations;
+		solve_history.insert(solve_history.end(), cgf.history.begin() + 1, cgf.history.end());
+		vectorN_add(pressure, pressuref, fluid_cells);
+		rinf = vectorN_residual(poisson_opf, pressure, rhs, residual, fluid_cells);
+	}
+	solve_residual = rinf;
 }
 
 //----------------------------------------------------------------------------//
-// Calculates the divergence in the velocity field
-// and fills the the b of the poisson equation
+// Carries the pressure of the last solve over to the fluid cells of this one.
+// Cells that joined the fluid take the mean pressure of their neighbours that
+// were fluid, or 0 next to none, and cells that left it are set to 0. The 
+// first pass only writes cells that were not fluid and only reads those that 
+// were, so its k slabs run in parallel.
 //----------------------------------------------------------------------------//
-void Grid::calc_divergence()
+void Grid::remap_pressure()
 {
-	double scale = 1.0 / h;
+	const Array3c &was = warm_marker;
 
-	for (int k = 0; k < Nz; ++k)
-		for (int j = 0; j < Ny; ++j)
-			for (int i = 0; i < Nx; ++i)
-				if (marker(i, j, k) == FLUIDCELL)
-				{
-					rhs(i, j, k) = -scale * (u(i + 1, j, k) - u(i, j, k) +
-						v(i, j + 1, k) - v(i, j, k) +
-						w(i, j, k + 1) - w(i, j, k));
-				}
+#pragma omp parallel for schedule(static)
+	for (int k = 1; k < Nz - 1; ++k)
+		for (int j = 1; j < Ny - 1; ++j)
+			for (int i = 1; i < Nx - 1; ++i)
+			{
+				if (marker(i, j, k) != FLUIDCELL)
+					continue;
+				if (was(i, j, k) == FLUIDCELL)
+					continue;
+
+				double sum = 0.0;
+				int n = 0;
+				if (was(i - 1, j, k) == FLUIDCELL) { sum += pressure(i - 1, j, k); ++n; }
+				if (was(i + 1, j, k) == FLUIDCELL) { sum += pressure(i + 1, j, k); ++n; }
+				if (was(i, j - 1, k) == FLUIDCELL) { sum += pressure(i, j - 1, k); ++n; }
+				if (was(i, j + 1, k) == FLUIDCELL) { sum += pressure(i, j + 1, k); ++n; }
+				if (was(i, j, k - 1) == FLUIDCELL) { sum += pressure(i, j, k - 1); ++n; }
+				if (was(i, j, k + 1) == FLUIDCELL) { sum += pressure(i, j, k + 1); ++n; }
+				pressure(i, j, k) = n > 0 ? sum / n : 0.0;
+			}
 
-	//Account for SOLID cells
-	for (int k = 0; k < Nz; ++k)
+#pragma omp parallel for schedule(static)
+	for (int n = 0; n < pressure.size; ++n)
 	{
-		for (int j = 0; j < Ny; ++j)
-		{
-			for (int i = 0; i < Nx; ++i)
-			{
-				if (marker(i, j, k) == FLUIDCELL)
-				{
-					//u
-					if (marker(i - 1, j, k) == SOLIDCELL)
-						rhs(i, j, k) -= scale * u(i, j, k);
+		if (marker.data[n] != FLUIDCELL)
+			pressure.data[n] = 0.0;
+	}
+}
 
-					if (marker(i + 1, j, k) == SOLIDCELL)
-						rhs(i, j, k) += scale * u(i + 1, j, k);
+// scale * pressure of a fluid cell, none for a cell outside the fluid
+static inline float pressure_term(const Array3c &marker, const VectorN &pressure, int i, int j, int k, float scale, float none)
+{
+	return marker(i, j, k) == FLUIDCELL ? scale * float(pressure(i, j, k)) : none;
+}
 
-					//v
-					if (marker(i, j - 1, k) == SOLIDCELL)
-						rhs(i, j, k) -= scale * v(i, j, k);
+// The i range [lo, hi) covering the fluid cells of two i-lines, false if neither has any
+static bool fluid_span(const Fluid_Cells &cells, int line0, int line1, int &lo, int &hi)
+{
+	int lo1, hi1;
+	bool has0 = cells.line_span(line0, lo, hi), has1 = cells.line_span(line1, lo1, hi1);
+	if (!has0)
+	{
+		lo = lo1; hi = hi1;
+	}
+	else if (has1)
+	{
+		lo = min(lo, lo1); hi = max(hi, hi1);
+	}
+	return has0 || has1;
+}
 
-					if (marker(i, j + 1, k) == SOLIDCELL)
-						rhs(i, j, k) += scale * v(i, j + 1, k);
+//----------------------------------------------------------------------------//
+// Subtracts the pressure gradient from the velocities making the velocity field 
+// divergence free. Every face gathers the pressures of its two cells, adding 
+// the one below before subtracting the one above as the scatter over the cells
+// did, so the k slabs of faces are updated in parallel with the same result. 
+// Only the faces of the span of fluid_cells on the adjacent i-lines are 
+// visited. -0 and 0 stand in for cells outside the fluid within the span, 
+// which leaves their faces unchanged and the inner loops free of branches.
+//----------------------------------------------------------------------------//	
+void Grid::project(float dt)
+{
+	const float scale = dt / (rho * h);
+	const Fluid_Cells &cells = fluid_cells;
 
-					//w
-					if (marker(i, j, k - 1) == SOLIDCELL)
-						rhs(i, j, k) -= scale * w(i, j, k);
+#pragma omp parallel for schedule(static)
+	for (int k = 1; k < Nz; ++k)
+		for (int j = 1; j < Ny; ++j)
+		{
+			int lo, hi;
 
-					if (marker(i, j, k + 1) == SOLIDCELL)
-						rhs(i, j, k) += scale * w(i, j, k + 1);
+			// u faces of the cells of line (j, k), up to the face after the last one
+			if (j < Ny - 1 && k < Nz - 1 && cells.line_span(j + Ny * k, lo, hi))
+			{
+				for (int i = lo; i <= hi; ++i)
+					u(i, j, k) = (u(i, j, k) + pressure_term(marker, pressure, i - 1, j, k, scale, -0.0f)) -
+						pressure_term(marker, pressure, i, j, k, scale, 0.0f);
+			}
 
-				}
+			// v faces between the lines (j - 1, k) and (j, k)
+			if (k < Nz - 1 && fluid_span(cells, j - 1 + Ny * k, j + Ny * k, lo, hi))
+			{
+				for (int i = lo; i < hi; ++i)
+					v(i, j, k) = (v(i, j, k) + pressure_term(marker, pressure, i, j - 1, k, scale, -0.0f)) -
+						pressure_term(marker, pressure, i, j, k, scale, 0.0f);
+			}
+
+			// w faces between the lines (j, k - 1) and (j, k)
+			if (j < Ny - 1 && fluid_span(cells, j + Ny * (k - 1), j + Ny * k, lo, hi))
+			{
+				for (int i = lo; i < hi; ++i)
+					w(i, j, k) = (w(i, j, k) + pressure_term(marker, pressure, i, j, k - 1, scale, -0.0f)) -
+						pressure_term(marker, pressure, i, j, k, scale, 0.0f);
 			}
 		}
-	}
 }
 
 //----------------------------------------------------------------------------//
-// Sets up the coefficients in the matrix of the poisson equation
+// Calculates the divergence in the velocity field and fills the the b of the 
+// poisson equation on the runs of fluid_cells, the rest of rhs stays 0 from 
+// zero. The velocities of faces towards solid cells are taken out of the 
+// divergence in the same pass, in the order the separate correction pass 
+// applied them, with -0 and 0 as the neutral terms.
 //----------------------------------------------------------------------------//
-void Grid::form_poisson(float dt)
+void Grid::calc_divergence()
 {
-	double scale = dt / (rho * h * h); // dt / (rho * dx^2) = (1/dx^2) * dt / rho
+	const double scale = 1.0 / h;
+	const Fluid_Cells &cells = fluid_cells;
 
+#pragma omp parallel for schedule(static)
 	for (int k = 1; k < Nz - 1; ++k)
 		for (int j = 1; j < Ny - 1; ++j)
-			for (int i = 1; i < Nx - 1; ++i)
+		{
+			int line = j + Ny * k, base = Nx * line;
+
+			for (int run = cells.line_start[line]; run < cells.line_start[line + 1]; ++run)
 			{
-				if (marker(i, j, k) == FLUIDCELL)
+				for (int i = cells.begin[run] - base; i < cells.end[run] - base; ++i)
 				{
-					if (marker(i - 1, j, k) != SOLIDCELL)		//Cell(i-1,j,k) Is air or fluid
-						poisson(i, j, k, 0) += scale;
-					if (marker(i + 1, j, k) != SOLIDCELL)		//Cell(i+1,j,k) Is air or fluid
-					{
-						poisson(i, j, k, 0) += scale;
-						if (marker(i + 1, j, k) == FLUIDCELL)	//Cell(i+1,j,k) Is fluid
-							poisson(i, j, k, 1) -= scale;
-					}
+					double r = -scale * (u(i + 1, j, k) - u(i, j, k) +
+						v(i, j + 1, k) - v(i, j, k) +
+						w(i, j, k + 1) - w(i, j, k));
 
-					if (marker(i, j - 1, k) != SOLIDCELL)		//Cell(i,j-1,k) Is air or fluid
-						poisson(i, j, k, 0) += scale;
-					if (marker(i, j + 1, k) != SOLIDCELL)		//Cell(i,j+1,k) Is air or fluid
-					{
-						poisson(i, j, k, 0) += scale;
-						if (marker(i, j + 1, k) == FLUIDCELL)	//Cell(i,j+1,k) Is fluid
-							poisson(i, j, k, 2) -= scale;
-					}
+					//Account for SOLID cells
+					r -= marker(i - 1, j, k) == SOLIDCELL ? scale * u(i, j, k) : 0.0;
+					r += marker(i + 1, j, k) == SOLIDCELL ? scale * u(i + 1, j, k) : -0.0;
+					r -= marker(i, j - 1, k) == SOLIDCELL ? scale * v(i, j, k) : 0.0;
+					r += marker(i, j + 1, k) == SOLIDCELL ? scale * v(i, j + 1, k) : -0.0;
+					r -= marker(i, j, k - 1) == SOLIDCELL ? scale * w(i, j, k) : 0.0;
+					r += marker(i, j, k + 1) == SOLIDCELL ? scale * w(i, j, k + 1) : -0.0;
 
-					if (marker(i, j, k - 1) != SOLIDCELL)		//Cell(i,j,k-1) Is air or fluid
-						poisson(i, j, k, 0) += scale;
-					if (marker(i, j, k + 1) != SOLIDCELL)		//Cell(i,j,k+1) Is air or fluid
-					{
-						poisson(i, j, k, 0) += scale;
-						if (marker(i, j, k + 1) == FLUIDCELL)	//Cell(i,j,k+1) Is fluid
-							poisson(i, j, k, 3) -= scale;
-					}
-				} //End if CELL(i,j,k) == FLUIDCELL
+					rhs(i, j, k) = r;
+				}
 			}
+		}
+}
+
+//----------------------------------------------------------------------------//
+// Sets up the operator of the poisson equation. The matrix free operator only 
+// records the scale, its coefficients follow from marker.
+//----------------------------------------------------------------------------//
+void Grid::form_poisson(float dt)
+{
+	poisson_scale = dt / (rho * h * h); // dt / (rho * dx^2) = (1/dx^2) * dt / rho
+	if (poisson_mode == POISSON_MATRIX_FREE)
+	{
+		poisson_op.set_stencil(marker, poisson_scale);
+		poisson_opf.set_stencil(marker, poisson_scale);
+	}
+	else if (precision == SOLVER_MIXED)
+	{
+		form_poisson_matrix(poissonf, marker, poisson_scale);
+		poisson_opf.set_matrix(poissonf);
+	}
+	else
+	{
+		form_poisson_matrix(poisson, marker, poisson_scale);
+		poisson_op.set_matrix(poisson);
+	}
+	fluid_cells.build(marker);
 }
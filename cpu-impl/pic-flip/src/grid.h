@@ -6,40 +6,90 @@
 #define FLUIDCELL 1
 #define SOLIDCELL 2
 
+#include <vector>
+
 #include "util.h"
 #include "array3d.h"
 #include "sparse_matrix.h"
 #include "unconditioned_cg_solver.h"
 
+// Precision of the pressure solve
+#define SOLVER_DOUBLE 0 // System stored and solved in double
+#define SOLVER_MIXED 1 // System stored in float, PCG corrections refined in double
+
+#define SOLVE_MAX_ITERATIONS 100 // Default PCG iterations per pressure solve
+#define SOLVE_TOLERANCE 1e-6 // Default residual of the pressure solve, relative to that of rhs
+
+#define MIXED_MAX_REFINEMENTS 5 // Maximum float PCG solves per mixed pressure solve
+#define MIXED_INNER_TOLERANCE 1e-4 // Tightest relative tolerance asked of a float PCG solve
+
+// Storage of the Poisson operator
+#define POISSON_MATRIX 0 // Coefficients assembled into a Sparse_Matrix by form_poisson
+#define POISSON_MATRIX_FREE 1 // Coefficients derived from marker during the solve
+
+// Cell indices and weights of a point in the staggered grids: u is 
+// interpolated at (ui, j, k), v at (i, vj, k) and w at (i, j, wk)
+struct Stencil
+{
+	int ui, i, vj, j, wk, k;
+	float ufx, fx, vfy, fy, wfz, fz;
+};
+
 struct Grid
 {
 	int Nx, Ny, Nz;
 	float h, overh, gravity, rho;
+	double poisson_scale; // dt / (rho * h^2) of the last form_poisson
 
 	Array3f u, v, w, du, dv, dw; // Staggered u, v, w velocities
 	Array3c marker; // Voxel classification
-	Sparse_Matrix poisson; // The matrix for pressure stage
-	Sparse_Matrix precond; // The matrix for pressure stage
+	Array3c warm_marker; // The marker of the solve that left pressure
+	Sparse_Matrix poisson; // The matrix for pressure stage, POISSON_MATRIX only
+	VectorN precond; // MIC(0) factor of every cell
+	Poisson_Operator poisson_op; // Either poisson or the stencil of marker
+	Fluid_Cells fluid_cells; // Fluid cells of the pressure system, built by form_poisson
 	VectorN rhs; // Right hand side of the poisson equation
 	VectorN pressure; // Right hand side of the poisson equation
 
-	Uncondioned_CG_Solver cg;
+	Uncondioned_CG_Solver cg; // Also holds the preconditioner choice for both precisions
+	int solve_iterations; // PCG iterations of the last solve_pressure, summed over the refinements
+	double solve_residual; // Infinity norm of the residual after the last solve_pressure
+	std::vector<double> solve_history; // The residual before and after every PCG iteration of the last solve_pressure
+	bool warm_start; // Start the solve from the pressure of the last step, see remap_pressure
+	bool warm_valid; // pressure and warm_marker hold a solve to start from
+	float max_speed[3]; // Largest |u|, |v| and |w|, found by get_velocity_update for the next CFL
+	bool max_speed_valid; // Cleared by init and by whatever else writes the velocities
+
+	// SOLVER_DOUBLE or SOLVER_MIXED and POISSON_MATRIX or POISSON_MATRIX_FREE. 
+	// Only the storage of the chosen settings is allocated, on the first step 
+	// after a change.
+	int precision;
+	int poisson_mode;
+	int system_precision; // Settings of the allocated storage, -1 for none
+	int system_poisson_mode;
+	Sparse_Matrixf poissonf; // Float system of SOLVER_MIXED
+	VectorNf precondf;
+	Poisson_Operatorf poisson_opf;
+	VectorNf rhsf; // Right hand side and solution of the float corrections
+	VectorNf pressuref;
+	VectorN residual; // Double residual of the iterative refinement
+	Uncondioned_CG_Solverf cgf;
 
 	Grid();
 	Grid(int Nx_, int Ny_, int Nz_, float h_, float gravity_, float rho_);
 	void init(int Nx_, int Ny_, int Nz_, float h_, float gravity_, float rho_);
 
 	void zero();
-	void bary_x(float x, int &i, float &fx);
-	void bary_x_centre(float x, int &i, float &fx);
-	void bary_y(float y, int &j, float &fy);
-	void bary_y_centre(float y, int &j, float &fy);
-	void bary_z(float z, int &k, float &fz);
-	void bary_z_centre(float z, int &k, float &fz);
-
-	void save_velocities();
+	void bary_x(float x, int &i, float &fx) const;
+	void bary_x_centre(float x, int &i, float &fx) const;
+	void bary_y(float y, int &j, float &fy) const;
+	void bary_y_centre(float y, int &j, float &fy) const;
+	void bary_z(float z, int &k, float &fz) const;
+	void bary_z_centre(float z, int &k, float &fz) const;
+	void stencil(float x, float y, float z, Stencil &s) const; // All six of the above
+
+	void add_forces(float dt);
 	void get_velocity_update();
-	void add_gravity(float dt);
 	void classify_voxel();
 	void apply_boundary_conditions();
 	float CFL();
@@ -47,7 +97,10 @@ struct Grid
 	void form_poisson(float dt);
 	void calc_divergence();
 	void project(float dt);
-	void solve_pressure(int maxiterations, double tolerance);
+	void solve_pressure(int maxiterations, double tolerance, double abstolerance);
+	void solve_pressure_mixed(int maxiterations, double tolerance, double abstolerance);
+	void remap_pressure();
+	void init_pressure_system();
 	void form_precond();
 };
 
@@ -0,0 +1,196 @@
+//----------------------------------------------------------------------------//
+// Compares the linear and brick Array3 layouts on the grid access patterns of
+// the particle transfers: the staggered trilerp gathers of G2P, the 8 corner
+// scatters of P2G and a 7-point sweep over the grid. Both layouts are built
+// into this one program, independent of PICFLIP_BRICK_LAYOUT.
+//----------------------------------------------------------------------------//
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "array3d.h"
+
+struct BenchParticle
+{
+	float x, y, z;
+	float u, v, w;
+};
+
+struct BenchOptions
+{
+	int dimx = 100, dimy = 78, dimz = 64;
+	int particles = 2000000;
+	int reps = 5;
+};
+
+static inline void bary(float x, int &i, float &f)
+{
+	i = (int)x;
+	f = x - (float)i;
+}
+
+template<int Layout>
+static double g2p(const std::vector<BenchParticle> &p, const Array3<float, Layout> &u, const Array3<float, Layout> &v, const Array3<float, Layout> &w)
+{
+	double sum = 0.0;
+	for (size_t n = 0; n < p.size(); ++n)
+	{
+		int i, j, k, ci, cj, ck;
+		float fx, fy, fz, cfx, cfy, cfz;
+		bary(p[n].x, i, fx); bary(p[n].x - 0.5f, ci, cfx);
+		bary(p[n].y, j, fy); bary(p[n].y - 0.5f, cj, cfy);
+		bary(p[n].z, k, fz); bary(p[n].z - 0.5f, ck, cfz);
+
+		sum += u.trilerp(i, cj, ck, fx, cfy, cfz) + v.trilerp(ci, j, ck, cfx, fy, cfz) + w.trilerp(ci, cj, k, cfx, cfy, fz);
+	}
+	return sum;
+}
+
+template<int Layout>
+static void splat(Array3<float, Layout> &a, float val, int i, int j, int k, float fx, float fy, float fz)
+{
+	a(i, j, k) += (1 - fx) * (1 - fy) * (1 - fz) * val;
+	a(i + 1, j, k) += fx * (1 - fy) * (1 - fz) * val;
+	a(i, j + 1, k) += (1 - fx) * fy * (1 - fz) * val;
+	a(i + 1, j + 1, k) += fx * fy * (1 - fz) * val;
+	a(i, j, k + 1) += (1 - fx) * (1 - fy) * fz * val;
+	a(i + 1, j, k + 1) += fx * (1 - fy) * fz * val;
+	a(i, j + 1, k + 1) += (1 - fx) * fy * fz * val;
+	a(i + 1, j + 1, k + 1) += fx * fy * fz * val;
+}
+
+template<int Layout>
+static double p2g(const std::vector<BenchParticle> &p, Array3<float, Layout> &u, Array3<float, Layout> &v, Array3<float, Layout> &w)
+{
+	u.zero(); v.zero(); w.zero();
+	for (size_t n = 0; n < p.size(); ++n)
+	{
+		int i, j, k, ci, cj, ck;
+		float fx, fy, fz, cfx, cfy, cfz;
+		bary(p[n].x, i, fx); bary(p[n].x - 0.5f, ci, cfx);
+		bary(p[n].y, j, fy); bary(p[n].y - 0.5f, cj, cfy);
+		bary(p[n].z, k, fz); bary(p[n].z - 0.5f, ck, cfz);
+
+		splat(u, p[n].u, i, cj, ck, fx, cfy, cfz);
+		splat(v, p[n].v, ci, j, ck, cfx, fy, cfz);
+		splat(w, p[n].w, ci, cj, k, cfx, cfy, fz);
+	}
+	return u.dot(u);
+}
+
+// Divergence like sweep, reading the 6 faces of every cell
+template<int Layout>
+static double sweep(const Array3<float, Layout> &u, const Array3<float, Layout> &v, const Array3<float, Layout> &w, Array3<float, Layout> &div)
+{
+	for (int k = 0; k < div.nz; ++k)
+		for (int j = 0; j < div.ny; ++j)
+			for (int i = 0; i < div.nx; ++i)
+				div(i, j, k) = u(i + 1, j, k) - u(i, j, k) + v(i, j + 1, k) - v(i, j, k) + w(i, j, k + 1) - w(i, j, k);
+	return div.dot(div);
+}
+
+// Best of reps runs in milliseconds
+template<class F>
+static double time_ms(int reps, F f, double &check)
+{
+	typedef std::chrono::steady_clock clock;
+	double best = 1e30;
+	for (int r = 0; r < reps; ++r)
+	{
+		clock::time_point t0 = clock::now();
+		check = f();
+		best = std::min(best, std::chrono::duration<double, std::milli>(clock::now() - t0).count());
+	}
+	return best;
+}
+
+template<int Layout>
+static void run_layout(const char *name, const BenchOptions &opt, const std::vector<BenchParticle> &p, const char *order)
+{
+	Array3<float, Layout> u(opt.dimx + 1, opt.dimy, opt.dimz), v(opt.dimx, opt.dimy + 1, opt.dimz), w(opt.dimx, opt.dimy, opt.dimz + 1);
+	Array3<float, Layout> div(opt.dimx, opt.dimy, opt.dimz);
+	double cp2g = 0.0, cg2p = 0.0, csweep = 0.0;
+
+	double tp2g = time_ms(opt.reps, [&]() { return p2g(p, u, v, w); }, cp2g);
+	double tg2p = time_ms(opt.reps, [&]() { return g2p(p, u, v, w); }, cg2p);
+	double tsweep = time_ms(opt.reps, [&]() { return sweep(u, v, w, div); }, csweep);
+
+	// The checksums agree between the layouts up to the summation order
+	std::printf("%-7s %-8s %10.3f %10.3f %10.3f   (%.6g %.6g %.6g)\n", name, order, tp2g, tg2p, tsweep, cp2g, cg2p, csweep);
+}
+
+static bool parse_args(int argc, char **argv, BenchOptions &opt)
+{
+	for (int a = 1; a < argc; ++a)
+	{
+		std::string arg = argv[a];
+		int left = argc - a - 1;
+		if (arg == "--dims" && left >= 3)
+		{
+			opt.dimx = std::atoi(argv[++a]);
+			opt.dimy = std::atoi(argv[++a]);
+			opt.dimz = std::atoi(argv[++a]);
+		}
+		else if (arg == "--particles" && left >= 1)
+			opt.particles = std::atoi(argv[++a]);
+		else if (arg == "--reps" && left >= 1)
+			opt.reps = std::atoi(argv[++a]);
+		else
+			return false;
+	}
+	return opt.dimx > 2 && opt.dimy > 2 && opt.dimz > 2 && opt.particles > 0 && opt.reps > 0;
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions opt;
+	if (!parse_args(argc, argv, opt))
+	{
+		std::cout << "Usage: " << argv[0] << " [--dims X Y Z] [--particles N] [--reps N]\n";
+		return 1;
+	}
+
+	// Particles uniformly in the interior, positions in cell units
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> rx(1.0f, opt.dimx - 1.0f), ry(1.0f, opt.dimy - 1.0f), rz(1.0f, opt.dimz - 1.0f);
+	std::vector<BenchParticle> p(opt.particles);
+	for (size_t n = 0; n < p.size(); ++n)
+	{
+		BenchParticle q = { rx(rng), ry(rng), rz(rng), 1.0f, 1.0f, 1.0f };
+		p[n] = q;
+	}
+
+	std::printf("Grid %dx%dx%d, %d particles, best of %d, times in ms\n", opt.dimx, opt.dimy, opt.dimz, opt.particles, opt.reps);
+	std::printf("%-7s %-8s %10s %10s %10s\n", "layout", "order", "p2g", "g2p", "sweep");
+
+	run_layout<ARRAY3_LINEAR>("linear", opt, p, "random");
+	run_layout<ARRAY3_BRICK>("brick", opt, p, "random");
+
+	// Particles in cell order, as after a spatial sort
+	std::sort(p.begin(), p.end(), [](const BenchParticle &a, const BenchParticle &b)
+	{
+		int ak = (int)a.z, bk = (int)b.z, aj = (int)a.y, bj = (int)b.y;
+		if (ak != bk) return ak < bk;
+		if (aj != bj) return aj < bj;
+		return (int)a.x < (int)b.x;
+	});
+
+	run_layout<ARRAY3_LINEAR>("linear", opt, p, "sorted");
+	run_layout<ARRAY3_BRICK>("brick", opt, p, "sorted");
+
+	// Particles in the brick order of their cells
+	Array3<char, ARRAY3_BRICK> cells(opt.dimx, opt.dimy, opt.dimz);
+	std::sort(p.begin(), p.end(), [&cells](const BenchParticle &a, const BenchParticle &b)
+	{
+		return cells.index((int)a.x, (int)a.y, (int)a.z) < cells.index((int)b.x, (int)b.y, (int)b.z);
+	});
+
+	run_layout<ARRAY3_LINEAR>("linear", opt, p, "morton");
+	run_layout<ARRAY3_BRICK>("brick", opt, p, "morton");
+	return 0;
+}
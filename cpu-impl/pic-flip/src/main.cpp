@@ -1,9 +1,10 @@
 #include <iostream>
+#include <vector>
 
 #define GLEW_STATIC
 
 #include "glapp.h"
-#include "array3D.h"
+#include "array3d.h"
 #include "fluid_solver.h"
 
 const int perCell = 8;
@@ -26,13 +27,14 @@ void initVoxels(float * voxelPositions, int dx, int dy, int dz)
 	}
 }
 
-void update_voxel_flags(Grid &grid, Array3f &flags)
+// The flags are uploaded as is, so they are stored linearly whatever the Array3 layout
+void update_voxel_flags(Grid &grid, float *flags)
 {
 	for (int k = 1; k < grid.Nz-1; ++k)
 		for (int j = 1; j < grid.Ny-1; ++j)
 			for (int i = 1; i < grid.Nx-1; ++i)
 			{
-				flags(i, j, k) = (float)grid.marker(i, j, k);
+				flags[i + grid.Nx * (j + grid.Ny * k)] = (float)grid.marker(i, j, k);
 			}
 }
 
@@ -42,16 +44,19 @@ int main()
 	FluidSolver fluid_solver(dimx, dimy, dimz, gridh, 1.0f / 30.0f, 9.82f, 1.0f, Nparticles);
 	fluid_solver.init_box();
 
-	app.initParticles(&fluid_solver.particles.pos[0], &fluid_solver.particles.vel[0], sizeof(vec3f) * fluid_solver.particles.currnp, fluid_solver.particles.currnp);	
+	std::vector<vec3f> initpos(fluid_solver.particles.currnp), initvel(fluid_solver.particles.currnp);
+	fluid_solver.particles.copy_positions(initpos.data());
+	fluid_solver.particles.copy_velocities(initvel.data());
+	app.initParticles(initpos.data(), initvel.data(), sizeof(vec3f) * fluid_solver.particles.currnp, fluid_solver.particles.currnp);	
 	
 	std::cout << "Number of particles: " << fluid_solver.particles.currnp << std::endl;
 
 	int Nvoxels = dimx * dimy * dimz;
-	Array3f voxelFlags(dimx, dimy, dimz);	
+	float * voxelFlags = new float[dimx * dimy * dimz]();
 	float * voxelPositions  = new float[3 * dimx * dimy * dimz];	
 	initVoxels(voxelPositions,dimx,dimy,dimz);
 
-	app.initWireframeCubes(voxelPositions,voxelFlags.data,Nvoxels);
+	app.initWireframeCubes(voxelPositions,voxelFlags,Nvoxels);
 	update_voxel_flags(fluid_solver.grid, voxelFlags);
 	
 	while (running)
@@ -0,0 +1,419 @@
+#include "multigrid.h"
+#include "util.h"
+
+template<class T>
+Multigrid_PreconditionerT<T>::Multigrid_PreconditionerT() : nlevels(0), presmooth(2), postsmooth(2), coarsesmooth(4), omega(2.0 / 3.0) {}
+
+template<class T>
+void Multigrid_PreconditionerT<T>::init(int dimx, int dimy, int dimz)
+{
+	// The finest level takes its right hand side from the caller
+	levels[0].dimx = dimx; levels[0].dimy = dimy; levels[0].dimz = dimz;
+	levels[0].diag.init(dimx, dimy, dimz);
+	levels[0].x.init(dimx, dimy, dimz);
+	levels[0].r.init(dimx, dimy, dimz);
+	levels[0].t.init(dimx, dimy, dimz);
+	nlevels = 1;
+
+	// Coarsen until the interior of the coarsest level is at most 4 cells wide
+	while (nlevels < MG_MAX_LEVELS && min(dimx, min(dimy, dimz)) - 2 > 4)
+	{
+		dimx = (dimx - 1) / 2 + 2;
+		dimy = (dimy - 1) / 2 + 2;
+		dimz = (dimz - 1) / 2 + 2;
+
+		Multigrid_LevelT<T> &lev = levels[nlevels++];
+		lev.dimx = dimx; lev.dimy = dimy; lev.dimz = dimz;
+		lev.coarsemarker.init(dimx, dimy, dimz);
+		lev.marker = &lev.coarsemarker;
+		lev.diag.init(dimx, dimy, dimz);
+		lev.x.init(dimx, dimy, dimz);
+		lev.b.init(dimx, dimy, dimz);
+		lev.r.init(dimx, dimy, dimz);
+		lev.t.init(dimx, dimy, dimz);
+	}
+}
+
+// Sets v to 0 on the given runs
+template<class T>
+static void zero_runs(VectorNT<T> &v, const Fluid_Cells &cells)
+{
+	for (int run = 0; run < cells.runs(); ++run)
+		std::memset(v.data + cells.begin[run], 0, (cells.end[run] - cells.begin[run]) * sizeof(T));
+}
+
+// The diagonal of the level's operator on its fluid cells
+template<class T, class C>
+static void store_diagonal(Multigrid_LevelT<T> &lev, C a)
+{
+	const Fluid_Cells &cells = lev.cells;
+	int nchunks = cells.chunks();
+
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+		for (int run = cells.chunk_start[c]; run < cells.chunk_start[c + 1]; ++run)
+			for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+				lev.diag.data[n] = (double)a(n, 0);
+}
+
+//----------------------------------------------------------------------------//
+// Builds the coarse voxel classifications and Poisson operators from the fine
+// level. scale is the fine Poisson coefficient, it shrinks by 4 per level as
+// the cell size doubles. The coarse operators are the matrix free stencils of
+// the coarse classifications. The vectors are cleared on the fluid cells of
+// the last setup, so they are 0 off the new ones.
+//----------------------------------------------------------------------------//
+template<class T>
+void Multigrid_PreconditionerT<T>::setup(const Poisson_OperatorT<T> &A, const Array3c &marker, const Fluid_Cells &cells, double scale)
+{
+	if (nlevels == 0)
+		init(marker.nx, marker.ny, marker.nz);
+
+	for (int l = 0; l < nlevels; ++l)
+	{
+		Multigrid_LevelT<T> &lev = levels[l];
+		zero_runs(lev.x, lev.cells);
+		zero_runs(lev.r, lev.cells);
+		zero_runs(lev.t, lev.cells);
+	}
+
+	levels[0].A = A;
+	levels[0].marker = &marker;
+	levels[0].cells = cells;
+
+	for (int l = 1; l < nlevels; ++l)
+	{
+		const Multigrid_LevelT<T> &fine = levels[l - 1];
+		Multigrid_LevelT<T> &coarse = levels[l];
+		const Array3c &fm = *fine.marker;
+		Array3c &cm = coarse.coarsemarker;
+
+		// Every coarse line reads the 4 fine lines of its children, clamped at the far border
+#pragma omp parallel for schedule(static)
+		for (int K = 0; K < coarse.dimz; ++K)
+			for (int J = 0; J < coarse.dimy; ++J)
+			{
+				char *c = &cm(0, J, K);
+				if (J == 0 || K == 0 || J == coarse.dimy - 1 || K == coarse.dimz - 1)
+				{
+					std::memset(c, SOLIDCELL, coarse.dimx);
+					continue;
+				}
+
+				int j0 = 2 * J - 1, j1 = min(2 * J, fine.dimy - 1);
+				int k0 = 2 * K - 1, k1 = min(2 * K, fine.dimz - 1);
+				const char *f[4] = { &fm(0, j0, k0), &fm(0, j1, k0), &fm(0, j0, k1), &fm(0, j1, k1) };
+
+				c[0] = c[coarse.dimx - 1] = SOLIDCELL;
+				for (int I = 1; I < coarse.dimx - 1; ++I)
+				{
+					int i0 = 2 * I - 1, i1 = min(2 * I, fine.dimx - 1);
+					bool air = false, fluid = false;
+					for (int q = 0; q < 4; ++q)
+					{
+						air = air | (f[q][i0] == AIRCELL) | (f[q][i1] == AIRCELL);
+						fluid = fluid | (f[q][i0] == FLUIDCELL) | (f[q][i1] == FLUIDCELL);
+					}
+					c[I] = air ? AIRCELL : (fluid ? FLUIDCELL : SOLIDCELL);
+				}
+			}
+
+		scale *= 0.25;
+		coarse.A.set_stencil(cm, scale);
+		coarse.cells.build(cm);
+	}
+
+	for (int l = 0; l < nlevels; ++l)
+	{
+		Multigrid_LevelT<T> &lev = levels[l];
+		if (lev.A.matrix)
+			store_diagonal(lev, lev.A.matrix_coefficients());
+		else
+			store_diagonal(lev, lev.A.stencil_coefficients());
+	}
+}
+
+//----------------------------------------------------------------------------//
+// The off-diagonal part of row n of A times x. For the matrix free stencil
+// it relies on x being 0 off the fluid cells.
+//----------------------------------------------------------------------------//
+struct Stencil_Coupling
+{
+	double offdiag;
+};
+
+template<class T>
+static inline double coupling(const Stencil_Coupling &a, const T *x, int n, int sy, int sz)
+{
+	return a.offdiag * ((double)x[n + 1] + x[n - 1] + x[n + sy] + x[n - sy] + x[n + sz] + x[n - sz]);
+}
+
+template<class T>
+static inline double coupling(const Matrix_Coefficients<T> &a, const T *x, int n, int sy, int sz)
+{
+	return (double)a(n, 1) * x[n + 1] + (double)a(n - 1, 1) * x[n - 1]
+		+ (double)a(n, 2) * x[n + sy] + (double)a(n - sy, 2) * x[n - sy]
+		+ (double)a(n, 3) * x[n + sz] + (double)a(n - sz, 3) * x[n - sz];
+}
+
+template<class T>
+static Stencil_Coupling stencil_coupling(const Multigrid_LevelT<T> &lev)
+{
+	Stencil_Coupling a = { (double)lev.A.offdiag };
+	return a;
+}
+
+// r = b - Ax on the fluid cells of the level
+template<class T, class C>
+static void compute_residual(Multigrid_LevelT<T> &lev, C a, const VectorNT<T> &b, const VectorNT<T> &x)
+{
+	const Fluid_Cells &cells = lev.cells;
+	const int sy = lev.dimx, sz = lev.dimx * lev.dimy;
+	int nchunks = cells.chunks();
+
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+		for (int run = cells.chunk_start[c]; run < cells.chunk_start[c + 1]; ++run)
+			for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+				lev.r.data[n] = (T)(b.data[n] - (lev.diag.data[n] * x.data[n] + coupling(a, x.data, n, sy, sz)));
+}
+
+template<class T>
+static void compute_residual(Multigrid_LevelT<T> &lev, const VectorNT<T> &b, const VectorNT<T> &x)
+{
+	if (lev.A.matrix)
+		compute_residual(lev, lev.A.matrix_coefficients(), b, x);
+	else
+		compute_residual(lev, stencil_coupling(lev), b, x);
+}
+
+//----------------------------------------------------------------------------//
+// One damped Jacobi sweep, dst = src + omega D^-1 (b - A src), with the
+// residual computed in the same pass. zero takes src as 0. Cells without a
+// diagonal keep their value.
+//----------------------------------------------------------------------------//
+template<class T, class C>
+static void jacobi_sweep(Multigrid_LevelT<T> &lev, C a, double omega, const VectorNT<T> &b, const VectorNT<T> &src, VectorNT<T> &dst, bool zero)
+{
+	const Fluid_Cells &cells = lev.cells;
+	const int sy = lev.dimx, sz = lev.dimx * lev.dimy;
+	int nchunks = cells.chunks();
+
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+		for (int run = cells.chunk_start[c]; run < cells.chunk_start[c + 1]; ++run)
+		{
+			if (zero)
+			{
+				for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+				{
+					double d = lev.diag.data[n];
+					dst.data[n] = (T)(d > 0.0 ? omega * b.data[n] / d : 0.0);
+				}
+				continue;
+			}
+
+			for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+			{
+				double d = lev.diag.data[n];
+				T r = (T)(b.data[n] - (d * src.data[n] + coupling(a, src.data, n, sy, sz)));
+				dst.data[n] = (T)(src.data[n] + (d > 0.0 ? omega * r / d : 0.0));
+			}
+		}
+}
+
+template<class T>
+static void jacobi_sweep(Multigrid_LevelT<T> &lev, double omega, const VectorNT<T> &b, const VectorNT<T> &src, VectorNT<T> &dst, bool zero)
+{
+	if (lev.A.matrix)
+		jacobi_sweep(lev, lev.A.matrix_coefficients(), omega, b, src, dst, zero);
+	else
+		jacobi_sweep(lev, stencil_coupling(lev), omega, b, src, dst, zero);
+}
+
+// Symmetric Gauss-Seidel sweeps in place, forward then backward over the runs
+template<class T, class C>
+static void gauss_seidel(Multigrid_LevelT<T> &lev, C a, const VectorNT<T> &b, VectorNT<T> &x, int iterations)
+{
+	const Fluid_Cells &cells = lev.cells;
+	const int sy = lev.dimx, sz = lev.dimx * lev.dimy;
+
+	for (int it = 0; it < iterations; ++it)
+	{
+		for (int run = 0; run < cells.runs(); ++run)
+			for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+			{
+				if (lev.diag.data[n] > 0.0)
+					x.data[n] = (T)((b.data[n] - coupling(a, x.data, n, sy, sz)) / lev.diag.data[n]);
+			}
+		for (int run = cells.runs() - 1; run >= 0; --run)
+			for (int n = cells.end[run] - 1; n >= cells.begin[run]; --n)
+			{
+				if (lev.diag.data[n] > 0.0)
+					x.data[n] = (T)((b.data[n] - coupling(a, x.data, n, sy, sz)) / lev.diag.data[n]);
+			}
+	}
+}
+
+template<class T>
+static void gauss_seidel(Multigrid_LevelT<T> &lev, const VectorNT<T> &b, VectorNT<T> &x, int iterations)
+{
+	if (lev.A.matrix)
+		gauss_seidel(lev, lev.A.matrix_coefficients(), b, x, iterations);
+	else
+		gauss_seidel(lev, stencil_coupling(lev), b, x, iterations);
+}
+
+template<class T>
+void Multigrid_PreconditionerT<T>::apply(const VectorNT<T> &r, VectorNT<T> &z)
+{
+	vcycle(0, r, levels[0].x);
+	vectorN_copy(z, levels[0].x, levels[0].cells);
+}
+
+template<class T>
+void Multigrid_PreconditionerT<T>::vcycle(int l, const VectorNT<T> &b, VectorNT<T> &x)
+{
+	if (l == nlevels - 1)
+	{
+		coarse_solve(b, x);
+		return;
+	}
+
+	smooth(l, b, x, presmooth, true);
+	compute_residual(levels[l], b, x);
+	restrict_residual(l);
+	vcycle(l + 1, levels[l + 1].b, levels[l + 1].x);
+	prolongate_add(l, x);
+	smooth(l, b, x, postsmooth, false);
+}
+
+//----------------------------------------------------------------------------//
+// Jacobi sweeps alternating between x and the level's t, zero_start starts
+// from x = 0. The first buffer is picked so the last sweep writes x when the
+// start is 0, otherwise an odd count is copied back.
+//----------------------------------------------------------------------------//
+template<class T>
+void Multigrid_PreconditionerT<T>::smooth(int l, const VectorNT<T> &b, VectorNT<T> &x, int iterations, bool zero_start)
+{
+	Multigrid_LevelT<T> &lev = levels[l];
+	VectorNT<T> *buffers[2] = { &x, &lev.t };
+
+	if (iterations == 0)
+	{
+		if (zero_start)
+			zero_runs(x, lev.cells);
+		return;
+	}
+
+	int cur = zero_start ? iterations % 2 : 0;
+	for (int it = 0; it < iterations; ++it)
+	{
+		const VectorNT<T> &src = *buffers[cur];
+		VectorNT<T> &dst = *buffers[1 - cur];
+		jacobi_sweep(lev, omega, b, src, dst, zero_start && it == 0);
+		cur = 1 - cur;
+	}
+
+	if (cur != 0)
+		vectorN_copy(x, lev.t, lev.cells);
+}
+
+// The coarsest level, solved approximately from x = 0
+template<class T>
+void Multigrid_PreconditionerT<T>::coarse_solve(const VectorNT<T> &b, VectorNT<T> &x)
+{
+	Multigrid_LevelT<T> &lev = levels[nlevels - 1];
+
+	zero_runs(x, lev.cells);
+	gauss_seidel(lev, b, x, coarsesmooth);
+}
+
+//----------------------------------------------------------------------------//
+// Full weighting of the residual of level l into the right hand side of
+// level l + 1, weights (1 3 3 1) / 8 along each axis
+//----------------------------------------------------------------------------//
+template<class T>
+void Multigrid_PreconditionerT<T>::restrict_residual(int l)
+{
+	static const double wt[4] = { 1.0 / 8.0, 3.0 / 8.0, 3.0 / 8.0, 1.0 / 8.0 };
+
+	const Multigrid_LevelT<T> &fine = levels[l];
+	Multigrid_LevelT<T> &coarse = levels[l + 1];
+	const Fluid_Cells &cells = coarse.cells;
+	int nchunks = cells.chunks();
+
+#pragma omp parallel for schedule(static)
+	for (int ch = 0; ch < nchunks; ++ch)
+		for (int run = cells.chunk_start[ch]; run < cells.chunk_start[ch + 1]; ++run)
+		{
+			int line = cells.begin[run] / coarse.dimx;
+			int J = line % coarse.dimy, K = line / coarse.dimy;
+
+			for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+			{
+				int I = n - line * coarse.dimx;
+				double sum = 0.0;
+				for (int c = 0; c < 4; ++c)
+				{
+					int k = 2 * K - 2 + c;
+					if (k < 0 || k >= fine.dimz)
+						continue;
+					for (int b = 0; b < 4; ++b)
+					{
+						int j = 2 * J - 2 + b;
+						if (j < 0 || j >= fine.dimy)
+							continue;
+						for (int a = 0; a < 4; ++a)
+						{
+							int i = 2 * I - 2 + a;
+							if (i < 0 || i >= fine.dimx)
+								continue;
+							sum += wt[a] * wt[b] * wt[c] * fine.r(i, j, k);
+						}
+					}
+				}
+				coarse.b.data[n] = (T)sum;
+			}
+		}
+}
+
+//----------------------------------------------------------------------------//
+// Trilinear interpolation of the level l + 1 solution, added to x on the
+// fluid cells of level l. Fine cell 2I-1 lies 1/4 towards coarse cell I-1,
+// fine cell 2I lies 1/4 towards coarse cell I+1.
+//----------------------------------------------------------------------------//
+template<class T>
+void Multigrid_PreconditionerT<T>::prolongate_add(int l, VectorNT<T> &x)
+{
+	const Multigrid_LevelT<T> &fine = levels[l];
+	const Multigrid_LevelT<T> &coarse = levels[l + 1];
+	const Fluid_Cells &cells = fine.cells;
+	int nchunks = cells.chunks();
+
+#pragma omp parallel for schedule(static)
+	for (int ch = 0; ch < nchunks; ++ch)
+		for (int run = cells.chunk_start[ch]; run < cells.chunk_start[ch + 1]; ++run)
+		{
+			int line = cells.begin[run] / fine.dimx;
+			int j = line % fine.dimy, k = line / fine.dimy;
+			int J = (j - 1) / 2 + 1, K = (k - 1) / 2 + 1;
+			int Jn = (j == 2 * J - 1) ? J - 1 : J + 1;
+			int Kn = (k == 2 * K - 1) ? K - 1 : K + 1;
+
+			for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+			{
+				int i = n - line * fine.dimx;
+				int I = (i - 1) / 2 + 1;
+				int In = (i == 2 * I - 1) ? I - 1 : I + 1;
+
+				x.data[n] = (T)(x.data[n] + (0.75 * (0.75 * (0.75 * coarse.x(I, J, K) + 0.25 * coarse.x(In, J, K))
+					+ 0.25 * (0.75 * coarse.x(I, Jn, K) + 0.25 * coarse.x(In, Jn, K)))
+					+ 0.25 * (0.75 * (0.75 * coarse.x(I, J, Kn) + 0.25 * coarse.x(In, J, Kn))
+					+ 0.25 * (0.75 * coarse.x(I, Jn, Kn) + 0.25 * coarse.x(In, Jn, Kn)))));
+			}
+		}
+}
+
+template struct Multigrid_PreconditionerT<double>;
+template struct Multigrid_PreconditionerT<float>;
@@ -0,0 +1,67 @@
+#pragma once
+#ifndef MULTIGRID_H_
+#define MULTIGRID_H_
+
+#define AIRCELL 0
+#define FLUIDCELL 1
+#define SOLIDCELL 2
+
+#define MG_MAX_LEVELS 10
+
+#include "sparse_matrix.h"
+#include "array3d.h"
+
+template<class T>
+struct Multigrid_LevelT
+{
+	int dimx, dimy, dimz;
+	Poisson_OperatorT<T> A; // The Poisson operator of the level, matrix free on the coarse levels
+	const Array3c *marker; // Voxel classification of the level
+	Array3c coarsemarker; // Storage for marker on the coarse levels
+	Fluid_Cells cells; // Fluid runs of the level, a copy of the caller's on the finest
+	VectorN diag; // Diagonal of A on the fluid cells
+	VectorNT<T> x, b, r; // Solution, right hand side and residual, b is the caller's on the finest
+	VectorNT<T> t; // Second buffer of the Jacobi sweeps
+};
+
+//----------------------------------------------------------------------------//
+// Geometric multigrid V-cycle used as a preconditioner for the CG solver.
+// Every level keeps a solid border ring, so coarse cell (I, J, K) covers the
+// fine cells 2I-1..2I along each axis. A coarse cell is air if any child is
+// air, else fluid if any child is fluid, else solid. Restriction is full
+// weighting and prolongation trilinear, the transpose of each other, both 
+// pre and post smoothing use damped Jacobi and the coarsest level symmetric
+// Gauss-Seidel from zero, so the V-cycle is a symmetric operator as PCG 
+// requires. T is the storage precision, the arithmetic is done in double.
+//
+// All passes run over the fluid runs of their level. x, t and r are kept 0
+// off the fluid cells, so the matrix free stencil needs no classification
+// lookups: the coupling of a fluid cell is offdiag times the sum of its six
+// neighbours.
+//----------------------------------------------------------------------------//
+template<class T>
+struct Multigrid_PreconditionerT
+{
+	Multigrid_LevelT<T> levels[MG_MAX_LEVELS];
+	int nlevels;
+	int presmooth, postsmooth;
+	int coarsesmooth; // Symmetric Gauss-Seidel iterations on the coarsest level
+	double omega; // Jacobi damping
+
+	Multigrid_PreconditionerT();
+
+	void init(int dimx, int dimy, int dimz);
+	void setup(const Poisson_OperatorT<T> &A, const Array3c &marker, const Fluid_Cells &cells, double scale);
+	void apply(const VectorNT<T> &r, VectorNT<T> &z);
+
+	void vcycle(int l, const VectorNT<T> &b, VectorNT<T> &x);
+	void smooth(int l, const VectorNT<T> &b, VectorNT<T> &x, int iterations, bool zero_start);
+	void coarse_solve(const VectorNT<T> &b, VectorNT<T> &x);
+	void restrict_residual(int l);
+	void prolongate_add(int l, VectorNT<T> &x);
+};
+
+typedef Multigrid_PreconditionerT<double> Multigrid_Preconditioner;
+typedef Multigrid_PreconditionerT<float> Multigrid_Preconditionerf;
+
+#endif
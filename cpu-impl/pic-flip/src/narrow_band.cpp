@@ -0,0 +1,353 @@
+#include "narrow_band.h"
+
+#include <algorithm>
+#include <cmath>
+
+void Narrow_Band::init(const Grid &grid)
+{
+	if (phi.nx == grid.Nx && phi.ny == grid.Ny && phi.nz == grid.Nz)
+		return;
+
+	phi.init(grid.Nx, grid.Ny, grid.Nz);
+	phi_advected.init(grid.Nx, grid.Ny, grid.Nz);
+	u.init(grid.u.nx, grid.u.ny, grid.u.nz);
+	v.init(grid.v.nx, grid.v.ny, grid.v.nz);
+	w.init(grid.w.nx, grid.w.ny, grid.w.nz);
+	ready = false;
+}
+
+// Cell i and weight f of coordinate s, in cells, along an axis of n samples
+static inline void bary(float s, int n, int &i, float &f)
+{
+	i = (int)std::floor(s);
+	if (i < 0)
+	{
+		i = 0; f = 0.0f;
+	}
+	else if (i > n - 2)
+	{
+		i = n - 2; f = 1.0f;
+	}
+	else
+		f = s - i;
+}
+
+//----------------------------------------------------------------------------//
+// Interpolation at any point of the box. face is the axis of a staggered
+// array, or -1 for a cell centred one.
+//----------------------------------------------------------------------------//
+static inline float sample(const Grid &grid, const Array3f &a, int face, float x, float y, float z)
+{
+	int i, j, k;
+	float fx, fy, fz;
+	bary(x * grid.overh - (face == 0 ? 0.0f : 0.5f), a.nx, i, fx);
+	bary(y * grid.overh - (face == 1 ? 0.0f : 0.5f), a.ny, j, fy);
+	bary(z * grid.overh - (face == 2 ? 0.0f : 0.5f), a.nz, k, fz);
+	return a.trilerp(i, j, k, fx, fy, fz);
+}
+
+static inline void sample_velocity(const Grid &grid, float x, float y, float z, float vel[3])
+{
+	vel[0] = sample(grid, grid.u, 0, x, y, z);
+	vel[1] = sample(grid, grid.v, 1, x, y, z);
+	vel[2] = sample(grid, grid.w, 2, x, y, z);
+}
+
+// Semi-Lagrangian advection of the value of src at (x, y, z) over dt
+static inline float advect_point(const Grid &grid, const Array3f &src, int face, float x, float y, float z, float dt)
+{
+	float vel[3];
+	sample_velocity(grid, x, y, z, vel);
+	return sample(grid, src, face, x - dt * vel[0], y - dt * vel[1], z - dt * vel[2]);
+}
+
+//----------------------------------------------------------------------------//
+// Advects phi and the velocities of the last step. The advected phi is only 
+// read below the band, and the velocities on faces without particle 
+// contributions, which are below the band too. So only the cells that may 
+// be below the band after the step are advected: the liquid moves at most a 
+// cell per step. The other velocities are zero, as without the band. Every 
+// cell advects its lower faces, and its upper faces where the next cell is 
+// not advected.
+//----------------------------------------------------------------------------//
+void advect_narrow_band(Narrow_Band &band, const Grid &grid, float dt)
+{
+	band.init(grid);
+	if (!band.ready)
+		return;
+
+	const Array3f &phi = band.phi;
+	const float h = grid.h, far = (band.width + 1.0f) * h, limit = -(band.width - 2.0f) * h;
+	for (int n = 0; n < band.phi_advected.size; ++n)
+		band.phi_advected.data[n] = far;
+	band.u.zero();
+	band.v.zero();
+	band.w.zero();
+
+#pragma omp parallel for schedule(static)
+	for (int k = 0; k < grid.Nz; ++k)
+		for (int j = 0; j < grid.Ny; ++j)
+			for (int i = 0; i < grid.Nx; ++i)
+			{
+				if (phi(i, j, k) >= limit)
+					continue;
+
+				float x = (i + 0.5f) * h, y = (j + 0.5f) * h, z = (k + 0.5f) * h;
+				band.phi_advected(i, j, k) = advect_point(grid, phi, -1, x, y, z, dt);
+
+				band.u(i, j, k) = advect_point(grid, grid.u, 0, x - 0.5f * h, y, z, dt);
+				band.v(i, j, k) = advect_point(grid, grid.v, 1, x, y - 0.5f * h, z, dt);
+				band.w(i, j, k) = advect_point(grid, grid.w, 2, x, y, z - 0.5f * h, dt);
+				if (i == grid.Nx - 1 || phi(i + 1, j, k) >= limit)
+					band.u(i + 1, j, k) = advect_point(grid, grid.u, 0, x + 0.5f * h, y, z, dt);
+				if (j == grid.Ny - 1 || phi(i, j + 1, k) >= limit)
+					band.v(i, j + 1, k) = advect_point(grid, grid.v, 1, x, y + 0.5f * h, z, dt);
+				if (k == grid.Nz - 1 || phi(i, j, k + 1) >= limit)
+					band.w(i, j, k + 1) = advect_point(grid, grid.w, 2, x, y, z + 0.5f * h, dt);
+			}
+}
+
+//----------------------------------------------------------------------------//
+// Redistances phi. The cells next to a sign change hold the surface and keep 
+// their values. The distances of the other cells are recomputed, up to far, 
+// by marching outwards from the surface one layer of cells at a time, where 
+// every cell solves |grad phi| = 1 upwind from its neighbours in the layers 
+// before. The cost is that of the band, not of the grid.
+//----------------------------------------------------------------------------//
+static void redistance(Array3f &phi, float h, float far)
+{
+	const int nx = phi.nx, ny = phi.ny, nz = phi.nz;
+	std::vector<char> done((size_t)nx * ny * nz, 0);
+	std::vector<int> front, next;
+
+	// The surface cells are the liquid cells with an outside neighbour and 
+	// those neighbours. Everything else restarts from far.
+	for (int k = 0; k < nz; ++k)
+		for (int j = 0; j < ny; ++j)
+			for (int i = 0; i < nx; ++i)
+			{
+				if (phi(i, j, k) >= 0.0f)
+					continue;
+
+				int n = i + nx * (j + ny * k);
+				int neighbours[6] = { i > 0 ? n - 1 : -1, i < nx - 1 ? n + 1 : -1, j > 0 ? n - nx : -1, j < ny - 1 ? n + nx : -1,
+					k > 0 ? n - nx * ny : -1, k < nz - 1 ? n + nx * ny : -1 };
+				for (int m = 0; m < 6; ++m)
+				{
+					int o = neighbours[m];
+					if (o < 0 || phi(o % nx, (o / nx) % ny, o / (nx * ny)) < 0.0f)
+						continue;
+					if (!done[o])
+					{
+						done[o] = 1;
+						front.push_back(o);
+					}
+					if (!done[n])
+					{
+						done[n] = 1;
+						front.push_back(n);
+					}
+				}
+			}
+
+	for (int k = 0; k < nz; ++k)
+		for (int j = 0; j < ny; ++j)
+			for (int i = 0; i < nx; ++i)
+				if (!done[i + nx * (j + ny * k)])
+					phi(i, j, k) = phi(i, j, k) < 0.0f ? -far : far;
+
+	const int layers = (int)std::ceil(far / h);
+	for (int layer = 0; layer < layers && !front.empty(); ++layer)
+	{
+		next.clear();
+		for (size_t f = 0; f < front.size(); ++f)
+		{
+			int n = front[f], i = n % nx, j = (n / nx) % ny, k = n / (nx * ny);
+			int neighbours[6] = { i > 0 ? n - 1 : -1, i < nx - 1 ? n + 1 : -1, j > 0 ? n - nx : -1, j < ny - 1 ? n + nx : -1,
+				k > 0 ? n - nx * ny : -1, k < nz - 1 ? n + nx * ny : -1 };
+			for (int m = 0; m < 6; ++m)
+				if (neighbours[m] >= 0 && !done[neighbours[m]])
+				{
+					done[neighbours[m]] = 2;
+					next.push_back(neighbours[m]);
+				}
+		}
+
+		for (size_t f = 0; f < next.size(); ++f)
+		{
+			int n = next[f], i = n % nx, j = (n / nx) % ny, k = n / (nx * ny);
+
+			// Nearest known distance along every axis, sorted
+			float a = min(i > 0 && done[n - 1] == 1 ? std::fabs(phi(i - 1, j, k)) : far, i < nx - 1 && done[n + 1] == 1 ? std::fabs(phi(i + 1, j, k)) : far);
+			float b = min(j > 0 && done[n - nx] == 1 ? std::fabs(phi(i, j - 1, k)) : far, j < ny - 1 && done[n + nx] == 1 ? std::fabs(phi(i, j + 1, k)) : far);
+			float c = min(k > 0 && done[n - nx * ny] == 1 ? std::fabs(phi(i, j, k - 1)) : far, k < nz - 1 && done[n + nx * ny] == 1 ? std::fabs(phi(i, j, k + 1)) : far);
+			if (a > b) std::swap(a, b);
+			if (b > c) std::swap(b, c);
+			if (a > b) std::swap(a, b);
+
+			// Upwind solution from one, two or three axes
+			float d = a + h;
+			if (d > b)
+			{
+				d = 0.5f * (a + b + sqrtf(2.0f * h * h - (a - b) * (a - b)));
+				if (d > c)
+				{
+					float s = a + b + c;
+					d = (s + sqrtf(s * s - 3.0f * (a * a + b * b + c * c - h * h))) / 3.0f;
+				}
+			}
+
+			float &p = phi(i, j, k);
+			p = p < 0.0f ? -min(d, far) : min(d, far);
+		}
+
+		for (size_t f = 0; f < next.size(); ++f)
+			done[next[f]] = 1;
+		front.swap(next);
+	}
+}
+
+//----------------------------------------------------------------------------//
+// Rebuilds phi from the particles: the distance to the nearest particle less
+// its radius, over the 2x2x2 cells around every particle. Those hold every
+// cell centre within the radius, so the liquid is exact, and redistance 
+// recomputes the other distances. Below the band, where there are no 
+// particles, the advected phi of the last step holds the liquid. The band 
+// overlaps it by a cell, so no gap opens between them.
+//----------------------------------------------------------------------------//
+void build_narrow_band(Narrow_Band &band, const Particles &particles, const Grid &grid)
+{
+	band.init(grid);
+
+	Array3f &phi = band.phi;
+	const float h = grid.h, r = NARROW_BAND_RADIUS * h, far = (band.width + 1.0f) * h;
+	for (int n = 0; n < phi.size; ++n)
+		phi.data[n] = far;
+
+	for (int p = 0; p < particles.currnp; ++p)
+	{
+		float x = particles.pos[0][p], y = particles.pos[1][p], z = particles.pos[2][p];
+		int ci = (int)std::floor(x * grid.overh - 0.5f), cj = (int)std::floor(y * grid.overh - 0.5f), ck = (int)std::floor(z * grid.overh - 0.5f);
+
+		for (int k = max(ck, 0); k <= min(ck + 1, grid.Nz - 1); ++k)
+			for (int j = max(cj, 0); j <= min(cj + 1, grid.Ny - 1); ++j)
+				for (int i = max(ci, 0); i <= min(ci + 1, grid.Nx - 1); ++i)
+				{
+					float dx = (i + 0.5f) * h - x, dy = (j + 0.5f) * h - y, dz = (k + 0.5f) * h - z;
+					float d = sqrtf(dx * dx + dy * dy + dz * dz) - r;
+					float &cell = phi(i, j, k);
+					cell = d < cell ? d : cell;
+				}
+	}
+
+	if (band.ready)
+	{
+		const float deep = -(band.width - 1.0f) * h;
+		for (int n = 0; n < phi.size; ++n)
+			if (band.phi_advected.data[n] < deep)
+				phi.data[n] = min(phi.data[n], band.phi_advected.data[n]);
+	}
+
+	redistance(phi, h, far);
+	band.ready = true;
+}
+
+static inline void fill_face(Array3f &vel, const Array3f &weightsum, const Array3f &advected, int i, int j, int k)
+{
+	if (weightsum(i, j, k) == 0.0f)
+		vel(i, j, k) = advected(i, j, k);
+}
+
+//----------------------------------------------------------------------------//
+// Marks the liquid cells of phi fluid, and gives the faces of fluid cells 
+// without particle contributions the advected velocity. Every cell fills its 
+// lower faces, and its upper faces where the next cell is not fluid.
+//----------------------------------------------------------------------------//
+void fill_narrow_band(const Narrow_Band &band, const Particles &particles, Grid &grid)
+{
+	if (!band.ready)
+		return;
+
+	Array3c &marker = grid.marker;
+	for (int k = 0; k < grid.Nz; ++k)
+		for (int j = 0; j < grid.Ny; ++j)
+			for (int i = 0; i < grid.Nx; ++i)
+				if (marker(i, j, k) == AIRCELL && band.phi(i, j, k) < -grid.h)
+					marker(i, j, k) = FLUIDCELL;
+
+#pragma omp parallel for schedule(static)
+	for (int k = 0; k < grid.Nz; ++k)
+		for (int j = 0; j < grid.Ny; ++j)
+			for (int i = 0; i < grid.Nx; ++i)
+			{
+				if (marker(i, j, k) != FLUIDCELL)
+					continue;
+
+				fill_face(grid.u, particles.weightsumx, band.u, i, j, k);
+				fill_face(grid.v, particles.weightsumy, band.v, i, j, k);
+				fill_face(grid.w, particles.weightsumz, band.w, i, j, k);
+				if (i == grid.Nx - 1 || marker(i + 1, j, k) != FLUIDCELL)
+					fill_face(grid.u, particles.weightsumx, band.u, i + 1, j, k);
+				if (j == grid.Ny - 1 || marker(i, j + 1, k) != FLUIDCELL)
+					fill_face(grid.v, particles.weightsumy, band.v, i, j + 1, k);
+				if (k == grid.Nz - 1 || marker(i, j, k + 1) != FLUIDCELL)
+					fill_face(grid.w, particles.weightsumz, band.w, i, j, k + 1);
+			}
+}
+
+//----------------------------------------------------------------------------//
+// Deletes the particles below the band, keeping the order of the others, and
+// refills the band cells at least a cell below the surface that have fewer
+// than NARROW_BAND_RESEED_MIN particles. The new particles are placed at
+// random within the band part of the cell and take the grid velocity.
+//----------------------------------------------------------------------------//
+int trim_narrow_band(Narrow_Band &band, Particles &particles, const Grid &grid, Random &rng)
+{
+	if (!band.ready)
+		return 0;
+
+	const float h = grid.h, bottom = -band.width * h;
+	int np = particles.currnp;
+	std::vector<char> below(np);
+
+#pragma omp parallel for schedule(static)
+	for (int p = 0; p < np; ++p)
+		below[p] = sample(grid, band.phi, -1, particles.pos[0][p], particles.pos[1][p], particles.pos[2][p]) < bottom;
+
+	int removed = compact_particles(particles, below), kept = particles.currnp;
+
+	band.count.assign((size_t)grid.Nx * grid.Ny * grid.Nz, 0);
+	for (int p = 0; p < kept; ++p)
+	{
+		int i = min((int)(particles.pos[0][p] * grid.overh), grid.Nx - 1);
+		int j = min((int)(particles.pos[1][p] * grid.overh), grid.Ny - 1);
+		int k = min((int)(particles.pos[2][p] * grid.overh), grid.Nz - 1);
+		unsigned char &n = band.count[i + grid.Nx * (j + grid.Ny * k)];
+		if (n < 255)
+			++n;
+	}
+
+	for (int k = 0; k < grid.Nz; ++k)
+		for (int j = 0; j < grid.Ny; ++j)
+			for (int i = 0; i < grid.Nx; ++i)
+			{
+				float d = band.phi(i, j, k);
+				int n = band.count[i + grid.Nx * (j + grid.Ny * k)];
+				if (grid.marker(i, j, k) == SOLIDCELL || d >= -h || d < bottom || n >= NARROW_BAND_RESEED_MIN)
+					continue;
+
+				for (; n < NARROW_BAND_RESEED; ++n)
+				{
+					vec3f pos((i + rng.uniform()) * h, (j + rng.uniform()) * h, (k + rng.uniform()) * h);
+					float dp = sample(grid, band.phi, -1, pos[0], pos[1], pos[2]);
+					if (dp >= 0.0f || dp < bottom)
+						continue;
+
+					float vel[3];
+					sample_velocity(grid, pos[0], pos[1], pos[2], vel);
+					add_particle(particles, pos, vec3f(vel[0], vel[1], vel[2]));
+				}
+			}
+
+	return removed;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#ifndef NARROW_BAND_H_
+#define NARROW_BAND_H_
+
+#include "array3d.h"
+#include "grid.h"
+#include "particles.h"
+#include "util.h"
+
+#define NARROW_BAND_RADIUS 0.75f // Particle radius of the particle level set, in cells
+#define NARROW_BAND_RESEED_MIN 2 // Band cells with fewer particles are refilled...
+#define NARROW_BAND_RESEED 8 // ...to this many, the 2x2x2 of init_box
+
+//----------------------------------------------------------------------------//
+// Narrow band FLIP: particles are only kept within width cells of the liquid
+// surface, and the deep interior is a grid level set with grid advected
+// velocities. Every step
+//  - advect_narrow_band advects phi and the velocities of the last step
+//    semi-Lagrangian on the grid,
+//  - build_narrow_band rebuilds phi from the particles in the band and the
+//    advected phi of the interior, and redistances it,
+//  - fill_narrow_band marks the interior cells fluid and gives the faces
+//    without particle contributions the advected velocity, after the P2G,
+//  - trim_narrow_band deletes the particles below the band and refills the
+//    band cells that ran low, after the G2P.
+// The first step builds phi from all particles, and its trim removes the
+// interior particles.
+//----------------------------------------------------------------------------//
+struct Narrow_Band
+{
+	float width; // In cells, 0 disables the narrow band
+	bool ready; // phi holds the liquid of the last step
+	Array3f phi; // Signed distance at the cell centres, negative in the liquid
+	Array3f phi_advected;
+	Array3f u, v, w; // Advected grid velocities
+	std::vector<unsigned char> count; // Particles per cell, in the linear cell index
+
+	Narrow_Band() : width(0.0f), ready(false) {}
+
+	bool enabled() const { return width > 0.0f; }
+	void init(const Grid &grid); // Allocates the arrays for the grid, if they do not fit it
+};
+
+void advect_narrow_band(Narrow_Band &band, const Grid &grid, float dt);
+void build_narrow_band(Narrow_Band &band, const Particles &particles, const Grid &grid);
+void fill_narrow_band(const Narrow_Band &band, const Particles &particles, Grid &grid);
+int trim_narrow_band(Narrow_Band &band, Particles &particles, const Grid &grid, Random &rng); // Returns the particles removed
+
+#endif
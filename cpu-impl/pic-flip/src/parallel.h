@@ -0,0 +1,54 @@
+#pragma once
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+// Thin wrapper around OpenMP so the solver also builds without it
+
+#include <cstring>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Sets the number of threads used by the parallel loops, 0 keeps the default
+inline void set_num_threads(int n)
+{
+#ifdef _OPENMP
+	if (n > 0)
+		omp_set_num_threads(n);
+#endif
+}
+
+inline int max_threads()
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+inline int thread_id()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// Sets bytes bytes from data to zero, in parallel over max_threads() chunks
+inline void parallel_zero(void *data, size_t bytes)
+{
+	const int nchunks = max_threads();
+	const size_t chunk = (bytes + nchunks - 1) / nchunks;
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < nchunks; ++t)
+	{
+		size_t first = t * chunk;
+		if (first < bytes)
+			std::memset((char *)data + first, 0, bytes - first < chunk ? bytes - first : chunk);
+	}
+}
+
+#endif
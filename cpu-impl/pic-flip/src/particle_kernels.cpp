@@ -0,0 +1,67 @@
+#include "particle_kernels.h"
+#include "simd.h"
+
+static inline void particle_velocity(const Grid &grid, float x, float y, float z, float &vx, float &vy, float &vz)
+{
+	Stencil s;
+	grid.stencil(x, y, z, s);
+
+	vx = grid.u.trilerp(s.ui, s.j, s.k, s.ufx, s.fy, s.fz);
+	vy = grid.v.trilerp(s.i, s.vj, s.k, s.fx, s.vfy, s.fz);
+	vz = grid.w.trilerp(s.i, s.j, s.wk, s.fx, s.fy, s.wfz);
+}
+
+// The velocity and its change of every component come from one walk over the corners
+static inline void particle_pic_flip(const Grid &grid, float alpha, float x, float y, float z, float &vx, float &vy, float &vz)
+{
+	Stencil s;
+	grid.stencil(x, y, z, s);
+
+	float u, du, v, dv, w, dw;
+	grid.u.trilerp2(grid.du, s.ui, s.j, s.k, s.ufx, s.fy, s.fz, u, du);
+	grid.v.trilerp2(grid.dv, s.i, s.vj, s.k, s.fx, s.vfy, s.fz, v, dv);
+	grid.w.trilerp2(grid.dw, s.i, s.j, s.wk, s.fx, s.fy, s.wfz, w, dw);
+
+	vx = alpha * u + (1.0f - alpha) * (vx + du);
+	vy = alpha * v + (1.0f - alpha) * (vy + dv);
+	vz = alpha * w + (1.0f - alpha) * (vz + dw);
+}
+
+static void velocity_scalar(const Grid &grid, const float *x, const float *y, const float *z, int n,
+	float *vx, float *vy, float *vz)
+{
+	for (int p = 0; p < n; ++p)
+		particle_velocity(grid, x[p], y[p], z[p], vx[p], vy[p], vz[p]);
+}
+
+static void pic_flip_scalar(const Grid &grid, float alpha, const float *x, const float *y, const float *z, int n,
+	float *vx, float *vy, float *vz)
+{
+	for (int p = 0; p < n; ++p)
+		particle_pic_flip(grid, alpha, x[p], y[p], z[p], vx[p], vy[p], vz[p]);
+}
+
+const Particle_Kernels particle_kernels_scalar =
+{
+	velocity_scalar,
+	pic_flip_scalar
+};
+
+const Particle_Kernels &particle_kernels()
+{
+#if ARRAY3_LAYOUT == ARRAY3_LINEAR
+	switch (simd_level())
+	{
+#ifdef PICFLIP_SIMD_AVX512
+	case SIMD_AVX512: return particle_kernels_avx512;
+#endif
+#ifdef PICFLIP_SIMD_AVX2
+	case SIMD_AVX2: return particle_kernels_avx2;
+#endif
+	default: return particle_kernels_scalar;
+	}
+#else
+	// The vector kernels index the grids linearly
+	return particle_kernels_scalar;
+#endif
+}
@@ -0,0 +1,40 @@
+#pragma once
+#ifndef PARTICLE_KERNELS_H_
+#define PARTICLE_KERNELS_H_
+
+#include "grid.h"
+
+//----------------------------------------------------------------------------//
+// Grid to particle kernels, one implementation per instruction set, selected
+// like the blas_kernels(). They work on n particles given as separate x, y and
+// z arrays. The vector versions compute every particle with the same float
+// operations as Grid::bary_* and Array3::trilerp, so all versions give bitwise
+// identical results. They address the grids linearly and are only used with
+// the linear Array3 layout. The particles left over by the vector loops go
+// through particle_kernels_scalar.
+//----------------------------------------------------------------------------//
+
+struct Particle_Kernels
+{
+	// (vx, vy, vz) = the staggered grid velocity (u, v, w) at the particles
+	void(*velocity)(const Grid &grid, const float *x, const float *y, const float *z, int n,
+		float *vx, float *vy, float *vz);
+
+	// The PIC/FLIP update of the particle velocities:
+	// v = alpha * (u, v, w) + (1 - alpha) * (v + (du, dv, dw))
+	void(*pic_flip)(const Grid &grid, float alpha, const float *x, const float *y, const float *z, int n,
+		float *vx, float *vy, float *vz);
+};
+
+// The kernels of the active simd_level()
+const Particle_Kernels &particle_kernels();
+
+extern const Particle_Kernels particle_kernels_scalar;
+#ifdef PICFLIP_SIMD_AVX2
+extern const Particle_Kernels particle_kernels_avx2;
+#endif
+#ifdef PICFLIP_SIMD_AVX512
+extern const Particle_Kernels particle_kernels_avx512;
+#endif
+
+#endif
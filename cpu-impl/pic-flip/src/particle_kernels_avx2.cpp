@@ -0,0 +1,129 @@
+//----------------------------------------------------------------------------//
+// AVX2 versions of the grid to particle kernels, 8 particles per iteration. 
+// Built with AVX2 enabled for this file only, see blas_kernels_avx2.cpp.
+//----------------------------------------------------------------------------//
+#include "particle_kernels.h"
+
+#ifdef PICFLIP_SIMD_AVX2
+
+#include <immintrin.h>
+
+// Grid::bary_x and friends for 8 coordinates
+static inline void bary8(__m256 x, __m256 overh, __m256i &i, __m256 &f)
+{
+	__m256 s = _mm256_mul_ps(x, overh);
+	i = _mm256_cvttps_epi32(s);
+	f = _mm256_sub_ps(s, _mm256_floor_ps(s));
+}
+
+// Grid::bary_x_centre and friends, last is the largest cell index N - 2
+static inline void bary_centre8(__m256 x, __m256 overh, int last, __m256i &i, __m256 &f)
+{
+	__m256 s = _mm256_sub_ps(_mm256_mul_ps(x, overh), _mm256_set1_ps(0.5f));
+	i = _mm256_cvttps_epi32(s);
+	f = _mm256_sub_ps(s, _mm256_floor_ps(s));
+
+	__m256i vlast = _mm256_set1_epi32(last);
+	__m256i below = _mm256_cmpgt_epi32(_mm256_setzero_si256(), i);
+	__m256i above = _mm256_cmpgt_epi32(i, vlast);
+	i = _mm256_blendv_epi8(_mm256_blendv_epi8(i, _mm256_setzero_si256(), below), vlast, above);
+	f = _mm256_blendv_ps(f, _mm256_setzero_ps(), _mm256_castsi256_ps(below));
+	f = _mm256_blendv_ps(f, _mm256_set1_ps(1.0f), _mm256_castsi256_ps(above));
+}
+
+// Linear index of element (i, j, k) of a for 8 particles
+static inline __m256i index8(const Array3f &a, __m256i i, __m256i j, __m256i k)
+{
+	return _mm256_add_epi32(i, _mm256_mullo_epi32(_mm256_set1_epi32(a.nx), _mm256_add_epi32(j, _mm256_mullo_epi32(k, _mm256_set1_epi32(a.ny)))));
+}
+
+// Array3::trilerp of the linear array a for 8 particles, from the index n of the lowest corner
+static inline __m256 trilerp8(const Array3f &a, __m256i n, __m256 fx, __m256 fy, __m256 fz)
+{
+	const int sy = a.nx, sz = a.nx * a.ny;
+	const __m256 one = _mm256_set1_ps(1.0f);
+	__m256i n_j = _mm256_add_epi32(n, _mm256_set1_epi32(sy));
+	__m256i n_k = _mm256_add_epi32(n, _mm256_set1_epi32(sz));
+	__m256i n_jk = _mm256_add_epi32(n_j, _mm256_set1_epi32(sz));
+
+	__m256 c000 = _mm256_i32gather_ps(a.data, n, 4), c100 = _mm256_i32gather_ps(a.data + 1, n, 4);
+	__m256 c010 = _mm256_i32gather_ps(a.data, n_j, 4), c110 = _mm256_i32gather_ps(a.data + 1, n_j, 4);
+	__m256 c001 = _mm256_i32gather_ps(a.data, n_k, 4), c101 = _mm256_i32gather_ps(a.data + 1, n_k, 4);
+	__m256 c011 = _mm256_i32gather_ps(a.data, n_jk, 4), c111 = _mm256_i32gather_ps(a.data + 1, n_jk, 4);
+
+	__m256 gx = _mm256_sub_ps(one, fx), gy = _mm256_sub_ps(one, fy), gz = _mm256_sub_ps(one, fz);
+	__m256 fval = _mm256_add_ps(_mm256_mul_ps(gx, _mm256_add_ps(_mm256_mul_ps(gy, c000), _mm256_mul_ps(fy, c010))),
+		_mm256_mul_ps(fx, _mm256_add_ps(_mm256_mul_ps(gy, c100), _mm256_mul_ps(fy, c110))));
+	__m256 bval = _mm256_add_ps(_mm256_mul_ps(gx, _mm256_add_ps(_mm256_mul_ps(gy, c001), _mm256_mul_ps(fy, c011))),
+		_mm256_mul_ps(fx, _mm256_add_ps(_mm256_mul_ps(gy, c101), _mm256_mul_ps(fy, c111))));
+	return _mm256_add_ps(_mm256_mul_ps(gz, fval), _mm256_mul_ps(fz, bval));
+}
+
+// Cell indices and weights of 8 particles for the u, v and w grids
+struct G2P_Weights8
+{
+	__m256i ui, i, vj, j, wk, k;
+	__m256 ufx, fx, vfy, fy, wfz, fz;
+};
+
+static inline void weights8(const Grid &grid, const float *x, const float *y, const float *z, int p, G2P_Weights8 &c)
+{
+	__m256 overh = _mm256_set1_ps(grid.overh);
+	__m256 vx = _mm256_loadu_ps(x + p), vy = _mm256_loadu_ps(y + p), vz = _mm256_loadu_ps(z + p);
+
+	bary8(vx, overh, c.ui, c.ufx);
+	bary_centre8(vx, overh, grid.Nx - 2, c.i, c.fx);
+	bary8(vy, overh, c.vj, c.vfy);
+	bary_centre8(vy, overh, grid.Ny - 2, c.j, c.fy);
+	bary8(vz, overh, c.wk, c.wfz);
+	bary_centre8(vz, overh, grid.Nz - 2, c.k, c.fz);
+}
+
+static void velocity_avx2(const Grid &grid, const float *x, const float *y, const float *z, int n,
+	float *vx, float *vy, float *vz)
+{
+	int p = 0;
+	for (; p + 8 <= n; p += 8)
+	{
+		G2P_Weights8 c;
+		weights8(grid, x, y, z, p, c);
+		_mm256_storeu_ps(vx + p, trilerp8(grid.u, index8(grid.u, c.ui, c.j, c.k), c.ufx, c.fy, c.fz));
+		_mm256_storeu_ps(vy + p, trilerp8(grid.v, index8(grid.v, c.i, c.vj, c.k), c.fx, c.vfy, c.fz));
+		_mm256_storeu_ps(vz + p, trilerp8(grid.w, index8(grid.w, c.i, c.j, c.wk), c.fx, c.fy, c.wfz));
+	}
+	particle_kernels_scalar.velocity(grid, x + p, y + p, z + p, n - p, vx + p, vy + p, vz + p);
+}
+
+static void pic_flip_avx2(const Grid &grid, float alpha, const float *x, const float *y, const float *z, int n,
+	float *vx, float *vy, float *vz)
+{
+	const __m256 a = _mm256_set1_ps(alpha), b = _mm256_set1_ps(1.0f - alpha);
+
+	int p = 0;
+	for (; p + 8 <= n; p += 8)
+	{
+		G2P_Weights8 c;
+		weights8(grid, x, y, z, p, c);
+
+		__m256i nu = index8(grid.u, c.ui, c.j, c.k); // Shared by u and du, which have the same size
+		__m256 u = trilerp8(grid.u, nu, c.ufx, c.fy, c.fz), du = trilerp8(grid.du, nu, c.ufx, c.fy, c.fz);
+		_mm256_storeu_ps(vx + p, _mm256_add_ps(_mm256_mul_ps(a, u), _mm256_mul_ps(b, _mm256_add_ps(_mm256_loadu_ps(vx + p), du))));
+
+		__m256i nv = index8(grid.v, c.i, c.vj, c.k); // Shared by v and dv, which have the same size
+		__m256 v = trilerp8(grid.v, nv, c.fx, c.vfy, c.fz), dv = trilerp8(grid.dv, nv, c.fx, c.vfy, c.fz);
+		_mm256_storeu_ps(vy + p, _mm256_add_ps(_mm256_mul_ps(a, v), _mm256_mul_ps(b, _mm256_add_ps(_mm256_loadu_ps(vy + p), dv))));
+
+		__m256i nw = index8(grid.w, c.i, c.j, c.wk); // Shared by w and dw, which have the same size
+		__m256 w = trilerp8(grid.w, nw, c.fx, c.fy, c.wfz), dw = trilerp8(grid.dw, nw, c.fx, c.fy, c.wfz);
+		_mm256_storeu_ps(vz + p, _mm256_add_ps(_mm256_mul_ps(a, w), _mm256_mul_ps(b, _mm256_add_ps(_mm256_loadu_ps(vz + p), dw))));
+	}
+	particle_kernels_scalar.pic_flip(grid, alpha, x + p, y + p, z + p, n - p, vx + p, vy + p, vz + p);
+}
+
+const Particle_Kernels particle_kernels_avx2 =
+{
+	velocity_avx2,
+	pic_flip_avx2
+};
+
+#endif
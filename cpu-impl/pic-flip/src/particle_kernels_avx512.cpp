@@ -0,0 +1,129 @@
+//----------------------------------------------------------------------------//
+// AVX-512 versions of the grid to particle kernels, 16 particles per 
+// iteration. Built with AVX-512F enabled for this file only, see 
+// blas_kernels_avx512.cpp.
+//----------------------------------------------------------------------------//
+#include "particle_kernels.h"
+
+#ifdef PICFLIP_SIMD_AVX512
+
+#include <immintrin.h>
+
+// Grid::bary_x and friends for 16 coordinates
+static inline void bary16(__m512 x, __m512 overh, __m512i &i, __m512 &f)
+{
+	__m512 s = _mm512_mul_ps(x, overh);
+	i = _mm512_cvttps_epi32(s);
+	f = _mm512_sub_ps(s, _mm512_roundscale_ps(s, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+}
+
+// Grid::bary_x_centre and friends, last is the largest cell index N - 2
+static inline void bary_centre16(__m512 x, __m512 overh, int last, __m512i &i, __m512 &f)
+{
+	__m512 s = _mm512_sub_ps(_mm512_mul_ps(x, overh), _mm512_set1_ps(0.5f));
+	i = _mm512_cvttps_epi32(s);
+	f = _mm512_sub_ps(s, _mm512_roundscale_ps(s, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+
+	__m512i vlast = _mm512_set1_epi32(last);
+	__mmask16 below = _mm512_cmplt_epi32_mask(i, _mm512_setzero_si512());
+	__mmask16 above = _mm512_cmpgt_epi32_mask(i, vlast);
+	i = _mm512_mask_mov_epi32(_mm512_mask_mov_epi32(i, below, _mm512_setzero_si512()), above, vlast);
+	f = _mm512_mask_mov_ps(_mm512_mask_mov_ps(f, below, _mm512_setzero_ps()), above, _mm512_set1_ps(1.0f));
+}
+
+// Linear index of element (i, j, k) of a for 16 particles
+static inline __m512i index16(const Array3f &a, __m512i i, __m512i j, __m512i k)
+{
+	return _mm512_add_epi32(i, _mm512_mullo_epi32(_mm512_set1_epi32(a.nx), _mm512_add_epi32(j, _mm512_mullo_epi32(k, _mm512_set1_epi32(a.ny)))));
+}
+
+// Array3::trilerp of the linear array a for 16 particles, from the index n of the lowest corner
+static inline __m512 trilerp16(const Array3f &a, __m512i n, __m512 fx, __m512 fy, __m512 fz)
+{
+	const int sy = a.nx, sz = a.nx * a.ny;
+	const __m512 one = _mm512_set1_ps(1.0f);
+	__m512i n_j = _mm512_add_epi32(n, _mm512_set1_epi32(sy));
+	__m512i n_k = _mm512_add_epi32(n, _mm512_set1_epi32(sz));
+	__m512i n_jk = _mm512_add_epi32(n_j, _mm512_set1_epi32(sz));
+
+	__m512 c000 = _mm512_i32gather_ps(n, a.data, 4), c100 = _mm512_i32gather_ps(n, a.data + 1, 4);
+	__m512 c010 = _mm512_i32gather_ps(n_j, a.data, 4), c110 = _mm512_i32gather_ps(n_j, a.data + 1, 4);
+	__m512 c001 = _mm512_i32gather_ps(n_k, a.data, 4), c101 = _mm512_i32gather_ps(n_k, a.data + 1, 4);
+	__m512 c011 = _mm512_i32gather_ps(n_jk, a.data, 4), c111 = _mm512_i32gather_ps(n_jk, a.data + 1, 4);
+
+	__m512 gx = _mm512_sub_ps(one, fx), gy = _mm512_sub_ps(one, fy), gz = _mm512_sub_ps(one, fz);
+	__m512 fval = _mm512_add_ps(_mm512_mul_ps(gx, _mm512_add_ps(_mm512_mul_ps(gy, c000), _mm512_mul_ps(fy, c010))),
+		_mm512_mul_ps(fx, _mm512_add_ps(_mm512_mul_ps(gy, c100), _mm512_mul_ps(fy, c110))));
+	__m512 bval = _mm512_add_ps(_mm512_mul_ps(gx, _mm512_add_ps(_mm512_mul_ps(gy, c001), _mm512_mul_ps(fy, c011))),
+		_mm512_mul_ps(fx, _mm512_add_ps(_mm512_mul_ps(gy, c101), _mm512_mul_ps(fy, c111))));
+	return _mm512_add_ps(_mm512_mul_ps(gz, fval), _mm512_mul_ps(fz, bval));
+}
+
+// Cell indices and weights of 16 particles for the u, v and w grids
+struct G2P_Weights16
+{
+	__m512i ui, i, vj, j, wk, k;
+	__m512 ufx, fx, vfy, fy, wfz, fz;
+};
+
+static inline void weights16(const Grid &grid, const float *x, const float *y, const float *z, int p, G2P_Weights16 &c)
+{
+	__m512 overh = _mm512_set1_ps(grid.overh);
+	__m512 vx = _mm512_loadu_ps(x + p), vy = _mm512_loadu_ps(y + p), vz = _mm512_loadu_ps(z + p);
+
+	bary16(vx, overh, c.ui, c.ufx);
+	bary_centre16(vx, overh, grid.Nx - 2, c.i, c.fx);
+	bary16(vy, overh, c.vj, c.vfy);
+	bary_centre16(vy, overh, grid.Ny - 2, c.j, c.fy);
+	bary16(vz, overh, c.wk, c.wfz);
+	bary_centre16(vz, overh, grid.Nz - 2, c.k, c.fz);
+}
+
+static void velocity_avx512(const Grid &grid, const float *x, const float *y, const float *z, int n,
+	float *vx, float *vy, float *vz)
+{
+	int p = 0;
+	for (; p + 16 <= n; p += 16)
+	{
+		G2P_Weights16 c;
+		weights16(grid, x, y, z, p, c);
+		_mm512_storeu_ps(vx + p, trilerp16(grid.u, index16(grid.u, c.ui, c.j, c.k), c.ufx, c.fy, c.fz));
+		_mm512_storeu_ps(vy + p, trilerp16(grid.v, index16(grid.v, c.i, c.vj, c.k), c.fx, c.vfy, c.fz));
+		_mm512_storeu_ps(vz + p, trilerp16(grid.w, index16(grid.w, c.i, c.j, c.wk), c.fx, c.fy, c.wfz));
+	}
+	particle_kernels_scalar.velocity(grid, x + p, y + p, z + p, n - p, vx + p, vy + p, vz + p);
+}
+
+static void pic_flip_avx512(const Grid &grid, float alpha, const float *x, const float *y, const float *z, int n,
+	float *vx, float *vy, float *vz)
+{
+	const __m512 a = _mm512_set1_ps(alpha), b = _mm512_set1_ps(1.0f - alpha);
+
+	int p = 0;
+	for (; p + 16 <= n; p += 16)
+	{
+		G2P_Weights16 c;
+		weights16(grid, x, y, z, p, c);
+
+		__m512i nu = index16(grid.u, c.ui, c.j, c.k); // Shared by u and du, which have the same size
+		__m512 u = trilerp16(grid.u, nu, c.ufx, c.fy, c.fz), du = trilerp16(grid.du, nu, c.ufx, c.fy, c.fz);
+		_mm512_storeu_ps(vx + p, _mm512_add_ps(_mm512_mul_ps(a, u), _mm512_mul_ps(b, _mm512_add_ps(_mm512_loadu_ps(vx + p), du))));
+
+		__m512i nv = index16(grid.v, c.i, c.vj, c.k); // Shared by v and dv, which have the same size
+		__m512 v = trilerp16(grid.v, nv, c.fx, c.vfy, c.fz), dv = trilerp16(grid.dv, nv, c.fx, c.vfy, c.fz);
+		_mm512_storeu_ps(vy + p, _mm512_add_ps(_mm512_mul_ps(a, v), _mm512_mul_ps(b, _mm512_add_ps(_mm512_loadu_ps(vy + p), dv))));
+
+		__m512i nw = index16(grid.w, c.i, c.j, c.wk); // Shared by w and dw, which have the same size
+		__m512 w = trilerp16(grid.w, nw, c.fx, c.fy, c.wfz), dw = trilerp16(grid.dw, nw, c.fx, c.fy, c.wfz);
+		_mm512_storeu_ps(vz + p, _mm512_add_ps(_mm512_mul_ps(a, w), _mm512_mul_ps(b, _mm512_add_ps(_mm512_loadu_ps(vz + p), dw))));
+	}
+	particle_kernels_scalar.pic_flip(grid, alpha, x + p, y + p, z + p, n - p, vx + p, vy + p, vz + p);
+}
+
+const Particle_Kernels particle_kernels_avx512 =
+{
+	velocity_avx512,
+	pic_flip_avx512
+};
+
+#endif
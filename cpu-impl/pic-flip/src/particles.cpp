@@ -1,154 +1,298 @@
 #include "particles.h"
+#include "particle_kernels.h"
+#include "parallel.h"
+#include "simd.h"
 
-Particles::Particles() {}
+Particles::Particles() : maxnp(0), currnp(0)
+{
+	for (int c = 0; c < 3; ++c)
+		pos[c] = vel[c] = 0;
+	scratch = 0;
+}
 
-Particles::Particles(int maxParticles, Grid &grid)
+Particles::Particles(int maxParticles, Grid &grid) : maxnp(0), currnp(0)
 {
+	for (int c = 0; c < 3; ++c)
+		pos[c] = vel[c] = 0;
+	scratch = 0;
 	init(maxParticles, grid);
 }
 
+Particles::~Particles()
+{
+	delete_memory();
+}
+
 void Particles::init(int maxParticles, Grid &grid)
 {
+	delete_memory();
 	maxnp = maxParticles;
 	currnp = 0;
+	for (int c = 0; c < 3; ++c)
+	{
+		pos[c] = (float *)simd_alloc(maxnp * sizeof(float));
+		vel[c] = (float *)simd_alloc(maxnp * sizeof(float));
+	}
+	scratch = (float *)simd_alloc(maxnp * sizeof(float));
 	weightsumx.init(grid.u.nx, grid.u.ny, grid.u.nz);
 	weightsumy.init(grid.v.nx, grid.v.ny, grid.v.nz);
 	weightsumz.init(grid.w.nx, grid.w.ny, grid.w.nz);
 }
 
+void Particles::delete_memory()
+{
+	for (int c = 0; c < 3; ++c)
+	{
+		simd_free(pos[c]);
+		simd_free(vel[c]);
+		pos[c] = vel[c] = 0;
+	}
+	simd_free(scratch);
+	scratch = 0;
+	maxnp = currnp = 0;
+}
+
 void Particles::clear()
 {
-	pos.clear();
-	vel.clear();
 	currnp = 0;
 }
 
 void Particles::remove(int i)
 {
-	std::swap(vel[i], vel.back());
-	std::swap(pos[i], pos.back());
-	vel.pop_back();
-	pos.pop_back();
-	currnp = vel.size();
+	--currnp;
+	for (int c = 0; c < 3; ++c)
+	{
+		std::swap(pos[c][i], pos[c][currnp]);
+		std::swap(vel[c][i], vel[c][currnp]);
+	}
 }
 
-void move_particles_in_grid(Particles &particles, Grid &grid, float dt)
+void Particles::copy_positions(vec3f *out) const
 {
-	vec3f vel;
-	int ui, i, vj, j, wk, k;
-	float ufx, fx, vfy, fy, wfz, fz;
+	for (int p = 0; p < currnp; ++p)
+		out[p] = position(p);
+}
 
-	float xmax = (float)((grid.Nx - 1.001) * grid.h), xmin = (float)(1.001 * grid.h);
-	float ymax = (float)((grid.Ny - 1.001) * grid.h), ymin = (float)(1.001 * grid.h);
-	float zmax = (float)((grid.Nz - 1.001) * grid.h), zmin = (float)(1.001 * grid.h);
+void Particles::copy_velocities(vec3f *out) const
+{
+	for (int p = 0; p < currnp; ++p)
+		out[p] = velocity(p);
+}
 
-	for (size_t p = 0; p < particles.pos.size(); p++)
-	{
-		// Trilerp from grid
-		grid.bary_x(particles.pos[p][0], ui, ufx);
-		grid.bary_x_centre(particles.pos[p][0], i, fx);
+//----------------------------------------------------------------------------//
+// Moves particle p to newpos, and pushes it out of solid cells. Particles in
+// a solid cell stay where they are.
+//----------------------------------------------------------------------------//
+static void move_particle_to(Particles &particles, Grid &grid, int p, vec3f newpos)
+{
+	int ui, vj, wk;
+	float ufx, vfy, wfz;
 
-		grid.bary_y(particles.pos[p][1], vj, vfy);
-		grid.bary_y_centre(particles.pos[p][1], j, fy);
+	grid.bary_x(particles.pos[0][p], ui, ufx);
+	grid.bary_y(particles.pos[1][p], vj, vfy);
+	grid.bary_z(particles.pos[2][p], wk, wfz);
 
-		grid.bary_z(particles.pos[p][2], wk, wfz);
-		grid.bary_z_centre(particles.pos[p][2], k, fz);
+	if (grid.marker(ui, vj, wk) == SOLIDCELL)
+		return;
 
-		vel = vec3f(grid.u.trilerp(ui, j, k, ufx, fy, fz), grid.v.trilerp(i, vj, k, fx, vfy, fz), grid.w.trilerp(i, j, wk, fx, fy, wfz));
+	grid.bary_x(newpos[0], ui, ufx);
+	grid.bary_y(newpos[1], vj, vfy);
+	grid.bary_z(newpos[2], wk, wfz);
 
-		// Move particle one step with forward euler
-		if (grid.marker(ui, vj, wk) == SOLIDCELL)
-			continue;
+	if (ui < 0 || vj < 0 || wk < 0)
+		return;
 
-		vec3f newpos = particles.pos[p] + dt * vel;
+	// Push particle out
+	float scale = 1.0;
+	bool moveX = true, moveY = true, moveZ = true;
+	vec3f movevec(0.0);
+	if (grid.marker(ui, vj, wk) == SOLIDCELL)
+	{
+		// X - AXIS
+		if (grid.marker(ui + 1, vj, wk) != SOLIDCELL) // Push left
+		{
+			movevec[0] += 1.0;
+		}
+		else if (grid.marker(ui - 1, vj, wk) != SOLIDCELL) // Push right
+		{
+			movevec[0] -= 1.0;
+		}
+		else
+		{
+			moveX = false;
+		}
 
-		grid.bary_x(newpos[0], ui, ufx);
-		grid.bary_y(newpos[1], vj, vfy);
-		grid.bary_z(newpos[2], wk, wfz);
+		// Y - AXIS 
 
-		if (ui < 0 || vj < 0 || wk < 0)
-			continue;
+		if (grid.marker(ui, vj + 1, wk) != SOLIDCELL) // Push up
+		{
+			movevec[1] += 1.0;
+		}
+		else if (grid.marker(ui, vj - 1, wk) != SOLIDCELL) // Push down
+		{
+			movevec[1] -= 1.0;
+		}
+		else
+		{
+			moveY = false;
+		}
 
-		// Push particle out
-		float scale = 1.0;
-		bool moveX = true, moveY = true, moveZ = true;
-		vec3f movevec(0.0);
-		if (grid.marker(ui, vj, wk) == SOLIDCELL)
+		// Z - AXIS 
+		if (grid.marker(ui, vj, wk + 1) != SOLIDCELL) // Push backwards
 		{
-			// X - AXIS
-			if (grid.marker(ui + 1, vj, wk) != SOLIDCELL) // Push left
-			{
-				movevec[0] += 1.0;
-			}
-			else if (grid.marker(ui - 1, vj, wk) != SOLIDCELL) // Push right
-			{
-				movevec[0] -= 1.0;
-			}
-			else
-			{
-				moveX = false;
-			}
+			movevec[2] += 1.0;
+		}
+		else if (grid.marker(ui, vj, wk - 1) != SOLIDCELL) // Push forward
+		{
+			movevec[2] += 1.0;
+		}
+		else
+		{
+			moveZ = false;
+		}
 
-			// Y - AXIS 
+	}
 
-			if (grid.marker(ui, vj + 1, wk) != SOLIDCELL) // Push up
-			{
-				movevec[1] += 1.0;
-			}
-			else if (grid.marker(ui, vj - 1, wk) != SOLIDCELL) // Push down
-			{
-				movevec[1] -= 1.0;
-			}
-			else
-			{
-				moveY = false;
-			}
+	//if surrounded by solid
+	if (!moveZ && !moveY && !moveX)
+	{
+		newpos = particles.position(p);
+	}
+	else
+	{
+		newpos += movevec * grid.h * scale;
+	}
+
+	particles.set_position(p, newpos);
+}
+
+// Moves particle p one forward euler step with the grid velocity vel
+static void move_particle(Particles &particles, Grid &grid, int p, const vec3f &vel, float dt)
+{
+	move_particle_to(particles, grid, p, particles.position(p) + dt * vel);
+}
+
+void move_particles_in_grid(Particles &particles, Grid &grid, float dt)
+{
+	const Particle_Kernels &kernels = particle_kernels();
+	int np = particles.currnp;
+	int nblocks = (np + G2P_BLOCK - 1) / G2P_BLOCK;
+
+	// Every particle only reads the grid and writes its own position
+#pragma omp parallel for schedule(static)
+	for (int b = 0; b < nblocks; ++b)
+	{
+		int first = b * G2P_BLOCK, n = min(G2P_BLOCK, np - first);
+		float velx[G2P_BLOCK], vely[G2P_BLOCK], velz[G2P_BLOCK];
+
+		// Trilerp from grid
+		kernels.velocity(grid, particles.pos[0] + first, particles.pos[1] + first, particles.pos[2] + first, n, velx, vely, velz);
+
+		for (int q = 0; q < n; ++q)
+			move_particle(particles, grid, first + q, vec3f(velx[q], vely[q], velz[q]), dt);
+	}
+}
+
+//----------------------------------------------------------------------------//
+// Runge-Kutta advection over dt with a step count per particle: a particle 
+// whose velocity at the start would carry it more than cfl cells takes n 
+// steps of dt / n, up to ADVECT_MAX_STEPS, all others a single step. The 
+// particles of a block take their steps together, and every step first 
+// compacts the particles that still have steps left, so the velocity kernel
+// runs on full arrays. The stage points are clamped into the grid, and the 
+// end of every step is pushed out of solids like a forward Euler step.
+//----------------------------------------------------------------------------//
+void advect_particles(Particles &particles, Grid &grid, float dt, int order, float cfl)
+{
+	const float lo[3] = { 1.001f * grid.h, 1.001f * grid.h, 1.001f * grid.h };
+	const float hi[3] = { (grid.Nx - 1.001f) * grid.h, (grid.Ny - 1.001f) * grid.h, (grid.Nz - 1.001f) * grid.h };
+	const float reach = cfl * grid.h;
+
+	const Particle_Kernels &kernels = particle_kernels();
+	int np = particles.currnp;
+	int nblocks = (np + G2P_BLOCK - 1) / G2P_BLOCK;
 
-			// Z - AXIS 
-			if (grid.marker(ui, vj, wk + 1) != SOLIDCELL) // Push backwards
+#pragma omp parallel for schedule(static)
+	for (int b = 0; b < nblocks; ++b)
+	{
+		int first = b * G2P_BLOCK, n = min(G2P_BLOCK, np - first);
+		float x[3][G2P_BLOCK], stage[3][G2P_BLOCK], k1[3][G2P_BLOCK], k2[3][G2P_BLOCK], k3[3][G2P_BLOCK];
+		int index[G2P_BLOCK], steps[G2P_BLOCK];
+
+		// The velocity at the start picks the steps, and is k1 of the first
+		kernels.velocity(grid, particles.pos[0] + first, particles.pos[1] + first, particles.pos[2] + first, n, k1[0], k1[1], k1[2]);
+		for (int q = 0; q < n; ++q)
+		{
+			float dist = sqrtf(sqr(k1[0][q]) + sqr(k1[1][q]) + sqr(k1[2][q])) * dt;
+			steps[q] = dist > reach ? min((int)ceilf(dist / reach), ADVECT_MAX_STEPS) : 1;
+		}
+
+		for (int step = 0;; ++step)
+		{
+			int m = 0;
+			for (int q = 0; q < n; ++q)
 			{
-				movevec[2] += 1.0;
+				if (step >= steps[q])
+					continue;
+
+				index[m] = q;
+				for (int c = 0; c < 3; ++c)
+					x[c][m] = particles.pos[c][first + q];
+				++m;
 			}
-			else if (grid.marker(ui, vj, wk - 1) != SOLIDCELL) // Push forward
+			if (m == 0)
+				break;
+
+			if (step > 0)
+				kernels.velocity(grid, x[0], x[1], x[2], m, k1[0], k1[1], k1[2]);
+
+			// k2 at the midpoint, and for RK3 (Ralston) k3 at three quarters of the step
+			for (int c = 0; c < 3; ++c)
+				for (int r = 0; r < m; ++r)
+				{
+					stage[c][r] = x[c][r] + 0.5f * (dt / steps[index[r]]) * k1[c][r];
+					clamp(stage[c][r], lo[c], hi[c]);
+				}
+			kernels.velocity(grid, stage[0], stage[1], stage[2], m, k2[0], k2[1], k2[2]);
+
+			if (order == ADVECT_RK3)
 			{
-				movevec[2] += 1.0;
+				for (int c = 0; c < 3; ++c)
+					for (int r = 0; r < m; ++r)
+					{
+						stage[c][r] = x[c][r] + 0.75f * (dt / steps[index[r]]) * k2[c][r];
+						clamp(stage[c][r], lo[c], hi[c]);
+					}
+				kernels.velocity(grid, stage[0], stage[1], stage[2], m, k3[0], k3[1], k3[2]);
 			}
-			else
+
+			for (int r = 0; r < m; ++r)
 			{
-				moveZ = false;
+				float hstep = dt / steps[index[r]];
+				vec3f vel;
+				for (int c = 0; c < 3; ++c)
+				{
+					if (order == ADVECT_RK3)
+						vel[c] = (2.0f / 9.0f) * k1[c][r] + (3.0f / 9.0f) * k2[c][r] + (4.0f / 9.0f) * k3[c][r];
+					else
+						vel[c] = k2[c][r];
+				}
+				move_particle(particles, grid, first + index[r], vel, hstep);
 			}
-
-		}
-
-		//if surrounded by solid
-		if (!moveZ && !moveY && !moveX)
-		{
-			newpos = particles.pos[p];
 		}
-		else
-		{
-			newpos += movevec * grid.h * scale;
-		}
-
-		particles.pos[p] = newpos;
 	}
 }
 
 void update_from_grid(Particles &particles, Grid &grid)
 {
-	int i, ui, j, vj, k, wk;
-	float fx, ufx, fy, vfy, fz, wfz;
+	const Particle_Kernels &kernels = particle_kernels();
+	int np = particles.currnp;
+	int nblocks = (np + G2P_BLOCK - 1) / G2P_BLOCK;
 
-	for (size_t p = 0; p < particles.pos.size(); ++p) //Loop over all particles
+#pragma omp parallel for schedule(static)
+	for (int b = 0; b < nblocks; ++b) //Loop over all particles, one block at a time
 	{
-		grid.bary_x(particles.pos[p][0], ui, ufx);
-		grid.bary_x_centre(particles.pos[p][0], i, fx);
-
-		grid.bary_y(particles.pos[p][1], vj, vfy);
-		grid.bary_y_centre(particles.pos[p][1], j, fy);
-
-		grid.bary_z(particles.pos[p][2], wk, wfz);
-		grid.bary_z_centre(particles.pos[p][2], k, fz);
+		int first = b * G2P_BLOCK, n = min(G2P_BLOCK, np - first);
 
 		// PIC
 		//particles.vel[p] = vec3f(grid.u.trilerp(ui, j, k, ufx, fy, fz), grid.v.trilerp(i, vj, k, fx, vfy, fz), grid.w.trilerp(i, j, wk, fx, fy, wfz)); 
@@ -157,8 +301,8 @@ void update_from_grid(Particles &particles, Grid &grid)
 
 		// PIC/FLIP
 		float alpha = 0.05f;
-		particles.vel[p] = alpha * vec3f(grid.u.trilerp(ui, j, k, ufx, fy, fz), grid.v.trilerp(i, vj, k, fx, vfy, fz), grid.w.trilerp(i, j, wk, fx, fy, wfz))
-			+ (1.0f - alpha) * (particles.vel[p] + vec3f(grid.du.trilerp(ui, j, k, ufx, fy, fz), grid.dv.trilerp(i, vj, k, fx, vfy, fz), grid.dw.trilerp(i, j, wk, fx, fy, wfz)));
+		kernels.pic_flip(grid, alpha, particles.pos[0] + first, particles.pos[1] + first, particles.pos[2] + first, n,
+			particles.vel[0] + first, particles.vel[1] + first, particles.vel[2] + first);
 	}
 }
 
@@ -199,82 +343,332 @@ void accumulate(Array3f &macvel, Array3f &sum, float &pvel, int i, int j, int k,
 	sum(i + 1, j + 1, k + 1) += weight;
 }
 
-void transfer_to_grid(Particles &particles, Grid &grid)
+//----------------------------------------------------------------------------//
+// Key of the cell of particle p: the P2G bin of the cell times P2G_BIN_CELLS 
+// plus the Morton index of the cell within the bin. Bins are numbered 
+// linearly, like the bricks of the Array3 brick layout.
+//----------------------------------------------------------------------------//
+static inline int cell_key(const Particles &particles, const Grid &grid, int p, int nbx, int nby)
+{
+	int i, j, k;
+	float fx, fy, fz;
+	grid.bary_x(particles.pos[0][p], i, fx);
+	grid.bary_y(particles.pos[1][p], j, fy);
+	grid.bary_z(particles.pos[2][p], k, fz);
+	clamp(i, 0, grid.Nx - 1);
+	clamp(j, 0, grid.Ny - 1);
+	clamp(k, 0, grid.Nz - 1);
+
+	int cell = 0;
+	for (int b = 0; (1 << b) < P2G_BLOCK; ++b)
+		cell |= (((i >> b) & 1) << (3 * b)) | (((j >> b) & 1) << (3 * b + 1)) | (((k >> b) & 1) << (3 * b + 2));
+
+	return (i / P2G_BLOCK + nbx * (j / P2G_BLOCK + nby * (k / P2G_BLOCK))) * P2G_BIN_CELLS + cell;
+}
+
+//----------------------------------------------------------------------------//
+// Sorts the particle indices into bins of P2G_BLOCK^3 cells with a counting
+// sort. The sort is stable, so each bin lists its particles in index order.
+//----------------------------------------------------------------------------//
+void bin_particles(Particles &particles, Grid &grid)
+{
+	int nbx = (grid.Nx + P2G_BLOCK - 1) / P2G_BLOCK;
+	int nby = (grid.Ny + P2G_BLOCK - 1) / P2G_BLOCK;
+	int nbz = (grid.Nz + P2G_BLOCK - 1) / P2G_BLOCK;
+	int nbins = nbx * nby * nbz;
+	int np = particles.currnp;
+
+	particles.bin_start.assign(nbins + 1, 0);
+	particles.bin_index.resize(np);
+	particles.bin_of.resize(np);
+
+#pragma omp parallel for schedule(static)
+	for (int p = 0; p < np; ++p)
+		particles.bin_of[p] = cell_key(particles, grid, p, nbx, nby) / P2G_BIN_CELLS;
+
+	for (int p = 0; p < np; ++p)
+		++particles.bin_start[particles.bin_of[p] + 1];
+
+	for (int b = 0; b < nbins; ++b)
+		particles.bin_start[b + 1] += particles.bin_start[b];
+
+	std::vector<int> next(particles.bin_start.begin(), particles.bin_start.end() - 1);
+	for (int p = 0; p < np; ++p)
+		particles.bin_index[next[particles.bin_of[p]]++] = p;
+}
+
+//----------------------------------------------------------------------------//
+// Reorders the particles by cell_key, so that the particles of a cell, and of
+// the cells close to it in Morton order, are next to each other in memory. 
+// Stable, so the result does not depend on the number of threads. Two 
+// counting sorts: the particles are first distributed to the P2G bins, each
+// thread counting and scattering its own contiguous share of the particles,
+// and then every bin is sorted by cell in parallel over the bins. The bins 
+// are left set for the P2G, with bin_index as the identity.
+//----------------------------------------------------------------------------//
+void sort_particles(Particles &particles, Grid &grid)
 {
-	int ui, vj, wk, i, j, k;
-	float fx, ufx, fy, vfy, fz, wfz;
-	int tmpi, tmpj, tmpk;
+	int nbx = (grid.Nx + P2G_BLOCK - 1) / P2G_BLOCK;
+	int nby = (grid.Ny + P2G_BLOCK - 1) / P2G_BLOCK;
+	int nbz = (grid.Nz + P2G_BLOCK - 1) / P2G_BLOCK;
+	int nbins = nbx * nby * nbz;
+	int np = particles.currnp;
+	int nchunks = max_threads();
+	int chunk = (np + nchunks - 1) / nchunks;
+
+	std::vector<int> &key = particles.bin_of;
+	std::vector<int> by_bin(np);
+	std::vector<int> counts((size_t)nchunks * nbins, 0); // counts[t * nbins + b]
+
+	key.resize(np);
+	particles.bin_index.resize(np);
+	particles.bin_start.resize(nbins + 1);
+
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < nchunks; ++t)
+	{
+		int *count = &counts[(size_t)t * nbins];
+		for (int p = t * chunk; p < min(np, (t + 1) * chunk); ++p)
+		{
+			key[p] = cell_key(particles, grid, p, nbx, nby);
+			++count[key[p] / P2G_BIN_CELLS];
+		}
+	}
 
-	particles.weightsumx.zero();
-	particles.weightsumy.zero();
-	particles.weightsumz.zero();
+	// First index of every bin, and of every chunk within the bin
+	int sum = 0;
+	for (int b = 0; b < nbins; ++b)
+	{
+		particles.bin_start[b] = sum;
+		for (int t = 0; t < nchunks; ++t)
+		{
+			int n = counts[(size_t)t * nbins + b];
+			counts[(size_t)t * nbins + b] = sum;
+			sum += n;
+		}
+	}
+	particles.bin_start[nbins] = sum;
 
-	std::vector< int > removeIndices;
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < nchunks; ++t)
+	{
+		int *next = &counts[(size_t)t * nbins];
+		for (int p = t * chunk; p < min(np, (t + 1) * chunk); ++p)
+			by_bin[next[key[p] / P2G_BIN_CELLS]++] = p;
+	}
 
-	for (size_t p = 0; p < particles.pos.size(); ++p) //Loop over all particles
+	// Sort every bin by cell, order[n] is the particle that goes to position n
+	std::vector<int> &order = particles.bin_index;
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int b = 0; b < nbins; ++b)
 	{
-		grid.bary_x(particles.pos[p][0], ui, ufx); tmpi = ui;
-		grid.bary_y(particles.pos[p][1], vj, vfy); tmpj = vj;
-		grid.bary_z(particles.pos[p][2], wk, wfz); tmpk = wk;
+		int next[P2G_BIN_CELLS] = { 0 };
+
+		for (int n = particles.bin_start[b]; n < particles.bin_start[b + 1]; ++n)
+			++next[key[by_bin[n]] % P2G_BIN_CELLS];
 
-		if (grid.marker(ui, vj, wk) == SOLIDCELL)
+		int first = particles.bin_start[b];
+		for (int c = 0; c < P2G_BIN_CELLS; ++c)
 		{
-			removeIndices.push_back(p);
-			continue;
+			int n = next[c];
+			next[c] = first;
+			first += n;
 		}
-		else
-			grid.marker(ui, vj, wk) = FLUIDCELL;
 
+		for (int n = particles.bin_start[b]; n < particles.bin_start[b + 1]; ++n)
+			order[next[key[by_bin[n]] % P2G_BIN_CELLS]++] = by_bin[n];
+	}
+
+	float *arrays[6] = { particles.pos[0], particles.pos[1], particles.pos[2], particles.vel[0], particles.vel[1], particles.vel[2] };
+	for (int a = 0; a < 6; ++a)
+	{
+		float *src = arrays[a], *dst = particles.scratch;
+#pragma omp parallel for schedule(static)
+		for (int n = 0; n < np; ++n)
+			dst[n] = src[order[n]];
+
+		// The sorted copy becomes the array, the old array the next scratch
+		arrays[a] = dst;
+		particles.scratch = src;
+	}
+	for (int c = 0; c < 3; ++c)
+	{
+		particles.pos[c] = arrays[c];
+		particles.vel[c] = arrays[3 + c];
+	}
+
+#pragma omp parallel for schedule(static)
+	for (int n = 0; n < np; ++n)
+		order[n] = n;
+}
 
-		grid.bary_y_centre(particles.pos[p][1], j, fy);
-		grid.bary_z_centre(particles.pos[p][2], k, fz);
-		accumulate(grid.u, particles.weightsumx, particles.vel[p][0], ui, j, k, ufx, fy, fz);
+//----------------------------------------------------------------------------//
+// Splats one particle onto the 8 nodes around it in each of u, v and w, with
+// one stencil for all three. Returns false if the particle is inside a solid cell and should be removed.
+//----------------------------------------------------------------------------//
+static bool splat_particle(Particles &particles, Grid &grid, int p)
+{
+	Stencil s;
+	grid.stencil(particles.pos[0][p], particles.pos[1][p], particles.pos[2][p], s);
 
+	if (grid.marker(s.ui, s.vj, s.wk) == SOLIDCELL)
+		return false;
+	else
+		grid.marker(s.ui, s.vj, s.wk) = FLUIDCELL;
+	++particles.cell_count[s.ui + grid.Nx * (s.vj + grid.Ny * s.wk)];
 
-		grid.bary_x_centre(particles.pos[p][0], i, fx);
-		grid.bary_z_centre(particles.pos[p][2], k, fz);
-		accumulate(grid.v, particles.weightsumy, particles.vel[p][1], i, vj, k, fx, vfy, fz);
+	accumulate(grid.u, particles.weightsumx, particles.vel[0][p], s.ui, s.j, s.k, s.ufx, s.fy, s.fz);
+	accumulate(grid.v, particles.weightsumy, particles.vel[1][p], s.i, s.vj, s.k, s.fx, s.vfy, s.fz);
+	accumulate(grid.w, particles.weightsumz, particles.vel[2][p], s.i, s.j, s.wk, s.fx, s.fy, s.wfz);
 
+	return true;
+}
 
-		grid.bary_x_centre(particles.pos[p][0], i, fx);
-		grid.bary_y_centre(particles.pos[p][1], j, fy);
-		accumulate(grid.w, particles.weightsumz, particles.vel[p][2], i, j, wk, fx, fy, wfz);
+// vel /= weightsum where vel is not 0, shared out over the threads of the enclosing parallel region
+static void normalize_velocity(Array3f &vel, const Array3f &weightsum)
+{
+#pragma omp for schedule(static) nowait
+	for (int i = 0; i < vel.size; i++)
+	{
+		float a = vel.data[i];
+		vel.data[i] = a != 0 ? a / weightsum.data[i] : a;
 	}
+}
 
-	for (size_t j = 0; j < removeIndices.size(); ++j)
+//----------------------------------------------------------------------------//
+// Particle to grid transfer. A particle in a bin only touches grid nodes
+// within one cell of the bin, so bins two apart along every axis never write
+// to the same node. The bins are processed in 8 colors by their parity and
+// all bins of one color run in parallel. Every node thus sums its
+// contributions in the same order for any number of threads. The cells, and
+// so their particle counts, also belong to a single bin. The particles must be
+// binned by bin_particles or sort_particles first.
+//----------------------------------------------------------------------------//
+void transfer_to_grid(Particles &particles, Grid &grid)
+{
+	parallel_zero(particles.weightsumx.data, particles.weightsumx.size * sizeof(float));
+	parallel_zero(particles.weightsumy.data, particles.weightsumy.size * sizeof(float));
+	parallel_zero(particles.weightsumz.data, particles.weightsumz.size * sizeof(float));
+	particles.cell_count.assign((size_t)grid.Nx * grid.Ny * grid.Nz, 0);
+
+	int nbx = (grid.Nx + P2G_BLOCK - 1) / P2G_BLOCK;
+	int nby = (grid.Ny + P2G_BLOCK - 1) / P2G_BLOCK;
+	int nbz = (grid.Nz + P2G_BLOCK - 1) / P2G_BLOCK;
+
+	int np = particles.currnp;
+	std::vector<char> inside_solid(np, 0);
+
+	for (int color = 0; color < 8; ++color)
 	{
-		particles.remove(removeIndices[j]);
+		int cx = color & 1, cy = (color >> 1) & 1, cz = color >> 2;
+		int nx = (nbx - cx + 1) / 2, ny = (nby - cy + 1) / 2, nz = (nbz - cz + 1) / 2;
+		int nbins = nx * ny * nz;
+
+#pragma omp parallel for schedule(dynamic, 4)
+		for (int b = 0; b < nbins; ++b)
+		{
+			int bx = cx + 2 * (b % nx);
+			int by = cy + 2 * ((b / nx) % ny);
+			int bz = cz + 2 * (b / (nx * ny));
+			int bin = bx + nbx * (by + nby * bz);
+
+			for (int n = particles.bin_start[bin]; n < particles.bin_start[bin + 1]; ++n)
+			{
+				int p = particles.bin_index[n];
+				inside_solid[p] = !splat_particle(particles, grid, p);
+			}
+		}
 	}
 
-	//Scale u velocities with weightsumx
+	compact_particles(particles, inside_solid);
 
-	for (int i = 0; i < grid.u.size; i++)
+	//Scale the velocities with their weightsums, in one parallel region
+#pragma omp parallel
 	{
-		if (grid.u.data[i] != 0)
-			grid.u.data[i] /= particles.weightsumx.data[i];
+		normalize_velocity(grid.u, particles.weightsumx);
+		normalize_velocity(grid.v, particles.weightsumy);
+		normalize_velocity(grid.w, particles.weightsumz);
 	}
+}
 
-	//Scale v velocities with weightsumy
-	for (int i = 0; i < grid.v.size; i++)
+//----------------------------------------------------------------------------//
+// Removes the particles p with remove[p] set, keeping the order of the others.
+// Every thread copies the kept particles of its chunk to their final index in
+// scratch, which then replaces the array as in sort_particles. Returns the
+// number of particles removed.
+//----------------------------------------------------------------------------//
+int compact_particles(Particles &particles, const std::vector<char> &remove)
+{
+	int np = particles.currnp;
+	int nchunks = max_threads();
+	int chunk = (np + nchunks - 1) / nchunks;
+	std::vector<int> start(nchunks + 1, 0); // First kept index of every chunk
+
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < nchunks; ++t)
 	{
-		if (grid.v.data[i] != 0)
-			grid.v.data[i] /= particles.weightsumy.data[i];
+		int n = 0;
+		for (int p = t * chunk; p < min(np, (t + 1) * chunk); ++p)
+			n += !remove[p];
+		start[t + 1] = n;
 	}
+	for (int t = 0; t < nchunks; ++t)
+		start[t + 1] += start[t];
+
+	int kept = start[nchunks];
+	if (kept == np)
+		return 0;
+
+	float *arrays[6] = { particles.pos[0], particles.pos[1], particles.pos[2], particles.vel[0], particles.vel[1], particles.vel[2] };
+	for (int a = 0; a < 6; ++a)
+	{
+		float *src = arrays[a], *dst = particles.scratch;
+#pragma omp parallel for schedule(static)
+		for (int t = 0; t < nchunks; ++t)
+		{
+			int n = start[t];
+			for (int p = t * chunk; p < min(np, (t + 1) * chunk); ++p)
+			{
+				if (!remove[p])
+					dst[n++] = src[p];
+			}
+		}
 
-	//Scale w velocities with weightsumz
-	for (int i = 0; i < grid.w.size; i++)
+		arrays[a] = dst;
+		particles.scratch = src;
+	}
+	for (int c = 0; c < 3; ++c)
 	{
-		if (grid.w.data[i] != 0)
-			grid.w.data[i] /= particles.weightsumz.data[i];
+		particles.pos[c] = arrays[c];
+		particles.vel[c] = arrays[3 + c];
 	}
+
+	particles.currnp = kept;
+	return np - kept;
 }
 
 //----------------------------------------------------------------------------//
-// Adds a particle to the particles struct
+// Makes room for n particles after the last one, for callers that fill them 
+// in parallel. n is cut to the room left below maxnp. Returns the index of the
+// first new particle.
+//----------------------------------------------------------------------------//
+int reserve_particles(Particles &particles, int &n)
+{
+	int first = particles.currnp;
+	n = max(0, min(n, particles.maxnp - first));
+	particles.currnp += n;
+	return first;
+}
+
+//----------------------------------------------------------------------------//
+// Adds a particle to the particles struct, unless maxnp is already reached
 //----------------------------------------------------------------------------//
 void add_particle(Particles &particles, vec3f &pos, const vec3f &vel)
 {
-	particles.pos.push_back(pos);
-	particles.vel.push_back(vel);
+	if (particles.currnp >= particles.maxnp)
+		return;
+
+	particles.set_position(particles.currnp, pos);
+	particles.set_velocity(particles.currnp, vel);
 	++particles.currnp;
 }
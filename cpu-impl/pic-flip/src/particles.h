@@ -6,28 +6,71 @@
 
 #include "vector3.h"
 #include "grid.h"
-#include "array3D.h"
+#include "array3d.h"
 
+// Side length, in cells, of the particle bins used by the parallel P2G, a power of two
+#define P2G_BLOCK 4
+#define P2G_BIN_CELLS (P2G_BLOCK * P2G_BLOCK * P2G_BLOCK)
+
+// Particles per call of the G2P kernels
+#define G2P_BLOCK 256
+
+// Particle advection schemes
+#define ADVECT_EULER 0 // Five forward Euler steps of dt / 5, move_particles_in_grid
+#define ADVECT_RK2 1 // Midpoint steps, with a step count per particle from its CFL number
+#define ADVECT_RK3 2 // Ralston's third order steps, likewise
+#define ADVECT_MAX_STEPS 8 // Most steps a particle takes in advect_particles
+#define ADVECT_CFL 1.0f // Default cells a particle may move per step in advect_particles
+
+//----------------------------------------------------------------------------//
+// Particles stored as a structure of arrays: pos[c][p] is component c of the 
+// position of particle p. Every array holds maxnp floats and is aligned to 
+// SIMD_ALIGNMENT, so the G2P kernels load the particles of a block directly.
+//----------------------------------------------------------------------------//
 struct Particles
 {
 	// maximum nr of particles and the number of particles in use
 	int maxnp, currnp;
 
-	std::vector<vec3f> vel, pos;
+	float *pos[3], *vel[3];
+	float *scratch; // maxnp floats, used by sort_particles
 	Array3f weightsumx, weightsumy, weightsumz;
 
+	// Particle indices sorted by P2G bin, bin b holds bin_index[bin_start[b] .. bin_start[b + 1])
+	std::vector<int> bin_start, bin_index;
+	std::vector<int> bin_of; // Scratch, one entry per particle
+
+	// Particles in every cell, in the linear cell index, counted by transfer_to_grid
+	std::vector<int> cell_count;
+
 	Particles();
 	Particles(int maxParticles, Grid &grid);
+	~Particles();
 	void init(int maxParticles, Grid &grid);
+	void delete_memory();
 
 	void clear();
 	void remove(int i);
+
+	vec3f position(int p) const { return vec3f(pos[0][p], pos[1][p], pos[2][p]); }
+	vec3f velocity(int p) const { return vec3f(vel[0][p], vel[1][p], vel[2][p]); }
+	void set_position(int p, vec3f x) { pos[0][p] = x[0]; pos[1][p] = x[1]; pos[2][p] = x[2]; }
+	void set_velocity(int p, vec3f v) { vel[0][p] = v[0]; vel[1][p] = v[1]; vel[2][p] = v[2]; }
+
+	// Interleaved copies of all particles, for file output and the viewer
+	void copy_positions(vec3f *out) const;
+	void copy_velocities(vec3f *out) const;
 };
 
 void move_particles_in_grid(Particles &particles, Grid &grid, float dt);
+void advect_particles(Particles &particles, Grid &grid, float dt, int order, float cfl);
 void update_from_grid(Particles &particles, Grid &grid);
 void accumulate(Array3f &macvel, Array3f &sum, float &pvel, int i, int j, int k, float fx, float fy, float fz);
+void bin_particles(Particles &particles, Grid &grid);
+void sort_particles(Particles &particles, Grid &grid);
 void transfer_to_grid(Particles &particles, Grid &grid);
 void add_particle(Particles &particles, vec3f &pos, const vec3f &vel);
+int reserve_particles(Particles &particles, int &n);
+int compact_particles(Particles &particles, const std::vector<char> &remove);
 
 #endif
@@ -0,0 +1,120 @@
+#include "reseed.h"
+#include "particle_kernels.h"
+#include "parallel.h"
+
+// Linear index of the cell of particle p, as marked by transfer_to_grid
+static inline int particle_cell(const Particles &particles, const Grid &grid, int p)
+{
+	int i = (int)(particles.pos[0][p] * grid.overh);
+	int j = (int)(particles.pos[1][p] * grid.overh);
+	int k = (int)(particles.pos[2][p] * grid.overh);
+	return i + grid.Nx * (j + grid.Ny * k);
+}
+
+//----------------------------------------------------------------------------//
+// Deletes the surplus of the cells above max_count with a stable compaction.
+// The count of such a cell is first set to minus its surplus, and counts back
+// up to 0 as its first particles are deleted.
+//----------------------------------------------------------------------------//
+static int thin_particles(const Reseeding &reseed, Particles &particles, const Grid &grid)
+{
+	std::vector<int> &count = particles.cell_count;
+	bool surplus = false;
+	for (size_t c = 0; c < count.size(); ++c)
+	{
+		if (count[c] > reseed.max_count)
+		{
+			count[c] = reseed.target - count[c];
+			surplus = true;
+		}
+	}
+	if (!surplus)
+		return 0;
+
+	int np = particles.currnp, kept = 0;
+	for (int p = 0; p < np; ++p)
+	{
+		int &n = count[particle_cell(particles, grid, p)];
+		if (n < 0)
+		{
+			if (++n == 0)
+				n = reseed.target;
+			continue;
+		}
+
+		for (int c = 0; c < 3; ++c)
+		{
+			particles.pos[c][kept] = particles.pos[c][p];
+			particles.vel[c][kept] = particles.vel[c][p];
+		}
+		++kept;
+	}
+	particles.currnp = kept;
+
+	return np - kept;
+}
+
+// Every face neighbour of cell c is solid or holds at least n particles
+static inline bool enclosed(const Grid &grid, const std::vector<int> &count, int c, int n)
+{
+	const int step[3] = { 1, grid.Nx, grid.Nx * grid.Ny };
+	for (int a = 0; a < 3; ++a)
+	{
+		int lo = c - step[a], hi = c + step[a];
+		if ((count[lo] < n && grid.marker.data[lo] != SOLIDCELL) || (count[hi] < n && grid.marker.data[hi] != SOLIDCELL))
+			return false;
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------//
+// Seeds the starved cells in a fixed cell order from rng, so the result does
+// not depend on the number of threads. The counts are not updated, so a 
+// seeded cell does not let its neighbours qualify in the same pass. The fluid
+// cells without particles are the interior of the narrow band, and are left
+// alone.
+//----------------------------------------------------------------------------//
+static int seed_particles(const Reseeding &reseed, Particles &particles, const Grid &grid, Random &rng)
+{
+	std::vector<int> &count = particles.cell_count;
+	const float h = grid.h;
+	int first = particles.currnp;
+
+	for (int k = 1; k < grid.Nz - 1; ++k)
+		for (int j = 1; j < grid.Ny - 1; ++j)
+			for (int i = 1; i < grid.Nx - 1; ++i)
+			{
+				int c = i + grid.Nx * (j + grid.Ny * k);
+				char m = grid.marker(i, j, k);
+				if (count[c] >= reseed.min_count || m == SOLIDCELL || (m == FLUIDCELL && count[c] == 0) || !enclosed(grid, count, c, reseed.min_count))
+					continue;
+
+				for (int n = count[c]; n < reseed.target && particles.currnp < particles.maxnp; ++n)
+				{
+					vec3f pos((i + rng.uniform()) * h, (j + rng.uniform()) * h, (k + rng.uniform()) * h);
+					add_particle(particles, pos, vec3f(0.0f));
+				}
+			}
+
+	// The new particles take the grid velocity
+	const Particle_Kernels &kernels = particle_kernels();
+	int np = particles.currnp - first;
+	int nblocks = (np + G2P_BLOCK - 1) / G2P_BLOCK;
+
+#pragma omp parallel for schedule(static)
+	for (int b = 0; b < nblocks; ++b)
+	{
+		int p = first + b * G2P_BLOCK, n = min(G2P_BLOCK, first + np - p);
+		kernels.velocity(grid, particles.pos[0] + p, particles.pos[1] + p, particles.pos[2] + p, n,
+			particles.vel[0] + p, particles.vel[1] + p, particles.vel[2] + p);
+	}
+
+	return np;
+}
+
+int reseed_particles(const Reseeding &reseed, Particles &particles, const Grid &grid, Random &rng, int &added)
+{
+	int removed = reseed.max_count > 0 ? thin_particles(reseed, particles, grid) : 0;
+	added = reseed.min_count > 0 ? seed_particles(reseed, particles, grid, rng) : 0;
+	return removed;
+}
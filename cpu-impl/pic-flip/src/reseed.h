@@ -0,0 +1,35 @@
+#pragma once
+#ifndef RESEED_H_
+#define RESEED_H_
+
+#include "grid.h"
+#include "particles.h"
+#include "util.h"
+
+#define RESEED_TARGET 8 // The 2x2x2 particles per cell of init_box
+
+//----------------------------------------------------------------------------//
+// Keeps the particles per cell near a target, from the counts of the last
+// transfer_to_grid. Cells with more than max_count particles are thinned to
+// target. Liquid cells with fewer than min_count particles are seeded up to
+// target, with the grid velocity at the new particles. A cell is only seeded
+// when its 6 neighbours are solid or hold min_count particles, so sparse 
+// splashes and the surface are not filled up, and the empty cells seeded are
+// voids inside the liquid.
+//----------------------------------------------------------------------------//
+struct Reseeding
+{
+	int min_count; // 0 seeds no particles
+	int target;
+	int max_count; // 0 deletes no particles
+
+	Reseeding() : min_count(0), target(RESEED_TARGET), max_count(0) {}
+
+	bool enabled() const { return min_count > 0 || max_count > 0; }
+};
+
+// Runs after update_from_grid, while the particles are still in the cells they
+// were counted in. Returns the particles removed, added is set to the seeded.
+int reseed_particles(const Reseeding &reseed, Particles &particles, const Grid &grid, Random &rng, int &added);
+
+#endif
@@ -0,0 +1,125 @@
+#include "simd.h"
+
+#include <cstdlib>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <malloc.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#endif
+
+static int active_level = -1;
+
+#ifdef SIMD_X86
+static void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	for (int i = 0; i < 4; ++i)
+		regs[i] = (unsigned int)r[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// The register state the OS saves on context switches, XCR0
+static unsigned long long xgetbv0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#endif
+
+int simd_detect()
+{
+	int level = SIMD_SCALAR;
+
+#ifdef SIMD_X86
+	unsigned int regs[4];
+	cpuid(0, 0, regs);
+	if (regs[0] < 7)
+		return level;
+
+	cpuid(1, 0, regs);
+	bool osxsave = (regs[2] >> 27) & 1;
+	if (!osxsave)
+		return level;
+
+	unsigned long long xcr0 = xgetbv0();
+	bool ymm = (xcr0 & 0x6) == 0x6; // SSE and AVX state
+	bool zmm = (xcr0 & 0xe6) == 0xe6; // and the opmask and upper zmm state
+
+	cpuid(7, 0, regs);
+	bool avx2 = (regs[1] >> 5) & 1;
+	bool avx512f = (regs[1] >> 16) & 1;
+
+#ifdef PICFLIP_SIMD_AVX2
+	if (avx2 && ymm)
+		level = SIMD_AVX2;
+#endif
+#ifdef PICFLIP_SIMD_AVX512
+	if (avx512f && zmm)
+		level = SIMD_AVX512;
+#endif
+	(void)avx2; (void)avx512f; (void)ymm; (void)zmm;
+#endif
+
+	return level;
+}
+
+int simd_level()
+{
+	if (active_level < 0)
+		active_level = simd_detect();
+	return active_level;
+}
+
+bool simd_set_level(int level)
+{
+	if (level < SIMD_SCALAR || level > simd_detect())
+		return false;
+	active_level = level;
+	return true;
+}
+
+const char *simd_name(int level)
+{
+	switch (level)
+	{
+	case SIMD_AVX2: return "avx2";
+	case SIMD_AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+void *simd_alloc(size_t bytes)
+{
+#if defined(_MSC_VER)
+	return _aligned_malloc(bytes, SIMD_ALIGNMENT);
+#else
+	void *ptr = NULL;
+	if (posix_memalign(&ptr, SIMD_ALIGNMENT, bytes) != 0)
+		return NULL;
+	return ptr;
+#endif
+}
+
+void simd_free(void *ptr)
+{
+#if defined(_MSC_VER)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
@@ -0,0 +1,30 @@
+#pragma once
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <cstddef>
+
+// Instruction set levels of the runtime dispatched kernels
+#define SIMD_SCALAR 0
+#define SIMD_AVX2 1
+#define SIMD_AVX512 2
+
+#define SIMD_ALIGNMENT 64 // Cache line and AVX-512 register size
+
+// Best level supported by both the build and the cpu
+int simd_detect();
+
+// Level used by the kernels, defaults to simd_detect()
+int simd_level();
+
+// Forces a lower level, e.g. for comparisons. Returns false if the level is
+// not supported, the active level is then left unchanged.
+bool simd_set_level(int level);
+
+const char *simd_name(int level);
+
+// Allocation aligned to SIMD_ALIGNMENT, release with simd_free
+void *simd_alloc(size_t bytes);
+void simd_free(void *ptr);
+
+#endif
@@ -0,0 +1,433 @@
+//----------------------------------------------------------------------------//
+// Benchmarks of the solver kernels and of whole frames. Every grid size runs
+// the init_box dam break from a fixed seed for a number of warm up frames,
+// and the kernels are then timed on the state of the last step: the Poisson
+// system, preconditioner and fluid cells of its pressure solve and the
+// particles after it. Kernels that change the state get it restored before
+// every repetition, outside of the timing. Results are printed as a table and
+// can be written as CSV and JSON.
+//----------------------------------------------------------------------------//
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "fluid_solver.h"
+#include "parallel.h"
+#include "simd.h"
+
+struct BenchSize
+{
+	int dimx, dimy, dimz;
+};
+
+struct BenchOptions
+{
+	std::vector<BenchSize> sizes;
+	float gridh = 0.1f;
+	int maxparticles = 30000 * 8;
+	int warmup = 10; // Frames simulated before the kernels are timed
+	int reps = 20; // Repetitions of every kernel
+	int frame_reps = 5; // Frames timed per grid size
+	int threads = 0;
+	int simd = -1;
+	unsigned int seed = 1;
+	std::string filter; // Only run the benchmarks whose name contains this
+	std::string csv, json;
+};
+
+struct BenchResult
+{
+	std::string name;
+	BenchSize size;
+	int particles, fluid_cells;
+	int reps;
+	double min_ms, median_ms, mean_ms;
+	double items; // Cells or particles processed per repetition
+};
+
+// Results of kernels the compiler must not drop
+static volatile double bench_sink;
+
+//----------------------------------------------------------------------------//
+// Times run reps times, calling the untimed setup before every repetition
+//----------------------------------------------------------------------------//
+static BenchResult time_kernel(const std::string &name, int reps, double items,
+	const std::function<void()> &setup, const std::function<void()> &run)
+{
+	typedef std::chrono::steady_clock clock;
+	std::vector<double> ms(reps);
+
+	for (int r = 0; r < reps; ++r)
+	{
+		if (setup)
+			setup();
+		clock::time_point t0 = clock::now();
+		run();
+		ms[r] = std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+	}
+
+	BenchResult res;
+	res.name = name;
+	res.reps = reps;
+	res.items = items;
+	std::sort(ms.begin(), ms.end());
+	res.min_ms = ms[0];
+	res.median_ms = reps % 2 ? ms[reps / 2] : 0.5 * (ms[reps / 2 - 1] + ms[reps / 2]);
+	res.mean_ms = 0.0;
+	for (int r = 0; r < reps; ++r)
+		res.mean_ms += ms[r] / reps;
+	return res;
+}
+
+//----------------------------------------------------------------------------//
+// Copy of the particle arrays, to undo the kernels that move the particles
+//----------------------------------------------------------------------------//
+struct ParticleState
+{
+	int np;
+	std::vector<float> pos[3], vel[3];
+
+	void save(const Particles &p)
+	{
+		np = p.currnp;
+		for (int c = 0; c < 3; ++c)
+		{
+			pos[c].assign(p.pos[c], p.pos[c] + np);
+			vel[c].assign(p.vel[c], p.vel[c] + np);
+		}
+	}
+
+	void restore(Particles &p) const
+	{
+		p.currnp = np;
+		for (int c = 0; c < 3; ++c)
+		{
+			std::copy(pos[c].begin(), pos[c].end(), p.pos[c]);
+			std::copy(vel[c].begin(), vel[c].end(), p.vel[c]);
+		}
+	}
+};
+
+static void run_size(const BenchOptions &opt, const BenchSize &size, std::vector<BenchResult> &results)
+{
+	const float timestep = 1.0f / 30.0f;
+	FluidSolver solver(size.dimx, size.dimy, size.dimz, opt.gridh, timestep, 9.82f, 1.0f, opt.maxparticles);
+	solver.seed = opt.seed;
+	solver.init_box();
+	for (int f = 0; f < opt.warmup; ++f)
+		solver.step_frame();
+
+	Grid &grid = solver.grid;
+	Particles &particles = solver.particles;
+	const Fluid_Cells &cells = grid.fluid_cells;
+	const Poisson_Operator &A = grid.poisson_op;
+	double ncells = cells.count, np = particles.currnp;
+
+	// Vectors with a deterministic pattern on the fluid cells
+	VectorN x(size.dimx, size.dimy, size.dimz), y(size.dimx, size.dimy, size.dimz), z(size.dimx, size.dimy, size.dimz), r(size.dimx, size.dimy, size.dimz);
+	for (int n = 0; n < x.size; ++n)
+	{
+		x.data[n] = 1.0 + 0.001 * (n % 97);
+		y.data[n] = 1.0 - 0.002 * (n % 89);
+	}
+
+	ParticleState state;
+	state.save(particles);
+	Array3f u0(grid.u.nx, grid.u.ny, grid.u.nz), v0(grid.v.nx, grid.v.ny, grid.v.nz), w0(grid.w.nx, grid.w.ny, grid.w.nz);
+	grid.u.copy_to(u0);
+	grid.v.copy_to(v0);
+	grid.w.copy_to(w0);
+	auto restore_grid = [&]()
+	{
+		u0.copy_to(grid.u);
+		v0.copy_to(grid.v);
+		w0.copy_to(grid.w);
+		grid.max_speed_valid = false;
+	};
+
+	size_t first = results.size();
+	std::function<void()> none;
+	auto add = [&](const std::string &name, int reps, double items, const std::function<void()> &setup, const std::function<void()> &run)
+	{
+		if (!opt.filter.empty() && name.find(opt.filter) == std::string::npos)
+			return;
+		results.push_back(time_kernel(name, reps, items, setup, run));
+	};
+
+	// Assembly of the pressure system and the projection
+	add("form_poisson", opt.reps, ncells, none, [&]() { grid.form_poisson(timestep); });
+	add("calc_divergence", opt.reps, ncells, none, [&]() { grid.calc_divergence(); });
+	add("project", opt.reps, ncells, restore_grid, [&]() { grid.project(timestep); });
+
+	// BLAS kernels of the CG iteration
+	add("mtx_mult_vectorN", opt.reps, ncells, none, [&]() { mtx_mult_vectorN(A, x, z, cells); });
+	add("mtx_mult_vectorN_dot", opt.reps, ncells, none, [&]() { bench_sink = mtx_mult_vectorN_dot(A, x, z, cells); });
+	add("vectorN_dot", opt.reps, ncells, none, [&]() { bench_sink = vectorN_dot(x, y, cells); });
+	add("vectorN_infnorm", opt.reps, ncells, none, [&]() { bench_sink = vectorN_infnorm(x, cells); });
+	add("vectorN_scale_add", opt.reps, ncells, none, [&]() { vectorN_scale_add(z, x, 0.5, cells); });
+	add("vectorN_update_xr", opt.reps, ncells, [&]() { vectorN_copy(r, y, cells); },
+		[&]() { bench_sink = vectorN_update_xr(z, x, r, y, 1e-3, cells, NULL); });
+
+	// Preconditioners
+	Uncondioned_CG_Solver &cg = grid.cg;
+	add("form_precond", opt.reps, ncells, [&]() { cg.precond_mode = PRECOND_MIC0; }, [&]() { grid.form_precond(); });
+	add("apply_precond_mic0", opt.reps, ncells, [&]() { cg.precond_mode = PRECOND_MIC0; },
+		[&]() { cg.apply_precond(A, grid.precond, x, z, cells); });
+	add("apply_precond_wavefront", opt.reps, ncells, [&]() { cg.precond_mode = PRECOND_MIC0_WAVEFRONT; },
+		[&]() { cg.apply_precond(A, grid.precond, x, z, cells); });
+	add("multigrid_setup", opt.reps, ncells, none, [&]() { cg.mg.setup(A, grid.marker, grid.fluid_cells, grid.poisson_scale); });
+	add("apply_precond_multigrid", opt.reps, ncells, [&]() { cg.precond_mode = PRECOND_MULTIGRID; cg.mg.setup(A, grid.marker, grid.fluid_cells, grid.poisson_scale); },
+		[&]() { cg.apply_precond(A, grid.precond, x, z, cells); });
+	add("solve_pressure", opt.reps, ncells, [&]() { cg.precond_mode = PRECOND_MIC0; },
+		[&]() { grid.solve_pressure(SOLVE_MAX_ITERATIONS, SOLVE_TOLERANCE, 0.0); });
+	cg.precond_mode = PRECOND_MIC0;
+
+	// Grid interpolation at the particle positions, and its transpose
+	add("trilerp", opt.reps, np, none, [&]()
+	{
+		double sum = 0.0;
+		for (int p = 0; p < particles.currnp; ++p)
+		{
+			int i, j, k;
+			float fx, fy, fz;
+			grid.bary_x(particles.pos[0][p], i, fx);
+			grid.bary_y_centre(particles.pos[1][p], j, fy);
+			grid.bary_z_centre(particles.pos[2][p], k, fz);
+			sum += grid.u.trilerp(i, j, k, fx, fy, fz);
+		}
+		bench_sink = sum;
+	});
+	add("accumulate", opt.reps, np, [&]() { grid.u.zero(); particles.weightsumx.zero(); }, [&]()
+	{
+		for (int p = 0; p < particles.currnp; ++p)
+		{
+			int i, j, k;
+			float fx, fy, fz;
+			grid.bary_x(particles.pos[0][p], i, fx);
+			grid.bary_y_centre(particles.pos[1][p], j, fy);
+			grid.bary_z_centre(particles.pos[2][p], k, fz);
+			accumulate(grid.u, particles.weightsumx, particles.vel[0][p], i, j, k, fx, fy, fz);
+		}
+	});
+
+	// Particle transfers and advection
+	add("bin_particles", opt.reps, np, [&]() { state.restore(particles); }, [&]() { bin_particles(particles, grid); });
+	add("sort_particles", opt.reps, np, [&]() { state.restore(particles); }, [&]() { sort_particles(particles, grid); });
+	add("transfer_to_grid", opt.reps, np, [&]()
+	{
+		state.restore(particles);
+		grid.zero();
+		grid.classify_voxel();
+		bin_particles(particles, grid);
+	}, [&]() { transfer_to_grid(particles, grid); });
+	add("update_from_grid", opt.reps, np, [&]()
+	{
+		state.restore(particles);
+		restore_grid();
+	}, [&]() { update_from_grid(particles, grid); });
+	add("move_particles_in_grid", opt.reps, np, [&]() { state.restore(particles); restore_grid(); },
+		[&]() { move_particles_in_grid(particles, grid, 0.2f * timestep); });
+	// Advection over one solver step, as FluidSolver::step_frame sizes it
+	float dt = min(timestep, grid.CFL());
+	add("advect_euler", opt.reps, np, [&]() { state.restore(particles); restore_grid(); },
+		[&]() { for (int i = 0; i < 5; i++) move_particles_in_grid(particles, grid, 0.2f * dt); });
+	add("advect_rk2", opt.reps, np, [&]() { state.restore(particles); restore_grid(); },
+		[&]() { advect_particles(particles, grid, dt, ADVECT_RK2, ADVECT_CFL); });
+	add("advect_rk3", opt.reps, np, [&]() { state.restore(particles); restore_grid(); },
+		[&]() { advect_particles(particles, grid, dt, ADVECT_RK3, ADVECT_CFL); });
+
+	// Element wise sweeps over the velocity grids
+	add("add_forces", opt.reps, grid.u.size, restore_grid, [&]() { grid.add_forces(timestep); });
+	add("get_velocity_update", opt.reps, grid.u.size, none, [&]() { grid.get_velocity_update(); });
+	add("cfl", opt.reps, grid.u.size, [&]() { grid.max_speed_valid = false; }, [&]() { bench_sink = grid.CFL(); });
+
+	// Whole frames, continuing the warm up
+	state.restore(particles);
+	restore_grid();
+	add("step_frame", opt.frame_reps, np, none, [&]() { solver.step_frame(); });
+
+	for (size_t r = first; r < results.size(); ++r)
+	{
+		results[r].size = size;
+		results[r].particles = (int)np;
+		results[r].fluid_cells = (int)ncells;
+	}
+}
+
+static bool write_csv(const std::string &path, const std::vector<BenchResult> &results)
+{
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+
+	fprintf(f, "name,dimx,dimy,dimz,particles,fluid_cells,reps,min_ms,median_ms,mean_ms,items_per_s\n");
+	for (size_t n = 0; n < results.size(); ++n)
+	{
+		const BenchResult &r = results[n];
+		fprintf(f, "%s,%d,%d,%d,%d,%d,%d,%.6f,%.6f,%.6f,%.6g\n", r.name.c_str(), r.size.dimx, r.size.dimy, r.size.dimz,
+			r.particles, r.fluid_cells, r.reps, r.min_ms, r.median_ms, r.mean_ms, r.min_ms > 0.0 ? 1e3 * r.items / r.min_ms : 0.0);
+	}
+	fclose(f);
+	return true;
+}
+
+static bool write_json(const std::string &path, const BenchOptions &opt, const std::vector<BenchResult> &results)
+{
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+
+	fprintf(f, "{\n  \"threads\": %d, \"simd\": \"%s\", \"seed\": %u, \"warmup_frames\": %d,\n  \"results\": [",
+		max_threads(), simd_name(simd_level()), opt.seed, opt.warmup);
+	for (size_t n = 0; n < results.size(); ++n)
+	{
+		const BenchResult &r = results[n];
+		fprintf(f, "%s\n    {\"name\": \"%s\", \"dims\": [%d, %d, %d], \"particles\": %d, \"fluid_cells\": %d, \"reps\": %d, "
+			"\"min_ms\": %.6f, \"median_ms\": %.6f, \"mean_ms\": %.6f, \"items_per_s\": %.6g}",
+			n ? "," : "", r.name.c_str(), r.size.dimx, r.size.dimy, r.size.dimz, r.particles, r.fluid_cells, r.reps,
+			r.min_ms, r.median_ms, r.mean_ms, r.min_ms > 0.0 ? 1e3 * r.items / r.min_ms : 0.0);
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	std::cout << "Usage: " << prog << " [options]\n"
+		<< "  --dims X Y Z       add a grid size (default 64 50 40, 100 78 64 and 128 100 80)\n"
+		<< "  --h H              grid cell size (default 0.1)\n"
+		<< "  --particles N      maximum number of particles (default 240000)\n"
+		<< "  --warmup N         frames simulated before timing (default 10)\n"
+		<< "  --reps N           repetitions of every kernel (default 20)\n"
+		<< "  --frame-reps N     frames timed per grid size (default 5)\n"
+		<< "  --threads N        number of solver threads (default: all cores)\n"
+		<< "  --simd S           scalar, avx2 or avx512 vector kernels (default: best supported)\n"
+		<< "  --seed S           seed of the dam break (default 1)\n"
+		<< "  --filter TEXT      only run the benchmarks whose name contains TEXT\n"
+		<< "  --csv FILE         write the results as CSV\n"
+		<< "  --json FILE        write the results as JSON\n";
+}
+
+static bool parse_args(int argc, char **argv, BenchOptions &opt)
+{
+	for (int a = 1; a < argc; ++a)
+	{
+		std::string arg = argv[a];
+		int left = argc - a - 1;
+
+		if (arg == "--dims" && left >= 3)
+		{
+			BenchSize s;
+			s.dimx = atoi(argv[++a]);
+			s.dimy = atoi(argv[++a]);
+			s.dimz = atoi(argv[++a]);
+			if (s.dimx < 3 || s.dimy < 3 || s.dimz < 3)
+				return false;
+			opt.sizes.push_back(s);
+		}
+		else if (arg == "--h" && left >= 1)
+			opt.gridh = (float)atof(argv[++a]);
+		else if (arg == "--particles" && left >= 1)
+			opt.maxparticles = atoi(argv[++a]);
+		else if (arg == "--warmup" && left >= 1)
+			opt.warmup = atoi(argv[++a]);
+		else if (arg == "--reps" && left >= 1)
+			opt.reps = atoi(argv[++a]);
+		else if (arg == "--frame-reps" && left >= 1)
+			opt.frame_reps = atoi(argv[++a]);
+		else if (arg == "--threads" && left >= 1)
+			opt.threads = atoi(argv[++a]);
+		else if (arg == "--simd" && left >= 1)
+		{
+			std::string level = argv[++a];
+			if (level == "scalar")
+				opt.simd = SIMD_SCALAR;
+			else if (level == "avx2")
+				opt.simd = SIMD_AVX2;
+			else if (level == "avx512")
+				opt.simd = SIMD_AVX512;
+			else
+				return false;
+		}
+		else if (arg == "--seed" && left >= 1)
+			opt.seed = (unsigned int)strtoul(argv[++a], NULL, 10);
+		else if (arg == "--filter" && left >= 1)
+			opt.filter = argv[++a];
+		else if (arg == "--csv" && left >= 1)
+			opt.csv = argv[++a];
+		else if (arg == "--json" && left >= 1)
+			opt.json = argv[++a];
+		else
+			return false;
+	}
+
+	if (opt.sizes.empty())
+	{
+		BenchSize defaults[3] = { { 64, 50, 40 }, { 100, 78, 64 }, { 128, 100, 80 } };
+		opt.sizes.assign(defaults, defaults + 3);
+	}
+	return opt.gridh > 0.0f && opt.maxparticles > 0 && opt.warmup >= 1 && opt.reps > 0 && opt.frame_reps > 0 && opt.threads >= 0;
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions opt;
+	for (int a = 1; a < argc; ++a)
+	{
+		if (!strcmp(argv[a], "--help") || !strcmp(argv[a], "-h"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	if (!parse_args(argc, argv, opt))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	set_num_threads(opt.threads);
+	if (opt.simd >= 0 && !simd_set_level(opt.simd))
+	{
+		std::cerr << "The " << simd_name(opt.simd) << " kernels are not supported on this machine\n";
+		return 1;
+	}
+
+	printf("threads: %d, simd: %s, seed: %u, %d warm up frames, times in ms\n", max_threads(), simd_name(simd_level()), opt.seed, opt.warmup);
+	printf("%-26s %-12s %9s %9s %10s %10s %10s %12s\n", "name", "grid", "particles", "cells", "min", "median", "mean", "items/s");
+
+	std::vector<BenchResult> results;
+	for (size_t s = 0; s < opt.sizes.size(); ++s)
+	{
+		size_t first = results.size();
+		run_size(opt, opt.sizes[s], results);
+
+		for (size_t n = first; n < results.size(); ++n)
+		{
+			const BenchResult &r = results[n];
+			char grid[32];
+			snprintf(grid, sizeof(grid), "%dx%dx%d", r.size.dimx, r.size.dimy, r.size.dimz);
+			printf("%-26s %-12s %9d %9d %10.4f %10.4f %10.4f %12.4g\n", r.name.c_str(), grid, r.particles, r.fluid_cells,
+				r.min_ms, r.median_ms, r.mean_ms, r.min_ms > 0.0 ? 1e3 * r.items / r.min_ms : 0.0);
+		}
+	}
+
+	if (!opt.csv.empty() && !write_csv(opt.csv, results))
+	{
+		std::cerr << "Could not write " << opt.csv << "\n";
+		return 1;
+	}
+	if (!opt.json.empty() && !write_json(opt.json, opt, results))
+	{
+		std::cerr << "Could not write " << opt.json << "\n";
+		return 1;
+	}
+	return 0;
+}
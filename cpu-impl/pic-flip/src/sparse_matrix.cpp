@@ -1,166 +1,393 @@
 #include "sparse_matrix.h"
 #include "array3d.h"
+#include "blas_kernels.h"
+#include "simd.h"
+#include "util.h"
 
 #include <cmath>
 #include <cstring>
 
-VectorN::VectorN() : size(0) {}
+Fluid_Cells::Fluid_Cells() : dimx(0), dimy(0), dimz(0), count(0) {}
 
-VectorN::VectorN(int dimx_, int dimy_, int dimz_)
+void Fluid_Cells::build(const Array3c &marker)
 {
-	init(dimx_, dimy_, dimz_);
-}
+	dimx = marker.nx; dimy = marker.ny; dimz = marker.nz;
+	const int nlines = dimy * dimz;
+	line_start.resize(nlines + 1);
 
-void VectorN::init(int dimx_, int dimy_, int dimz_)
-{
-	size = dimx_ * dimy_ * dimz_;
-	dimx = dimx_;
-	dimy = dimy_;
-	dimz = dimz_;
-	data = new double[size];
-	zero();
+	// Runs per i-line, then their offsets, so the lines are scanned in parallel
+	line_start[0] = 0;
+#pragma omp parallel for schedule(static)
+	for (int line = 0; line < nlines; ++line)
+	{
+		const char *m = &marker(0, line % dimy, line / dimy);
+		int nruns = m[0] == FLUIDCELL;
+		for (int i = 1; i < dimx; ++i)
+			nruns += (m[i] == FLUIDCELL) & (m[i - 1] != FLUIDCELL);
+		line_start[line + 1] = nruns;
+	}
+	for (int line = 0; line < nlines; ++line)
+		line_start[line + 1] += line_start[line];
+
+	begin.resize(line_start[nlines]);
+	end.resize(line_start[nlines]);
+
+#pragma omp parallel for schedule(static)
+	for (int line = 0; line < nlines; ++line)
+	{
+		int run = line_start[line];
+		if (run == line_start[line + 1])
+			continue;
+
+		const char *m = &marker(0, line % dimy, line / dimy);
+		int base = dimx * line;
+
+		for (int i = 0; i < dimx; ++i)
+		{
+			if (m[i] != FLUIDCELL)
+				continue;
+
+			int first = i;
+			while (i < dimx && m[i] == FLUIDCELL)
+				++i;
+
+			begin[run] = base + first;
+			end[run] = base + i;
+			++run;
+		}
+	}
+
+	// A new chunk starts at the first run once the chunk holds FLUID_CHUNK_CELLS
+	count = 0;
+	chunk_start.clear();
+	int chunkcells = FLUID_CHUNK_CELLS;
+	for (int run = 0; run < runs(); ++run)
+	{
+		if (chunkcells >= FLUID_CHUNK_CELLS)
+		{
+			chunk_start.push_back(run);
+			chunkcells = 0;
+		}
+		chunkcells += end[run] - begin[run];
+		count += end[run] - begin[run];
+	}
+	chunk_start.push_back(runs());
 }
 
-double VectorN::infnorm() const
+bool Fluid_Cells::line_span(int line, int &lo, int &hi) const
 {
-	double r = 0;
-	for (int i = 0; i < size; ++i)
-		if (!(std::fabs(data[i]) <= r))
-			r = std::fabs(data[i]);
-	return r;
+	int first = line_start[line], last = line_start[line + 1];
+	if (first == last)
+		return false;
+	lo = begin[first] - dimx * line;
+	hi = end[last - 1] - dimx * line;
+	return true;
 }
 
-void VectorN::copy_to(VectorN &vec) const
+//----------------------------------------------------------------------------//
+// The vector operations below run the blas_kernels() of the active instruction 
+// set over the fluid runs, in parallel over the chunks of the fluid cells. The 
+// chunks do not depend on the number of threads, and the reductions sum the 
+// per chunk results in chunk order, so the results are reproducible.
+//----------------------------------------------------------------------------//
+
+// Adj = A * d on the fluid cells, returns dot(d, Adj). Entries of Adj outside 
+// the fluid are not written. All boundary cells are solid, so no run touches 
+// the border.
+template<class T>
+double mtx_mult_vectorN_dot(const Poisson_OperatorT<T> &A, const VectorNT<T> &d, VectorNT<T> &Adj, const Fluid_Cells &cells)
 {
-	std::memcpy(vec.data, data, size * sizeof(double));
+	const Blas_KernelsT<T> &kernels = blas_kernels<T>();
+	const int sy = d.dimx, sz = d.dimx * d.dimy;
+	int nchunks = cells.chunks();
+	std::vector<double> partial(nchunks);
+
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+	{
+		int run = cells.chunk_start[c];
+		double lanes[BLAS_LANES] = { 0 };
+		if (A.matrix)
+			kernels.stencil_dot(A.matrix->data, d.data, Adj.data, sy, sz, &cells.begin[0] + run, &cells.end[0] + run, cells.chunk_start[c + 1] - run, lanes);
+		else
+			kernels.stencil_mf_dot(A.marker->data, A.diagd, A.offdiag, d.data, Adj.data, sy, sz, &cells.begin[0] + run, &cells.end[0] + run, cells.chunk_start[c + 1] - run, lanes);
+		partial[c] = blas_reduce_lanes(lanes);
+	}
+
+	double sum = 0.0;
+	for (int c = 0; c < nchunks; ++c)
+		sum += partial[c];
+	return sum;
 }
 
-VectorN::~VectorN()
+template<class T>
+void mtx_mult_vectorN(const Poisson_OperatorT<T> &A, const VectorNT<T> &d, VectorNT<T> &Adj, const Fluid_Cells &cells)
 {
-	delete[]data;
+	mtx_mult_vectorN_dot(A, d, Adj, cells);
 }
 
-double &VectorN::operator()(int i, int j, int k)
+// x = x + alpha * d and r = r - alpha * q on the fluid cells. Returns the 
+// infinity norm of the new r and stores its squared 2-norm in rnorm2.
+template<class T>
+double vectorN_update_xr(VectorNT<T> &x, const VectorNT<T> &d, VectorNT<T> &r, const VectorNT<T> &q, double alpha, const Fluid_Cells &cells, double *rnorm2)
 {
-	return data[i + dimx * (j + dimy * k)];
+	const Blas_KernelsT<T> &kernels = blas_kernels<T>();
+	int nchunks = cells.chunks();
+	std::vector<double> partial(2 * nchunks);
+
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+	{
+		int run = cells.chunk_start[c];
+		double lanes[BLAS_LANES] = { 0 };
+		partial[2 * c + 1] = kernels.update_xr(x.data, d.data, r.data, q.data, alpha, &cells.begin[0] + run, &cells.end[0] + run, cells.chunk_start[c + 1] - run, lanes, 0.0);
+		partial[2 * c] = blas_reduce_lanes(lanes);
+	}
+
+	double sum = 0.0, m = 0.0;
+	for (int c = 0; c < nchunks; ++c)
+	{
+		sum += partial[2 * c];
+		m = max(m, partial[2 * c + 1]);
+	}
+	if (rnorm2)
+		*rnorm2 = sum;
+	return m;
 }
 
-const double &VectorN::operator()(int i, int j, int k) const
+template<class T>
+void vectorN_copy(VectorNT<T> &lhs, const VectorNT<T> &rhs, const Fluid_Cells &cells)
 {
-	return data[i + dimx * (j + dimy * k)];
+	for (int run = 0; run < cells.runs(); ++run)
+		std::memcpy(lhs.data + cells.begin[run], rhs.data + cells.begin[run], (cells.end[run] - cells.begin[run]) * sizeof(T));
 }
 
-void VectorN::zero()
+template<class T>
+void vectorN_add(VectorNT<T> &lhs, const VectorNT<T> &rhs, const Fluid_Cells &cells)
 {
-	std::memset(data, 0, size * sizeof(double));
+	vectorN_add_scale(lhs, rhs, 1.0, cells);
 }
 
-Sparse_Matrix::Sparse_Matrix() : data(NULL)
+template<class T>
+void vectorN_add_scale(VectorNT<T> &lhs, const VectorNT<T> &rhs, double scale, const Fluid_Cells &cells)
 {
+	const Blas_KernelsT<T> &kernels = blas_kernels<T>();
+	int nchunks = cells.chunks();
 
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+	{
+		int run = cells.chunk_start[c];
+		kernels.axpy(lhs.data, rhs.data, scale, &cells.begin[0] + run, &cells.end[0] + run, cells.chunk_start[c + 1] - run);
+	}
 }
 
-Sparse_Matrix::Sparse_Matrix(int dimx, int dimy, int dimz)
+template<class T>
+void vectorN_scale_add(VectorNT<T> &d, const VectorNT<T> &r, double beta, const Fluid_Cells &cells)
 {
-	init(dimx, dimy, dimz);
-}
+	const Blas_KernelsT<T> &kernels = blas_kernels<T>();
+	int nchunks = cells.chunks();
 
-void Sparse_Matrix::init(int dimx_, int dimy_, int dimz_)
-{
-	dimx = dimx_; dimy = dimy_; dimz = dimz_;
-	size = 4 * dimx * dimy * dimz;
-	stride_y = 4 * dimx;
-	stride_z = stride_y * dimy;
-	data = new double[size];
-	zero();
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+	{
+		int run = cells.chunk_start[c];
+		kernels.xpby(d.data, r.data, beta, &cells.begin[0] + run, &cells.end[0] + run, cells.chunk_start[c + 1] - run);
+	}
 }
 
-Sparse_Matrix::~Sparse_Matrix()
+template<class T>
+void vectorN_sub_scale(VectorNT<T> &r, const VectorNT<T> &Adj, double alpha, const Fluid_Cells &cells)
 {
-	delete[]data;
+	vectorN_add_scale(r, Adj, -alpha, cells);
 }
 
-double &Sparse_Matrix::operator()(int i, int j, int k, int offset)
+template<class T>
+double vectorN_dot(const VectorNT<T> &lhs, const VectorNT<T> &rhs, const Fluid_Cells &cells)
 {
-	return data[i * 4 + j * stride_y + k * stride_z + offset];
+	const Blas_KernelsT<T> &kernels = blas_kernels<T>();
+	int nchunks = cells.chunks();
+	std::vector<double> partial(nchunks);
+
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+	{
+		int run = cells.chunk_start[c];
+		double lanes[BLAS_LANES] = { 0 };
+		kernels.dot(lhs.data, rhs.data, &cells.begin[0] + run, &cells.end[0] + run, cells.chunk_start[c + 1] - run, lanes);
+		partial[c] = blas_reduce_lanes(lanes);
+	}
+
+	double sum = 0.0;
+	for (int c = 0; c < nchunks; ++c)
+		sum += partial[c];
+	return sum;
 }
 
-const double &Sparse_Matrix::operator()(int i, int j, int k, int offset) const
+template<class T>
+double vectorN_norm2(const VectorNT<T> &lhs, const Fluid_Cells &cells)
 {
-	return data[i * 4 + j * stride_y + k * stride_z + offset];
+	return vectorN_dot(lhs, lhs, cells);
 }
 
-void Sparse_Matrix::zero()
+template<class T>
+double vectorN_infnorm(const VectorNT<T> &lhs, const Fluid_Cells &cells)
 {
-	std::memset(data, 0, size * sizeof(double));
+	const Blas_KernelsT<T> &kernels = blas_kernels<T>();
+	int nchunks = cells.chunks();
+	std::vector<double> partial(nchunks);
+
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
+	{
+		int run = cells.chunk_start[c];
+		partial[c] = kernels.absmax(lhs.data, &cells.begin[0] + run, &cells.end[0] + run, cells.chunk_start[c + 1] - run, 0.0);
+	}
+
+	double m = 0.0;
+	for (int c = 0; c < nchunks; ++c)
+		m = max(m, partial[c]);
+	return m;
 }
 
-void mtx_mult_vectorN(const Sparse_Matrix &A, const VectorN &d, VectorN &Adj, Array3c &marker)
+//----------------------------------------------------------------------------//
+// Sets A to the 7-point Poisson stencil of every fluid cell: scale times the 
+// number of non-solid neighbours on the diagonal and -scale towards fluid 
+// neighbours in the +i, +j and +k slots. Every interior cell writes its own 
+// coefficients, 0 outside the fluid, so the k slabs are formed in parallel. 
+// The boundary cells of A are left as they are, zero from init.
+//----------------------------------------------------------------------------//
+template<class T>
+void form_poisson_matrix(Sparse_MatrixT<T> &A, const Array3c &marker, double scale_)
 {
-	// All boundary cells are SOLIDS
-	// Thus the boundary cell rows in the Poisson matrix are ZERO: No need to operate on them
-	Adj.zero();
+	const T scale = (T)scale_;
+
+#pragma omp parallel for schedule(static)
 	for (int k = 1; k < A.dimz - 1; ++k)
 		for (int j = 1; j < A.dimy - 1; ++j)
 			for (int i = 1; i < A.dimx - 1; ++i)
 			{
+				T diag = 0, plusi = 0, plusj = 0, plusk = 0;
+
 				if (marker(i, j, k) == FLUIDCELL)
 				{
-					// No need to zero Adj since we assign the value on the first entry
-					Adj(i, j, k) = A(i, j, k, 0) * d(i, j, k);     // i, j, k
+					if (marker(i - 1, j, k) != SOLIDCELL)		//Cell(i-1,j,k) Is air or fluid
+						diag += scale;
+					if (marker(i + 1, j, k) != SOLIDCELL)		//Cell(i+1,j,k) Is air or fluid
+					{
+						diag += scale;
+						if (marker(i + 1, j, k) == FLUIDCELL)	//Cell(i+1,j,k) Is fluid
+							plusi -= scale;
+					}
 
-					Adj(i, j, k) += A(i, j, k, 1) * d(i + 1, j, k); // i + 1, j, k
-					Adj(i, j, k) += A(i, j, k, 2) * d(i, j + 1, k); // i, j + 1, k
-					Adj(i, j, k) += A(i, j, k, 3) * d(i, j, k + 1); // i, j, k + 1
+					if (marker(i, j - 1, k) != SOLIDCELL)		//Cell(i,j-1,k) Is air or fluid
+						diag += scale;
+					if (marker(i, j + 1, k) != SOLIDCELL)		//Cell(i,j+1,k) Is air or fluid
+					{
+						diag += scale;
+						if (marker(i, j + 1, k) == FLUIDCELL)	//Cell(i,j+1,k) Is fluid
+							plusj -= scale;
+					}
 
-					Adj(i, j, k) += A(i - 1, j, k, 1) * d(i - 1, j, k); // i - 1, j, k
-					Adj(i, j, k) += A(i, j - 1, k, 2) * d(i, j - 1, k); // i, j - 1, k
-					Adj(i, j, k) += A(i, j, k - 1, 3) * d(i, j, k - 1); // i, j, k - 1
-				}
+					if (marker(i, j, k - 1) != SOLIDCELL)		//Cell(i,j,k-1) Is air or fluid
+						diag += scale;
+					if (marker(i, j, k + 1) != SOLIDCELL)		//Cell(i,j,k+1) Is air or fluid
+					{
+						diag += scale;
+						if (marker(i, j, k + 1) == FLUIDCELL)	//Cell(i,j,k+1) Is fluid
+							plusk -= scale;
+					}
+				} //End if CELL(i,j,k) == FLUIDCELL
+
+				A(i, j, k, 0) = diag;
+				A(i, j, k, 1) = plusi;
+				A(i, j, k, 2) = plusj;
+				A(i, j, k, 3) = plusk;
 			}
 }
 
-void vectorN_add(VectorN &lhs, const VectorN &rhs)
-{
-	for (int i = 0; i < lhs.size; ++i)
-		lhs.data[i] += rhs.data[i];
-}
+//----------------------------------------------------------------------------//
+// Helpers for the iterative refinement of the mixed precision solve, which
+// keeps the solution and residual in double and solves for the corrections in
+// float
+//----------------------------------------------------------------------------//
 
-void vectorN_add_scale(VectorN &lhs, const VectorN &rhs, double scale)
+// lhs = rhs on the fluid cells, rounded to float
+void vectorN_convert(VectorNf &lhs, const VectorN &rhs, const Fluid_Cells &cells)
 {
-	for (int i = 0; i < lhs.size; ++i)
-		lhs.data[i] += scale * rhs.data[i];
-}
+	int nruns = cells.runs();
 
-void vectorN_scale_add(VectorN &d, const VectorN &r, double beta)
-{
-	for (int i = 0; i < d.size; ++i)
-		d.data[i] = r.data[i] + beta * d.data[i];
+#pragma omp parallel for schedule(static)
+	for (int run = 0; run < nruns; ++run)
+		for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+			lhs.data[n] = (float)rhs.data[n];
 }
 
-void vectorN_sub_scale(VectorN &r, const VectorN &Adj, double alpha)
+void vectorN_add(VectorN &lhs, const VectorNf &rhs, const Fluid_Cells &cells)
 {
-	for (int i = 0; i < r.size; ++i)
-		r.data[i] -= alpha * Adj.data[i];
+	int nruns = cells.runs();
+
+#pragma omp parallel for schedule(static)
+	for (int run = 0; run < nruns; ++run)
+		for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+			lhs.data[n] += rhs.data[n];
 }
 
-double vectorN_dot(const VectorN &lhs, const VectorN &rhs)
+// r = b - A * x on the fluid cells in double, returns the infinity norm of r
+template<class C>
+static double residual(C a, const VectorN &x, const VectorN &b, VectorN &r, const Fluid_Cells &cells)
 {
-	double *rhsitr = rhs.data;
-	double sum = 0.0;
-	for (double *lhsitr = lhs.data; lhsitr < lhs.data + lhs.size; ++lhsitr)
+	const int sy = x.dimx, sz = x.dimx * x.dimy;
+	int nchunks = cells.chunks();
+	std::vector<double> partial(nchunks);
+
+#pragma omp parallel for schedule(static)
+	for (int c = 0; c < nchunks; ++c)
 	{
-		sum += (*lhsitr) * (*rhsitr++);
+		double m = 0.0;
+		for (int run = cells.chunk_start[c]; run < cells.chunk_start[c + 1]; ++run)
+			for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+			{
+				double sum = (double)a(n, 0) * x.data[n];
+				sum += (double)a(n, 1) * x.data[n + 1];
+				sum += (double)a(n, 2) * x.data[n + sy];
+				sum += (double)a(n, 3) * x.data[n + sz];
+				sum += (double)a(n - 1, 1) * x.data[n - 1];
+				sum += (double)a(n - sy, 2) * x.data[n - sy];
+				sum += (double)a(n - sz, 3) * x.data[n - sz];
+
+				r.data[n] = b.data[n] - sum;
+				m = max(m, std::fabs(r.data[n]));
+			}
+		partial[c] = m;
 	}
-	return sum;
+
+	double m = 0.0;
+	for (int c = 0; c < nchunks; ++c)
+		m = max(m, partial[c]);
+	return m;
 }
 
-double vectorN_norm2(const VectorN &lhs)
+double vectorN_residual(const Poisson_Operatorf &A, const VectorN &x, const VectorN &b, VectorN &r, const Fluid_Cells &cells)
 {
-	double sum = 0;
-	for (double *lhsitr = lhs.data; lhsitr < lhs.data + lhs.size; ++lhsitr)
-	{
-		sum += (*lhsitr) * (*lhsitr);
-	}
-	return sum;
+	if (A.matrix)
+		return residual(A.matrix_coefficients(), x, b, r, cells);
+	return residual(A.stencil_coefficients(), x, b, r, cells);
 }
+
+#define INSTANTIATE_VECTORN_OPS(T) \
+	template void form_poisson_matrix<T>(Sparse_MatrixT<T> &, const Array3c &, double); \
+	template void mtx_mult_vectorN<T>(const Poisson_OperatorT<T> &, const VectorNT<T> &, VectorNT<T> &, const Fluid_Cells &); \
+	template double mtx_mult_vectorN_dot<T>(const Poisson_OperatorT<T> &, const VectorNT<T> &, VectorNT<T> &, const Fluid_Cells &); \
+	template double vectorN_update_xr<T>(VectorNT<T> &, const VectorNT<T> &, VectorNT<T> &, const VectorNT<T> &, double, const Fluid_Cells &, double *); \
+	template void vectorN_copy<T>(VectorNT<T> &, const VectorNT<T> &, const Fluid_Cells &); \
+	template void vectorN_add<T>(VectorNT<T> &, const VectorNT<T> &, const Fluid_Cells &); \
+	template void vectorN_add_scale<T>(VectorNT<T> &, const VectorNT<T> &, double, const Fluid_Cells &); \
+	template void vectorN_scale_add<T>(VectorNT<T> &, const VectorNT<T> &, double, const Fluid_Cells &); \
+	template void vectorN_sub_scale<T>(VectorNT<T> &, const VectorNT<T> &, double, const Fluid_Cells &); \
+	template double vectorN_dot<T>(const VectorNT<T> &, const VectorNT<T> &, const Fluid_Cells &); \
+	template double vectorN_norm2<T>(const VectorNT<T> &, const Fluid_Cells &); \
+	template double vectorN_infnorm<T>(const VectorNT<T> &, const Fluid_Cells &);
+
+INSTANTIATE_VECTORN_OPS(double)
+INSTANTIATE_VECTORN_OPS(float)
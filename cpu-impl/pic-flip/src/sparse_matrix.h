@@ -6,48 +6,272 @@
 #define FLUIDCELL 1
 #define SOLIDCELL 2
 
+#define FLUID_CHUNK_CELLS 4096 // Minimum cells per chunk of parallel work on the fluid runs
+
+#include <vector>
+#include <cstring>
+
 #include "array3d.h"
+#include "simd.h"
 
-struct VectorN
+//----------------------------------------------------------------------------//
+// Vector and matrix of the pressure system. T is double, or float for the 
+// mixed precision solve, which stores the system in float but does all 
+// reductions in double.
+//----------------------------------------------------------------------------//
+template<class T>
+struct VectorNT
 {
-	VectorN();
-	VectorN(int dimx_, int dimy_, int dimz_);
-	void init(int dimx_, int dimy_, int dimz_);
-	~VectorN();
+	int size, dimx, dimy, dimz;
+	T *data;
+
+	VectorNT() : size(0), dimx(0), dimy(0), dimz(0), data(NULL) {}
+
+	VectorNT(int dimx_, int dimy_, int dimz_) : size(0), dimx(0), dimy(0), dimz(0), data(NULL)
+	{
+		init(dimx_, dimy_, dimz_);
+	}
+
+	void init(int dimx_, int dimy_, int dimz_)
+	{
+		delete_memory();
+		dimx = dimx_; dimy = dimy_; dimz = dimz_;
+		size = dimx * dimy * dimz;
+		data = (T *)simd_alloc(size * sizeof(T));
+		zero();
+	}
+
+	~VectorNT()
+	{
+		delete_memory();
+	}
+
+	void delete_memory()
+	{
+		simd_free(data); data = NULL;
+		size = dimx = dimy = dimz = 0;
+	}
+
+	double infnorm() const
+	{
+		double r = 0;
+		for (int i = 0; i < size; ++i)
+			if (!(std::fabs(data[i]) <= r))
+				r = std::fabs(data[i]);
+		return r;
+	}
+
+	void copy_to(VectorNT &vec) const
+	{
+		std::memcpy(vec.data, data, size * sizeof(T));
+	}
+
+	T &operator()(int i, int j, int k)
+	{
+		return data[i + dimx * (j + dimy * k)];
+	}
 
-	double infnorm() const;
-	void copy_to(VectorN &vec) const;
+	const T &operator()(int i, int j, int k) const
+	{
+		return data[i + dimx * (j + dimy * k)];
+	}
 
-	double &operator()(int i, int j, int k);
-	const double &operator()(int i, int j, int k) const;
-	void zero();
+	void zero()
+	{
+		std::memset(data, 0, size * sizeof(T));
+	}
+};
 
+template<class T>
+struct Sparse_MatrixT
+{
 	int size, dimx, dimy, dimz;
-	double *data;
+	int stride_y, stride_z;
+	T *data;
+
+	Sparse_MatrixT() : size(0), dimx(0), dimy(0), dimz(0), stride_y(0), stride_z(0), data(NULL) {}
+
+	Sparse_MatrixT(int dimx_, int dimy_, int dimz_) : size(0), dimx(0), dimy(0), dimz(0), stride_y(0), stride_z(0), data(NULL)
+	{
+		init(dimx_, dimy_, dimz_);
+	}
+
+	void init(int dimx_, int dimy_, int dimz_)
+	{
+		delete_memory();
+		dimx = dimx_; dimy = dimy_; dimz = dimz_;
+		size = 4 * dimx * dimy * dimz;
+		stride_y = 4 * dimx;
+		stride_z = stride_y * dimy;
+		data = (T *)simd_alloc(size * sizeof(T));
+		zero();
+	}
+
+	~Sparse_MatrixT()
+	{
+		delete_memory();
+	}
+
+	void delete_memory()
+	{
+		simd_free(data); data = NULL;
+		size = dimx = dimy = dimz = stride_y = stride_z = 0;
+	}
+
+	T &operator()(int i, int j, int k, int offset)
+	{
+		return data[i * 4 + j * stride_y + k * stride_z + offset];
+	}
+
+	const T &operator()(int i, int j, int k, int offset) const
+	{
+		return data[i * 4 + j * stride_y + k * stride_z + offset];
+	}
+
+	void zero()
+	{
+		std::memset(data, 0, size * sizeof(T));
+	}
 };
 
-struct Sparse_Matrix
+typedef VectorNT<double> VectorN;
+typedef VectorNT<float> VectorNf;
+typedef Sparse_MatrixT<double> Sparse_Matrix;
+typedef Sparse_MatrixT<float> Sparse_Matrixf;
+
+//----------------------------------------------------------------------------//
+// The fluid cells of a grid, stored as runs of consecutive fluid cells along i. 
+// Run n covers the linear indices [begin[n], end[n]) in increasing order, and 
+// the i-line (j, k) owns the runs [line_start[j + dimy * k], line_start[j + dimy * k + 1]).
+// The CG kernels only visit these cells instead of the whole box. The runs are 
+// also split into chunks [chunk_start[c], chunk_start[c + 1]) of at least 
+// FLUID_CHUNK_CELLS cells, the units of parallel work.
+//----------------------------------------------------------------------------//
+struct Fluid_Cells
 {
-	Sparse_Matrix();
-	Sparse_Matrix(int dimx, int dimy, int dimz);
-	void init(int dimx_, int dimy_, int dimz_);
-	~Sparse_Matrix();
+	int dimx, dimy, dimz;
+	int count; // Number of fluid cells
+	std::vector<int> begin, end;
+	std::vector<int> line_start;
+	std::vector<int> chunk_start;
 
-	double &operator()(int i, int j, int k, int offset);
-	const double &operator()(int i, int j, int k, int offset) const;
-	void zero();
+	Fluid_Cells();
+	void build(const Array3c &marker);
+	int runs() const { return (int)begin.size(); }
+	int chunks() const { return chunk_start.empty() ? 0 : (int)chunk_start.size() - 1; }
+	bool line_span(int line, int &lo, int &hi) const; // The i range [lo, hi) of the runs of line, false if it has none
+};
 
-	int size, dimx, dimy, dimz;
-	int stride_y, stride_z;
-	double *data;
+//----------------------------------------------------------------------------//
+// Coefficient o of the cell with linear index n, o = 0 is the diagonal and 
+// 1, 2, 3 the coupling towards +i, +j and +k, from an explicit matrix
+//----------------------------------------------------------------------------//
+template<class T>
+struct Matrix_Coefficients
+{
+	const T *a;
+
+	T operator()(int n, int o) const { return a[4 * n + o]; }
+};
+
+//----------------------------------------------------------------------------//
+// The same coefficients derived from the voxel classification. They are the 
+// values form_poisson_matrix stores: diag[c] on the diagonal of a fluid cell 
+// with c non-solid neighbours, offdiag between two fluid cells, 0 elsewhere.
+//----------------------------------------------------------------------------//
+template<class T>
+struct Stencil_Coefficients
+{
+	const char *m;
+	int sy, sz;
+	T offdiag;
+	const T *diag;
+
+	T operator()(int n, int o) const
+	{
+		if (m[n] != FLUIDCELL)
+			return 0;
+
+		switch (o)
+		{
+		case 0:
+			return diag[(m[n - 1] != SOLIDCELL) + (m[n + 1] != SOLIDCELL) + (m[n - sy] != SOLIDCELL)
+				+ (m[n + sy] != SOLIDCELL) + (m[n - sz] != SOLIDCELL) + (m[n + sz] != SOLIDCELL)];
+		case 1: return m[n + 1] == FLUIDCELL ? offdiag : 0;
+		case 2: return m[n + sy] == FLUIDCELL ? offdiag : 0;
+		default: return m[n + sz] == FLUIDCELL ? offdiag : 0;
+		}
+	}
 };
 
-void mtx_mult_vectorN(const Sparse_Matrix &A, const VectorN &d, VectorN &Adj, Array3c &marker);
-void vectorN_add(VectorN &lhs, const VectorN &rhs);
-void vectorN_add_scale(VectorN &lhs, const VectorN &rhs, double scale);
-void vectorN_scale_add(VectorN &d, const VectorN &r, double beta);
-void vectorN_sub_scale(VectorN &r, const VectorN &Adj, double alpha);
-double vectorN_dot(const VectorN &lhs, const VectorN &rhs);
-double vectorN_norm2(const VectorN &lhs);
+//----------------------------------------------------------------------------//
+// The Poisson operator of the pressure solve, either an explicit matrix or the 
+// matrix free 7-point stencil of a voxel classification and a scale. Both give 
+// identical results, the explicit matrix is kept for coefficients that do not 
+// follow from the classification alone.
+//----------------------------------------------------------------------------//
+template<class T>
+struct Poisson_OperatorT
+{
+	const Sparse_MatrixT<T> *matrix; // NULL for the matrix free stencil
+	const Array3c *marker;
+	T offdiag;
+	T diag[8]; // scale summed c times for c = 0..6, as form_poisson_matrix accumulates it
+	double diagd[8]; // diag in double for the kernels
+
+	Poisson_OperatorT() : matrix(NULL), marker(NULL), offdiag(0) {}
+
+	void set_matrix(const Sparse_MatrixT<T> &A)
+	{
+		matrix = &A;
+		marker = NULL;
+	}
+
+	void set_stencil(const Array3c &marker_, double scale)
+	{
+		matrix = NULL;
+		marker = &marker_;
+		offdiag = -(T)scale;
+		diag[0] = 0;
+		for (int c = 1; c < 8; ++c)
+			diag[c] = diag[c - 1] + (T)scale;
+		for (int c = 0; c < 8; ++c)
+			diagd[c] = diag[c];
+	}
+
+	Matrix_Coefficients<T> matrix_coefficients() const
+	{
+		Matrix_Coefficients<T> c = { matrix->data };
+		return c;
+	}
+
+	Stencil_Coefficients<T> stencil_coefficients() const
+	{
+		Stencil_Coefficients<T> c = { marker->data, marker->nx, marker->nx * marker->ny, offdiag, diag };
+		return c;
+	}
+};
+
+typedef Poisson_OperatorT<double> Poisson_Operator;
+typedef Poisson_OperatorT<float> Poisson_Operatorf;
+
+// Instantiated for float and double
+template<class T> void form_poisson_matrix(Sparse_MatrixT<T> &A, const Array3c &marker, double scale);
+template<class T> void mtx_mult_vectorN(const Poisson_OperatorT<T> &A, const VectorNT<T> &d, VectorNT<T> &Adj, const Fluid_Cells &cells);
+template<class T> double mtx_mult_vectorN_dot(const Poisson_OperatorT<T> &A, const VectorNT<T> &d, VectorNT<T> &Adj, const Fluid_Cells &cells);
+template<class T> double vectorN_update_xr(VectorNT<T> &x, const VectorNT<T> &d, VectorNT<T> &r, const VectorNT<T> &q, double alpha, const Fluid_Cells &cells, double *rnorm2);
+template<class T> void vectorN_copy(VectorNT<T> &lhs, const VectorNT<T> &rhs, const Fluid_Cells &cells);
+template<class T> void vectorN_add(VectorNT<T> &lhs, const VectorNT<T> &rhs, const Fluid_Cells &cells);
+template<class T> void vectorN_add_scale(VectorNT<T> &lhs, const VectorNT<T> &rhs, double scale, const Fluid_Cells &cells);
+template<class T> void vectorN_scale_add(VectorNT<T> &d, const VectorNT<T> &r, double beta, const Fluid_Cells &cells);
+template<class T> void vectorN_sub_scale(VectorNT<T> &r, const VectorNT<T> &Adj, double alpha, const Fluid_Cells &cells);
+template<class T> double vectorN_dot(const VectorNT<T> &lhs, const VectorNT<T> &rhs, const Fluid_Cells &cells);
+template<class T> double vectorN_norm2(const VectorNT<T> &lhs, const Fluid_Cells &cells);
+template<class T> double vectorN_infnorm(const VectorNT<T> &lhs, const Fluid_Cells &cells);
+
+// Conversions between the precisions for the iterative refinement of the mixed solve
+void vectorN_convert(VectorNf &lhs, const VectorN &rhs, const Fluid_Cells &cells);
+void vectorN_add(VectorN &lhs, const VectorNf &rhs, const Fluid_Cells &cells);
+double vectorN_residual(const Poisson_Operatorf &A, const VectorN &x, const VectorN &b, VectorN &r, const Fluid_Cells &cells);
 
 #endif
@@ -0,0 +1,175 @@
+#include "timer.h"
+
+#include <cstdio>
+
+const char *stage_names[STAGE_COUNT] =
+{
+	"advect", "classify", "sort", "p2g", "forces", "form_poisson", "divergence", "solve", "project", "g2p", "cfl", "narrow_band", "reseed", "emit"
+};
+
+Profiler::Profiler() : enabled(false), trace(false), origin(clock::now())
+{
+	begin_frame(0);
+}
+
+void Profiler::enable(bool trace_events)
+{
+	enabled = true;
+	trace = trace_events;
+	clear();
+}
+
+void Profiler::clear()
+{
+	origin = clock::now();
+	frames.clear();
+	solves.clear();
+	events.clear();
+	begin_frame(0);
+}
+
+void Profiler::begin_frame(int frame)
+{
+	current.frame = frame;
+	current.substeps = 0;
+	current.particles = 0;
+	current.removed = 0;
+	current.added = 0;
+	current.fluid_cells = 0;
+	current.cg_iterations = 0;
+	current.cg_residual = 0.0;
+	for (int s = 0; s < STAGE_COUNT; ++s)
+		current.stage_ms[s] = 0.0;
+	current.total_ms = 0.0;
+}
+
+void Profiler::end_frame(double start_us, int particles)
+{
+	double end_us = now_us();
+	current.particles = particles;
+	current.total_ms = 1e-3 * (end_us - start_us);
+	frames.push_back(current);
+
+	if (trace)
+	{
+		Trace_Event e = { "frame", start_us, end_us - start_us };
+		events.push_back(e);
+	}
+}
+
+void Profiler::add_stage(int stage, double start_us, double end_us)
+{
+	current.stage_ms[stage] += 1e-3 * (end_us - start_us);
+
+	if (trace)
+	{
+		Trace_Event e = { stage_names[stage], start_us, end_us - start_us };
+		events.push_back(e);
+	}
+}
+
+void Profiler::add_solve(int iterations, double residual, int fluid_cells, const std::vector<double> &history)
+{
+	Solve_Profile s = { current.frame, current.substeps, iterations, residual, now_us(), history };
+	solves.push_back(s);
+
+	current.cg_iterations += iterations;
+	if (residual > current.cg_residual)
+		current.cg_residual = residual;
+	current.fluid_cells = fluid_cells;
+}
+
+//----------------------------------------------------------------------------//
+// One row per frame, stage times in milliseconds
+//----------------------------------------------------------------------------//
+bool Profiler::write_csv(const std::string &path) const
+{
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+
+	fprintf(f, "frame,substeps,particles,removed,added,fluid_cells,cg_iterations,cg_residual");
+	for (int s = 0; s < STAGE_COUNT; ++s)
+		fprintf(f, ",%s_ms", stage_names[s]);
+	fprintf(f, ",total_ms\n");
+
+	for (size_t n = 0; n < frames.size(); ++n)
+	{
+		const Frame_Profile &p = frames[n];
+		fprintf(f, "%d,%d,%d,%d,%d,%d,%d,%.9g", p.frame, p.substeps, p.particles, p.removed, p.added, p.fluid_cells, p.cg_iterations, p.cg_residual);
+		for (int s = 0; s < STAGE_COUNT; ++s)
+			fprintf(f, ",%.4f", p.stage_ms[s]);
+		fprintf(f, ",%.4f\n", p.total_ms);
+	}
+
+	fclose(f);
+	return true;
+}
+
+//----------------------------------------------------------------------------//
+// The frames as in the CSV, and every pressure solve with its residual history
+//----------------------------------------------------------------------------//
+bool Profiler::write_json(const std::string &path) const
+{
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+
+	fprintf(f, "{\n  \"frames\": [");
+	for (size_t n = 0; n < frames.size(); ++n)
+	{
+		const Frame_Profile &p = frames[n];
+		fprintf(f, "%s\n    {\"frame\": %d, \"substeps\": %d, \"particles\": %d, \"removed\": %d, \"added\": %d, \"fluid_cells\": %d, "
+			"\"cg_iterations\": %d, \"cg_residual\": %.9g, \"stage_ms\": {",
+			n ? "," : "", p.frame, p.substeps, p.particles, p.removed, p.added, p.fluid_cells, p.cg_iterations, p.cg_residual);
+		for (int s = 0; s < STAGE_COUNT; ++s)
+			fprintf(f, "%s\"%s\": %.4f", s ? ", " : "", stage_names[s], p.stage_ms[s]);
+		fprintf(f, "}, \"total_ms\": %.4f}", p.total_ms);
+	}
+	fprintf(f, "\n  ],\n  \"solves\": [");
+	for (size_t n = 0; n < solves.size(); ++n)
+	{
+		const Solve_Profile &s = solves[n];
+		fprintf(f, "%s\n    {\"frame\": %d, \"substep\": %d, \"iterations\": %d, \"residual\": %.9g, \"history\": [",
+			n ? "," : "", s.frame, s.substep, s.iterations, s.residual);
+		for (size_t i = 0; i < s.history.size(); ++i)
+			fprintf(f, "%s%.9g", i ? ", " : "", s.history[i]);
+		fprintf(f, "]}");
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	fclose(f);
+	return true;
+}
+
+//----------------------------------------------------------------------------//
+// Chrome trace event format, for chrome://tracing or Perfetto. The frames and
+// stages are complete events on one track, the CG iterations a counter.
+//----------------------------------------------------------------------------//
+bool Profiler::write_trace(const std::string &path) const
+{
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+
+	fprintf(f, "{\"traceEvents\": [");
+	const char *sep = "";
+	for (size_t n = 0; n < events.size(); ++n)
+	{
+		const Trace_Event &e = events[n];
+		fprintf(f, "%s\n{\"name\": \"%s\", \"cat\": \"solver\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": 1}",
+			sep, e.name, e.start_us, e.duration_us);
+		sep = ",";
+	}
+	for (size_t n = 0; n < solves.size(); ++n)
+	{
+		const Solve_Profile &s = solves[n];
+		fprintf(f, "%s\n{\"name\": \"cg_iterations\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": 1, \"args\": {\"iterations\": %d}}",
+			sep, s.time_us, s.iterations);
+		sep = ",";
+	}
+	fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+
+	fclose(f);
+	return true;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Stages of FluidSolver::step timed by the profiler
+#define STAGE_ADVECT 0 // move_particles_in_grid or advect_particles
+#define STAGE_CLASSIFY 1 // grid.zero and classify_voxel
+#define STAGE_SORT 2 // bin_particles or sort_particles
+#define STAGE_P2G 3 // transfer_to_grid
+#define STAGE_FORCES 4 // Saved velocities, gravity and boundary conditions
+#define STAGE_FORM_POISSON 5
+#define STAGE_DIVERGENCE 6
+#define STAGE_SOLVE 7 // solve_pressure, including the preconditioner setup
+#define STAGE_PROJECT 8 // project, boundary conditions and velocity update
+#define STAGE_G2P 9 // update_from_grid
+#define STAGE_CFL 10
+#define STAGE_NARROW_BAND 11 // Level set and particles of the narrow band, if enabled
+#define STAGE_RESEED 12 // reseed_particles, if enabled
+#define STAGE_EMIT 13 // Sinks and emitters, if any
+#define STAGE_COUNT 14
+
+extern const char *stage_names[STAGE_COUNT];
+
+// Counters and stage times of one frame
+struct Frame_Profile
+{
+	int frame;
+	int substeps; // Steps taken by the frame, from CFL()
+	int particles; // At the end of the frame
+	int removed; // Particles removed by transfer_to_grid, the narrow band, the reseeding and the sinks
+	int added; // Particles seeded by the reseeding and the emitters
+	int fluid_cells; // Of the last pressure solve
+	int cg_iterations; // Summed over the substeps
+	double cg_residual; // Largest final residual of the substeps
+	double stage_ms[STAGE_COUNT];
+	double total_ms;
+};
+
+// One pressure solve
+struct Solve_Profile
+{
+	int frame, substep;
+	int iterations;
+	double residual;
+	double time_us; // End of the solve
+	std::vector<double> history; // Residual before and after every iteration
+};
+
+// A complete event of the Chrome trace, times in microseconds from the start
+struct Trace_Event
+{
+	const char *name;
+	double start_us, duration_us;
+};
+
+//----------------------------------------------------------------------------//
+// Per stage timing and counters of the solver. Disabled by default, and then
+// the timers do not read the clock. All timed code runs on the thread calling
+// FluidSolver::step, the profiler is not thread safe.
+//----------------------------------------------------------------------------//
+struct Profiler
+{
+	typedef std::chrono::steady_clock clock;
+
+	bool enabled;
+	bool trace; // Also keep every stage as a Chrome trace event
+	clock::time_point origin;
+
+	Frame_Profile current; // The frame in progress
+	std::vector<Frame_Profile> frames;
+	std::vector<Solve_Profile> solves;
+	std::vector<Trace_Event> events;
+
+	Profiler();
+
+	void enable(bool trace_events);
+	void clear();
+
+	double now_us() const { return std::chrono::duration<double, std::micro>(clock::now() - origin).count(); }
+
+	void begin_frame(int frame);
+	void end_frame(double start_us, int particles);
+	void add_stage(int stage, double start_us, double end_us);
+	void add_solve(int iterations, double residual, int fluid_cells, const std::vector<double> &history);
+
+	bool write_csv(const std::string &path) const;
+	bool write_json(const std::string &path) const;
+	bool write_trace(const std::string &path) const;
+};
+
+//----------------------------------------------------------------------------//
+// Adds the time from construction to destruction to a stage
+//----------------------------------------------------------------------------//
+struct Scoped_Timer
+{
+	Profiler &profiler;
+	int stage;
+	double start_us;
+
+	Scoped_Timer(Profiler &p, int stage_) : profiler(p), stage(stage_), start_us(p.enabled ? p.now_us() : 0.0) {}
+	~Scoped_Timer()
+	{
+		if (profiler.enabled)
+			profiler.add_stage(stage, start_us, profiler.now_us());
+	}
+};
+
+#endif
@@ -1,15 +1,19 @@
 #include "unconditioned_cg_solver.h"
+#include "util.h"
 
 #include <iostream>
 
-Uncondioned_CG_Solver::Uncondioned_CG_Solver() {}
+template<class T>
+Uncondioned_CG_SolverT<T>::Uncondioned_CG_SolverT() : precond_mode(PRECOND_MIC0), iterations(0), residual(0.0) {}
 
-Uncondioned_CG_Solver::Uncondioned_CG_Solver(int dimx, int dimy, int dimz)
+template<class T>
+Uncondioned_CG_SolverT<T>::Uncondioned_CG_SolverT(int dimx, int dimy, int dimz) : precond_mode(PRECOND_MIC0), iterations(0), residual(0.0)
 {
 	init(dimx, dimy, dimz);
 }
 
-void Uncondioned_CG_Solver::init(int dimx, int dimy, int dimz)
+template<class T>
+void Uncondioned_CG_SolverT<T>::init(int dimx, int dimy, int dimz)
 {
 	d.init(dimx, dimy, dimz);
 	r.init(dimx, dimy, dimz);
@@ -17,21 +21,46 @@ void Uncondioned_CG_Solver::init(int dimx, int dimy, int dimz)
 	Adj.init(dimx, dimy, dimz);
 }
 
-void Uncondioned_CG_Solver::solve(const Sparse_Matrix &A, const VectorN &b, int maxiterations, double tol, VectorN &pressure, Array3c &marker)
+template<class T>
+void Uncondioned_CG_SolverT<T>::release()
 {
-	b.copy_to(r);
-	double rinfnorm = r.infnorm();
+	d.delete_memory();
+	r.delete_memory();
+	z.delete_memory();
+	Adj.delete_memory();
+}
+
+//----------------------------------------------------------------------------//
+// The solvers only touch the fluid cells during the iterations, so the work 
+// vectors are cleared once per solve to keep the rest of the box at zero.
+//----------------------------------------------------------------------------//
+template<class T>
+void Uncondioned_CG_SolverT<T>::clear_work_vectors()
+{
+	d.zero();
+	z.zero();
+	r.zero();
+	Adj.zero();
+}
+
+template<class T>
+void Uncondioned_CG_SolverT<T>::solve(const Poisson_OperatorT<T> &A, const VectorNT<T> &b, int maxiterations, double tol, VectorNT<T> &pressure, const Fluid_Cells &cells)
+{
+	clear_work_vectors();
+	vectorN_copy(r, b, cells);
+	double rinfnorm = vectorN_infnorm(r, cells);
+	iterations = 0;
+	residual = rinfnorm;
 	if (rinfnorm == 0.0)
 		return;
 
 	tol = tol * rinfnorm;
 
-	double rnorm = vectorN_norm2(r);
+	double rnorm = vectorN_norm2(r, cells);
 	if (rnorm == 0.0)
 		return;
 
-	Adj.zero();
-	b.copy_to(d); // d(0) = r(0) = b
+	vectorN_copy(d, b, cells); // d(0) = r(0) = b
 
 	int i = 0;
 	double rnextnorm = 0;
@@ -39,87 +68,189 @@ void Uncondioned_CG_Solver::solve(const Sparse_Matrix &A, const VectorN &b, int
 	while (true)
 	{
 		// Calc alpha(i): alpha(i) = dot(r, r) / dot(d(i), A * d(i));
-		mtx_mult_vectorN(A, d, Adj, marker);
-
-		alpha = rnorm / vectorN_dot(d, Adj);
+		alpha = rnorm / mtx_mult_vectorN_dot(A, d, Adj, cells);
 
 		// Calc new position x(i + 1): x(i + 1) = x(i) + alpha(i) * d(i);
-		vectorN_add_scale(pressure, d, alpha);
-
 		// Calc new residual r(i + 1) = r(i) - alpha(i) * A * d(i);
-		vectorN_sub_scale(r, Adj, alpha);
+		// in one pass, which also returns the norms of r(i + 1)
+		double rinf = vectorN_update_xr(pressure, d, r, Adj, alpha, cells, &rnextnorm);
 
 		i++; //We have now moved one step
-		if (r.infnorm() <= tol || i == maxiterations)
+		if (rinf <= tol || i == maxiterations)
 		{
+			iterations = i;
+			residual = rinf;
 			std::cout << std::scientific;
 			std::cout << "CG: " << i << " iterations, " << "norm_squared = " << rnextnorm << "\n";
 			return;
 		}
 
 		// Calc beta(i + 1) = dot(r(i + 1), r(i + 1)) / dot(r(i), r(i));
-		// the norm of the new residual
-		rnextnorm = vectorN_norm2(r); //r = r(i+1)
 		beta = rnextnorm / rnorm;
 
 		//Calc new search vector d(i + 1) = r(i + 1) + beta(i + 1) * d(i);
-		vectorN_scale_add(d, r, beta);
+		vectorN_scale_add(d, r, beta, cells);
 		rnorm = rnextnorm;
 	}
 }
 
-void Uncondioned_CG_Solver::apply_precond(const Sparse_Matrix &A, const Sparse_Matrix &precond, const VectorN &r, VectorN &z, const Array3c &marker)
+//----------------------------------------------------------------------------//
+// Forward substitution Lq = r over the fluid run n. a gives the coefficients 
+// of A, p holds the MIC(0) factor of every cell.
+//----------------------------------------------------------------------------//
+template<class T, class C>
+static inline void precond_forward_run(C a, const VectorNT<T> &precond, const VectorNT<T> &r, VectorNT<T> &q, const Fluid_Cells &cells, int run)
 {
-	//Solve Lq = r
+	const int sy = r.dimx, sz = r.dimx * r.dimy;
+	const T *p = precond.data;
 	double t = 0;
-	Adj.zero();
-	for (int k = 1; k < A.dimz - 1; ++k)
-		for (int j = 1; j < A.dimy - 1; ++j)
-			for (int i = 1; i < A.dimx - 1; ++i)
+
+	for (int n = cells.begin[run]; n < cells.end[run]; ++n)
+	{
+		t = r.data[n] - (double)a(n - 1, 1) * p[n - 1] * q.data[n - 1]
+			- (double)a(n - sy, 2) * p[n - sy] * q.data[n - sy]
+			- (double)a(n - sz, 3) * p[n - sz] * q.data[n - sz];
+
+		q.data[n] = (T)(t * p[n]);
+	}
+}
+
+//----------------------------------------------------------------------------//
+// Backward substitution Lt z = q over the fluid run n, walked in reverse
+//----------------------------------------------------------------------------//
+template<class T, class C>
+static inline void precond_backward_run(C a, const VectorNT<T> &precond, const VectorNT<T> &q, VectorNT<T> &z, const Fluid_Cells &cells, int run)
+{
+	const int sy = q.dimx, sz = q.dimx * q.dimy;
+	const T *p = precond.data;
+	double t = 0;
+
+	for (int n = cells.end[run] - 1; n >= cells.begin[run]; --n)
+	{
+		t = q.data[n] - (double)a(n, 1) * p[n] * z.data[n + 1]
+			- (double)a(n, 2) * p[n] * z.data[n + sy]
+			- (double)a(n, 3) * p[n] * z.data[n + sz];
+
+		z.data[n] = (T)(t * p[n]);
+	}
+}
+
+// The sequential sweeps, the runs are stored in sweep order, line by line
+template<class T, class C>
+static void precond_sweeps(C a, const VectorNT<T> &precond, const VectorNT<T> &r, VectorNT<T> &q, VectorNT<T> &z, const Fluid_Cells &cells)
+{
+	//Solve Lq = r
+	for (int run = 0; run < cells.runs(); ++run)
+		precond_forward_run(a, precond, r, q, cells, run);
+
+	//Solve Lt z = q	
+	for (int run = cells.runs() - 1; run >= 0; --run)
+		precond_backward_run(a, precond, q, z, cells, run);
+}
+
+//----------------------------------------------------------------------------//
+// Same MIC(0) application as the sequential sweeps, level scheduled: the i-line 
+// (j, k) only depends on the lines (j - 1, k) and (j, k - 1) in the forward 
+// sweep, so all lines on a diagonal j + k = level are independent and run in 
+// parallel. The backward sweep walks the diagonals in reverse. Every cell is 
+// computed exactly as in the sequential sweeps, so the result is identical.
+//----------------------------------------------------------------------------//
+template<class T, class C>
+static void precond_sweeps_wavefront(C a, const VectorNT<T> &precond, const VectorNT<T> &r, VectorNT<T> &q, VectorNT<T> &z, const Fluid_Cells &cells)
+{
+	int jmax = cells.dimy - 2, kmax = cells.dimz - 2;
+
+#pragma omp parallel
+	{
+		//Solve Lq = r
+		for (int level = 2; level <= jmax + kmax; ++level)
+		{
+			int jlo = max(1, level - kmax), jhi = min(jmax, level - 1);
+#pragma omp for schedule(static)
+			for (int j = jlo; j <= jhi; ++j)
 			{
-				if (marker(i, j, k) == FLUIDCELL)
-				{
-					t = r(i, j, k) - A(i - 1, j, k, 1) * precond(i - 1, j, k, 0) * Adj(i - 1, j, k)
-						- A(i, j - 1, k, 2) * precond(i, j - 1, k, 0) * Adj(i, j - 1, k)
-						- A(i, j, k - 1, 3) * precond(i, j, k - 1, 0) * Adj(i, j, k - 1);
-
-					Adj(i, j, k) = t * precond(i, j, k, 0);
-				}
+				int line = j + cells.dimy * (level - j);
+				for (int run = cells.line_start[line]; run < cells.line_start[line + 1]; ++run)
+					precond_forward_run(a, precond, r, q, cells, run);
 			}
+		}
 
-	//Solve Lt z = q	
-	z.zero();
-	for (int k = A.dimz - 2; k > 0; --k)
-		for (int j = A.dimy - 2; j > 0; --j)
-			for (int i = A.dimx - 2; i > 0; --i)
+		//Solve Lt z = q
+		for (int level = jmax + kmax; level >= 2; --level)
+		{
+			int jlo = max(1, level - kmax), jhi = min(jmax, level - 1);
+#pragma omp for schedule(static)
+			for (int j = jlo; j <= jhi; ++j)
 			{
-				if (marker(i, j, k) == FLUIDCELL)
-				{
-					t = Adj(i, j, k) - A(i, j, k, 1) * precond(i, j, k, 0) * z(i + 1, j, k)
-						- A(i, j, k, 2) * precond(i, j, k, 0) * z(i, j + 1, k)
-						- A(i, j, k, 3) * precond(i, j, k, 0) * z(i, j, k + 1);
-
-					z(i, j, k) = t * precond(i, j, k, 0);
-				}
+				int line = j + cells.dimy * (level - j);
+				for (int run = cells.line_start[line + 1] - 1; run >= cells.line_start[line]; --run)
+					precond_backward_run(a, precond, q, z, cells, run);
 			}
+		}
+	}
 }
 
-
-void Uncondioned_CG_Solver::solve_precond(const Sparse_Matrix &A, const VectorN &b, const Sparse_Matrix &precond, int maxiterations, double tol, VectorN &pressure, Array3c &marker)
+template<class T>
+void Uncondioned_CG_SolverT<T>::apply_precond(const Poisson_OperatorT<T> &A, const VectorNT<T> &precond, const VectorNT<T> &r, VectorNT<T> &z, const Fluid_Cells &cells)
 {
-	b.copy_to(r);
-	double rinfnorm = r.infnorm();
-	if (rinfnorm == 0.0)
+	if (precond_mode == PRECOND_MIC0_WAVEFRONT)
+	{
+		apply_precond_wavefront(A, precond, r, z, cells);
 		return;
+	}
 
-	tol = tol * rinfnorm;
-	pressure.zero();
+	if (precond_mode == PRECOND_MULTIGRID)
+	{
+		mg.apply(r, z);
+		return;
+	}
+
+	if (A.matrix)
+		precond_sweeps(A.matrix_coefficients(), precond, r, Adj, z, cells);
+	else
+		precond_sweeps(A.stencil_coefficients(), precond, r, Adj, z, cells);
+}
+
+template<class T>
+void Uncondioned_CG_SolverT<T>::apply_precond_wavefront(const Poisson_OperatorT<T> &A, const VectorNT<T> &precond, const VectorNT<T> &r, VectorNT<T> &z, const Fluid_Cells &cells)
+{
+	if (A.matrix)
+		precond_sweeps_wavefront(A.matrix_coefficients(), precond, r, Adj, z, cells);
+	else
+		precond_sweeps_wavefront(A.stencil_coefficients(), precond, r, Adj, z, cells);
+}
+
+template<class T>
+void Uncondioned_CG_SolverT<T>::solve_precond(const Poisson_OperatorT<T> &A, const VectorNT<T> &b, const VectorNT<T> &precond, int maxiterations, double tol, double abstol,
+	VectorNT<T> &pressure, const Fluid_Cells &cells, bool warm_start)
+{
+	clear_work_vectors();
+	vectorN_copy(r, b, cells);
+	double binfnorm = vectorN_infnorm(r, cells);
+	double rinfnorm = binfnorm;
+	if (warm_start)
+	{
+		// r(0) = b - A * pressure
+		mtx_mult_vectorN(A, pressure, Adj, cells);
+		vectorN_sub_scale(r, Adj, 1.0, cells);
+		rinfnorm = vectorN_infnorm(r, cells);
+	}
+	else
+		pressure.zero();
+
+	iterations = 0;
+	residual = rinfnorm;
+	history.assign(1, rinfnorm);
+
+	tol = max(tol * binfnorm, abstol);
+	if (rinfnorm <= tol)
+		return;
 
 	// z(0) = precond * r0
-	apply_precond(A, precond, r, z, marker);
-	z.copy_to(d); // d(0) = r(0) = b
+	apply_precond(A, precond, r, z, cells);
+	vectorN_copy(d, z, cells); // d(0) = z(0)
 
-	double rznorm = vectorN_dot(z, r);
+	double rznorm = vectorN_dot(z, r, cells);
 	if (rznorm == 0.0)
 		return;
 
@@ -128,30 +259,34 @@ void Uncondioned_CG_Solver::solve_precond(const Sparse_Matrix &A, const VectorN
 
 	while (true)
 	{
-		mtx_mult_vectorN(A, d, z, marker);
-		alpha = rznorm / vectorN_dot(d, z);
+		alpha = rznorm / mtx_mult_vectorN_dot(A, d, z, cells);
 
 		// Calc new position x(i + 1): x(i + 1) = x(i) + alpha(i) * d(i);
-		vectorN_add_scale(pressure, d, alpha);
-
 		// Calc new residual r(i + 1) = r(i) - alpha(i) * A * d(i);
-		vectorN_sub_scale(r, z, alpha);
+		// in one pass, which also returns the infinity norm of r(i + 1)
+		double rinf = vectorN_update_xr(pressure, d, r, z, alpha, cells, NULL);
+		history.push_back(rinf);
 
 		i++; // We have now moved one step
-		if (r.infnorm() <= tol || i == maxiterations)
+		if (rinf <= tol || i == maxiterations)
 		{
+			iterations = i;
+			residual = rinf;
 			return;
 		}
 
-		apply_precond(A, precond, r, z, marker);
+		apply_precond(A, precond, r, z, cells);
 
 		// Calc beta(i+1) = dot(r(i + 1), r(i + 1)) / dot(r(i), r(i));
 		// the norm of the new residual
-		rznextnorm = vectorN_dot(r, z); //r = r(i + 1)
+		rznextnorm = vectorN_dot(r, z, cells); //r = r(i + 1)
 		beta = rznextnorm / rznorm;
 
 		// Calc new search vector d(i + 1) = r(i + 1) + beta(i + 1) * d(i);
-		vectorN_scale_add(d, z, beta);
+		vectorN_scale_add(d, z, beta, cells);
 		rznorm = rznextnorm;
 	}
 }
+
+template struct Uncondioned_CG_SolverT<double>;
+template struct Uncondioned_CG_SolverT<float>;
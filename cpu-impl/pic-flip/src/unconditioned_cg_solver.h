@@ -3,29 +3,55 @@
 #define UNCONDITIONED_CG_SOLVER_H_
 
 #include "sparse_matrix.h"
+#include "multigrid.h"
 #include "array3d.h"
 #include <cmath>
+#include <vector>
 
 #define AIRCELL 0
 #define FLUIDCELL 1
 #define SOLIDCELL 2
 
-struct Uncondioned_CG_Solver
+// How apply_precond applies the MIC(0) preconditioner
+#define PRECOND_MIC0 0 // Sequential forward and backward sweeps
+#define PRECOND_MIC0_WAVEFRONT 1 // Sweeps parallelized over j + k diagonals of i-lines
+#define PRECOND_MULTIGRID 2 // Geometric multigrid V-cycle (MGPCG)
+
+//----------------------------------------------------------------------------//
+// Preconditioned CG on the fluid cells. T is the storage precision of the 
+// system, reductions are always done in double.
+//----------------------------------------------------------------------------//
+template<class T>
+struct Uncondioned_CG_SolverT
 {
-	VectorN d; // Search vector
-	VectorN z;
-	VectorN r;
-	VectorN Adj;
+	VectorNT<T> d; // Search vector
+	VectorNT<T> z;
+	VectorNT<T> r;
+	VectorNT<T> Adj;
 	double beta, alpha;
+	int precond_mode;
+	int iterations; // Iterations of the last solve
+	double residual; // Infinity norm of the residual after the last solve
+	std::vector<double> history; // Infinity norm of the residual before and after every iteration of the last solve
+	Multigrid_PreconditionerT<T> mg; // Used when precond_mode is PRECOND_MULTIGRID
 		
-	Uncondioned_CG_Solver();
-	Uncondioned_CG_Solver(int dimx, int dimy, int dimz);
+	Uncondioned_CG_SolverT();
+	Uncondioned_CG_SolverT(int dimx, int dimy, int dimz);
 
 	void init(int dimx, int dimy, int dimz);
+	void release();
 
-	void apply_precond(const Sparse_Matrix & A, const Sparse_Matrix & precond,const VectorN &r, VectorN &z,const Array3c & marker);
-	void solve(const Sparse_Matrix & A,const VectorN & b,int maxiterations, double tol, VectorN & x, Array3c & marker);
-	void solve_precond(const Sparse_Matrix & A,const VectorN & b,const Sparse_Matrix & precond,int maxiterations, double tol, VectorN & pressure, Array3c &marker);
+	void clear_work_vectors();
+	void apply_precond(const Poisson_OperatorT<T> & A, const VectorNT<T> & precond,const VectorNT<T> &r, VectorNT<T> &z,const Fluid_Cells & cells);
+	void apply_precond_wavefront(const Poisson_OperatorT<T> & A, const VectorNT<T> & precond,const VectorNT<T> &r, VectorNT<T> &z,const Fluid_Cells & cells);
+	void solve(const Poisson_OperatorT<T> & A,const VectorNT<T> & b,int maxiterations, double tol, VectorNT<T> & x, const Fluid_Cells & cells);
+	// Stops when the residual is within tol times that of b or within abstol. 
+	// A warm start continues from the given pressure instead of 0.
+	void solve_precond(const Poisson_OperatorT<T> & A,const VectorNT<T> & b,const VectorNT<T> & precond,int maxiterations, double tol, double abstol,
+		VectorNT<T> & pressure, const Fluid_Cells & cells, bool warm_start);
 };
 
+typedef Uncondioned_CG_SolverT<double> Uncondioned_CG_Solver;
+typedef Uncondioned_CG_SolverT<float> Uncondioned_CG_Solverf;
+
 #endif
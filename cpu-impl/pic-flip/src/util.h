@@ -41,3 +41,36 @@ template<class T> inline void clamp(T & toclamp, T minval, T maxval)
 {
 	toclamp = min(maxval, max(toclamp, minval));
 }
+
+//----------------------------------------------------------------------------//
+// PCG32 random numbers. Unlike the state of rand() the state is two plain 
+// integers, so it can be stored in a checkpoint and restored exactly, and the 
+// sequence is the same on every platform.
+//----------------------------------------------------------------------------//
+struct Random
+{
+	unsigned long long state, inc;
+
+	Random() { seed(0); }
+
+	void seed(unsigned long long s)
+	{
+		state = 0;
+		inc = (54ULL << 1) | 1;
+		next();
+		state += s;
+		next();
+	}
+
+	unsigned int next()
+	{
+		unsigned long long old = state;
+		state = old * 6364136223846793005ULL + inc;
+		unsigned int xorshifted = (unsigned int)(((old >> 18) ^ old) >> 27);
+		unsigned int rot = (unsigned int)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	// Uniform in [0, 1)
+	float uniform() { return (float)(next() >> 8) * (1.0f / 16777216.0f); }
+};
@@ -59,7 +59,7 @@ float mag2(const vec3f &a)
 
 float mag(const vec3f &a)
 {
-	return std::sqrtf(mag2(a));
+	return sqrtf(mag2(a));
 }
 
 float dist2(const vec3f &a, const vec3f &b)